@@ -75,6 +75,13 @@ void arch_config_fp_csr_for_local(arch_fp_csr_t *old);
 // Implementation should be able to tell us if any special exception
 // (other than the fenv ones) has been noted.  For example FE_DENORM
 int arch_have_special_fp_csr_exception(int which);
+// ... and the same for the FP state captured in a context, e.g., at a trap
+int arch_have_special_fp_csr_exception_in_context(const ucontext_t *uc, int which);
+
+// Implementation must tell us which FP exceptions have been noted
+// in the FP state captured in a context, as FE_* values plus FE_DENORM
+// if supported.  These are the ones arch_clear_fp_exceptions() clears
+int arch_get_fp_exceptions_in_context(const ucontext_t *uc);
 
 // Implementation must let us dump FP and GP control/status regs
 // and should dump them using the DEBUG() macro
@@ -94,7 +101,9 @@ void arch_dump_fp_csr(const char *pre, const ucontext_t *uc);
 // If state==NULL, then the implementation should do the best it can
 // If this happens, it is because of a surprise abort in FPSpy in which
 // we cannot find the monitoring context of the thread.
-void arch_set_trap_mode(ucontext_t *uc, uint64_t *state);
+// Returns nonzero if the trap cannot be arranged (e.g., a breakpoint
+// cannot be written), in which case the ucontext is left as it was.
+int arch_set_trap_mode(ucontext_t *uc, uint64_t *state);
 // disable trap mode for the *current* instruction
 void arch_reset_trap_mode(ucontext_t *uc, uint64_t *state);
 
@@ -137,6 +146,14 @@ uint64_t arch_get_sp(const ucontext_t *uc);
 // then return the number of number of bytes read, or negative on error
 int arch_get_instr_bytes(const ucontext_t *uc, uint8_t *dest, int size);
 
+// Implementation may be able to complete the current (trapping)
+// instruction on our behalf, with all traps masked, updating the
+// register state in the ucontext and advancing the instruction pointer.
+// Returns zero on success, in which case no trap mode is needed to
+// get past the instruction.   Returns nonzero if the instruction cannot
+// be emulated, in which case the ucontext is unchanged.
+int arch_emulate_instruction(ucontext_t *uc);
+
 
 // Implementation is initialized at start of process.  It can
 // veto by returning non-zero.   Implementation is also
@@ -147,6 +164,14 @@ void arch_process_deinit(void);
 int arch_thread_init(ucontext_t *uc);  // uc can be null (for aggregate mode)
 void arch_thread_deinit(void);
 
+// Implementation may be able to bring up the running thread directly,
+// doing to the machine state what a trap in INIT state does to the
+// ucontext: arch_thread_init(), clear the FP exceptions, unmask the FP
+// traps, and install *round_config if it is non-null.  *state is left
+// as arch_reset_trap_mode() would leave it.   Returns nonzero if this
+// is not possible, in which case the thread must kick itself instead.
+int arch_thread_init_direct(const fpspy_round_config_t *round_config, uint64_t *state);
+
 #endif
 
 #endif
@@ -171,11 +171,13 @@ void arch_config_machine_fp_csr_for_local(arch_fp_csr_t *old);
 
 // detects only FE_DENORM (within the HW state)
 int arch_have_special_fp_csr_exception(int which);
+int arch_have_special_fp_csr_exception_in_context(const ucontext_t *uc, int which);
+int arch_get_fp_exceptions_in_context(const ucontext_t *uc);
 
 void arch_dump_gp_csr(const char *pre, const ucontext_t *uc);
 void arch_dump_fp_csr(const char *pre, const ucontext_t *uc);
 
-void arch_set_trap_mode(ucontext_t *uc, uint64_t *state);
+int arch_set_trap_mode(ucontext_t *uc, uint64_t *state);
 void arch_reset_trap_mode(ucontext_t *uc, uint64_t *state);
 
 void arch_clear_fp_exceptions(ucontext_t *uc);
@@ -202,12 +204,15 @@ uint64_t arch_get_sp(const ucontext_t *uc);
 
 int arch_get_instr_bytes(const ucontext_t *uc, uint8_t *dest, int size);
 
+int arch_emulate_instruction(ucontext_t *uc);
+
 
 int arch_process_init(void);
 void arch_process_deinit(void);
 
 int arch_thread_init(ucontext_t *uc);
 void arch_thread_deinit(void);
+int arch_thread_init_direct(const fpspy_round_config_t *round_config, uint64_t *state);
 
 
 #endif
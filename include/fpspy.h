@@ -11,12 +11,17 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "trace_record.h"
+#include "trace_codec.h"
+#include "trace_lz.h"
 
 void fp_trap_handler(siginfo_t *si, ucontext_t *uc);
 void brk_trap_handler(siginfo_t *si, ucontext_t *uc);
 void abort_operation(char *reason);
+// for backends that insert breakpoints into the code
+int make_code_writeable(void *addr, size_t len);
 
 // State of our internal random number generator
 // In typical use, there will be one of these per thread
@@ -35,22 +40,180 @@ typedef struct sampler_state {
   rand_state_t rand;
   uint64_t on_mean_us;
   uint64_t off_mean_us;
-  struct itimerval it;
+  uint64_t forced_off_us;  // if nonzero, next ON->OFF is for this long (governor)
+  int have_timer;
+  timer_t timer;           // signals only this thread
+  struct itimerspec it;
 } sampler_state_t;
 
+// State of the overhead governor, one per thread if it is in use
+// (FPSPY_OVERHEAD_BUDGET).   See "Overhead governor" in fpspy.c
+typedef struct governor_state {
+  uint32_t level;            // 0 => always on, L => off for 2^(L-1) windows per window on
+  uint64_t window_start;     // cycles when the current window started
+  uint64_t handler_cycles;   // spent in handlers since then
+  uint64_t deadline_ns;      // CLOCK_MONOTONIC at which the window is evaluated
+  uint64_t overhead;         // of the last window evaluated, parts per million
+  uint64_t changes;          // of level
+  uint64_t offs;             // times the governor switched the thread off
+} governor_state_t;
+
+// A thread's entry in the aggregate roll-up's per-thread breakdown
+// (FPSPY_AGGREGATE_THREADS).   tid is set last, so 0 => being filled in
+typedef struct aggregate_thread {
+  int tid;
+  int flags;  // FE_* (and FE_DENORM), -1 => aborted
+} aggregate_thread_t;
+
+// A poll of a thread's sticky FP flags (aggregate mode, FPSPY_POLL)
+// that found some set
+typedef struct poll_record {
+  uint64_t poll;   // which poll of the thread this was
+  uint64_t time;   // cycles from start of monitoring
+  uint64_t ip;     // where the thread was interrupted
+  uint32_t flags;  // FE_* (and FE_DENORM) set since the previous poll
+} poll_record_t;
+
+#define POLL_BUFLEN 256  // records the ring holds
+
+// Per-thread state for polling (aggregate mode, FPSPY_POLL).
+// Touched only by the owning thread, mostly in its timer handler,
+// except that record is a ring the handler publishes into and the
+// writer thread drains, as with trace records (thread output)
+typedef struct poller {
+  size_t alloc_len;
+  int have_timer;
+  timer_t timer;    // periodic, signals only this thread
+  uint32_t flags;   // all those seen so far
+  uint64_t polls;   // taken
+  uint64_t dropped; // records dropped on a full ring
+  uint64_t head __attribute__((aligned(64)));  // records produced
+  uint64_t tail __attribute__((aligned(64)));  // records consumed
+  poll_record_t record[POLL_BUFLEN];
+} poller_t;
+
+// Per-site statistics, one per distinct instruction that has
+// caused an FP trap.   Used in sites mode, and in individual mode
+// when throttling per site.
+#define SITE_CODES 16  // si_codes tracked individually, others are counted in 0
+typedef struct site {
+  void *rip;  // 0 => unused
+  uint64_t first_time;
+  uint64_t last_time;
+  uint64_t count;
+  uint64_t code_count[SITE_CODES];
+  uint8_t instruction[MAX_INSTR_SIZE];
+  uint8_t instruction_len;
+  // per-site throttling (individual mode)
+  uint64_t recorded;     // events recorded
+  uint64_t next_record;  // count at which the next event is recorded
+  uint64_t gap;          // between recorded events
+  uint64_t at_gap;       // events recorded at this gap
+} site_t;
+
+// Per-thread open-addressed table of sites, keyed by rip
+// Only the owning thread touches it
+typedef struct site_table {
+  size_t alloc_len;
+  uint64_t size;   // power of two
+  uint64_t count;  // number of sites in use
+  site_t site[];
+} site_table_t;
+
+// Per-thread dictionary of trapping instructions (individual mode,
+// v2 format), so that a record need only carry an index.   Entries
+// are added only by the owning thread and never move or go away while
+// the thread is monitored, so the writer thread can read any entry a
+// record it has been handed refers to.   The table does not grow;
+// once it is full, records carry their instruction bytes as before.
+typedef struct instr_dict {
+  size_t alloc_len;
+  uint32_t size;      // hash slots, power of two
+  uint32_t capacity;  // entries, 3/4 of size
+  uint32_t count;     // entries in use
+  uint32_t *slot;     // entry index + 1, 0 => empty
+  trace_instr_t entry[];
+} instr_dict_t;
+
+// Per-thread state for writing a trace file in compressed blocks
+// (thread output, FPSPY_COMPRESS).   Touched only by whoever is
+// draining the thread's ring, under the writer lock.
+typedef struct trace_blocker {
+  size_t alloc_len;
+  uint32_t size;                 // capacity of raw
+  uint32_t raw_len;              // bytes of encoded records in raw
+  uint64_t record_count;         // records in raw
+  uint64_t first_time;
+  uint64_t last_time;
+  trace_block_index_t *index;    // one entry per block written
+  size_t index_alloc_len;
+  uint64_t index_count;
+  uint32_t hash[TRACE_LZ_HASH_SIZE];  // compressor scratch
+  uint8_t *stored;               // compressor output, after raw
+  uint8_t raw[];
+} trace_blocker_t;
+
+// Staging of a thread's trace bytes until they are appended to the
+// process's container file as a chunk (FPSPY_CONTAINER).   The chunk
+// header is assembled in front of the data, so a chunk goes out in
+// one write.   Touched only under the writer lock, or by the thread
+// itself before it can have produced any records.
+typedef struct trace_chunker {
+  size_t alloc_len;
+  uint32_t size;    // capacity of data
+  uint32_t len;     // bytes staged in data
+  uint64_t offset;  // where data goes in the thread's trace
+  trace_chunk_header_t header;
+  uint8_t data[];
+} trace_chunker_t;
+
 // State used to monitor a thread
+// Contexts are allocated by the thread they monitor, with the
+// trace buffer allocated along with them
 typedef struct monitoring_context {
+  size_t alloc_len;     // size of this context plus its trace buffer
   uint64_t start_time;  // cycles when context created
   enum { INIT, AWAIT_FPE, AWAIT_TRAP, ABORT } state;
   int aborting_in_trap;
   int tid;
   int fd;
+  int closed;           // files taken over at process exit, thread still running
+  int recording;        // thread is touching its files or sites (see begin_recording())
   uint64_t count;
   uint64_t trap_mode_state;      // for use by the architectural trap mode mechanism
   sampler_state_t sampler;  // used only when sampling is on
-  // for buffering of trace records
+  governor_state_t governor;  // used only when there is an overhead budget
+  site_table_t *sites;      // used only in sites mode, or when throttling per site
+  int sites_fd;             // where sites are written when throttling per site
+  instr_dict_t *instrs;     // used only in individual mode with the v2 format
+  trace_blocker_t *blocks;  // used only when compressing
+  trace_chunker_t *chunks;  // used only when writing to a container
+  poller_t *poller;         // used only in aggregate mode, when polling
+  void *kring;              // used only when the kernel module records events
+  size_t kring_len;         // (an fpvm_ring_t, mapped from the module)
+  // what has gone into the trace file, and how
+  trace_file_header_t trace_header;  // as of when the file was opened
+  trace_codec_state_t codec;         // delta encoding state
+  uint64_t records_written;
+  uint64_t bytes_written;
+  // events seen and recorded, by class (TRACE_SAMPLE_*)
+  uint64_t sample_seen[TRACE_SAMPLE_CLASSES];
+  uint64_t sample_recorded[TRACE_SAMPLE_CLASSES];
+  // for buffering of trace records (inline output)
   uint64_t trace_record_count;
-  individual_trace_record_t trace_records[CONFIG_TRACE_BUFLEN];
+  // for handing trace records to the writer thread (thread output)
+  // trace_records is then a ring written only by the thread
+  // and read only by the writer, so the indices get their own lines
+  uint64_t ring_head __attribute__((aligned(64)));  // records produced
+  uint64_t dropped;                                 // records dropped on a full ring
+  uint32_t ring_waiting;                            // producer is blocked on a full ring
+  uint64_t ring_tail __attribute__((aligned(64)));  // records consumed
+  uint32_t ring_seq;                                // bumped as the tail moves (futex)
+  // for storing trace records straight into the trace file (mmap output)
+  trace_file_header_t *header;  // start of the file, always mapped
+  uint8_t *window;              // chunk of the file records are going to
+  uint64_t window_offset;       // file offset of that chunk
+  individual_trace_record_t trace_records[] __attribute__((aligned(64)));
 } monitoring_context_t;
 
 monitoring_context_t *find_monitoring_context(int tid);
@@ -11,19 +11,153 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "trace_record.h"
+#include "trace_codec.h"
 
 typedef struct trace {
   uint64_t numrecs;
   individual_trace_record_t *rec;
   int fd;
+  void *map;         // the whole file
+  uint64_t map_len;
+  trace_file_header_t *header;  // 0 if the file has none
+  uint32_t version;             // 0 if the file has no header
+  uint32_t record_format;       // TRACE_RECORD_*
+  individual_trace_record_t *decoded;  // rec, if it had to be decoded
+  uint64_t decoded_size;
+  trace_block_index_t *blocks;  // TRACE_FILE_BLOCKS: where the blocks are
+  uint64_t numblocks;
+  trace_block_index_t *scanned_blocks;  // blocks, if the file had no index
+  uint8_t *raw;                         // for decompressing a block
+  uint64_t raw_size;
+  uint8_t *stream;  // map, if the trace was assembled from a container
+  const uint8_t *data;  // TRACE_RECORD_DELTA without blocks: the records
+  uint64_t data_len;
 } trace_t;
 
+typedef struct trace_container_thread {
+  uint32_t tid;
+  uint64_t len;        // of its trace
+  uint64_t numchunks;
+  uint64_t *chunks;    // file offsets of its chunks, in order
+  uint64_t size;       // of chunks
+} trace_container_thread_t;
+
+typedef struct trace_container {
+  int fd;
+  void *map;  // the whole file
+  uint64_t map_len;
+  trace_container_header_t *header;
+  uint64_t numthreads;
+  trace_container_thread_t *threads;  // in the order their traces begin
+  uint64_t size;                      // of threads
+} trace_container_t;
+
+// Files with a header (trace_file_header_t) are handled transparently,
+// including partially written ones, of which only the committed records
+// are visible.   Delta encoded records are decoded on attach, so
+// rec is always an array of fixed size records.   Fields of the header
+// beyond the version 1 header are valid only if version >= 2
+
 trace_t *trace_attach(char *file);
 void trace_detach(trace_t *trace);
 
+// Block compressed files (TRACE_FILE_BLOCKS) can instead be attached
+// without decoding anything, and then decoded a block at a time,
+// the loaded block becoming rec/numrecs.  Blocks are in time order.
+// Any other file appears as a single block, already loaded.
+trace_t *trace_attach_blocks(char *file);
+uint64_t trace_num_blocks(trace_t *trace);
+int trace_load_block(trace_t *trace, uint64_t block);
+// first block that may hold records at or after time
+uint64_t trace_find_block(trace_t *trace, uint64_t time);
+
 int trace_map(char *file, void (*filter)(individual_trace_record_t *, void *), void *);
 
+// only records with start <= time <= end, decoding only the blocks
+// that may hold them
+int trace_map_range(char *file, uint64_t start, uint64_t end,
+    void (*filter)(individual_trace_record_t *, void *), void *);
+
+int trace_print_header(trace_t *trace, FILE *dest);
+
+// A merge yields the records of many traces (files, or all the threads
+// of containers) in global time order, each tagged with where it came
+// from.   Times are put on CLOCK_MONOTONIC using the anchor in each
+// trace's header, so the traces must have version 2 headers.   Traces
+// are decoded as the merge goes, so memory does not grow with the
+// length of trace files, but the threads of containers are each
+// loaded in full.   A record stays valid until the next call to
+// trace_merge_next(), which returns 1 for a record, 0 at the end,
+// and -1 on error.
+typedef struct trace_merge_input {
+  trace_t *trace;  // attached without decoding
+  uint64_t order;  // in which it was added, to break ties
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t start_ns;  // CLOCK_MONOTONIC when record time is 0
+  uint64_t freq;      // cycles per second of record times
+  uint64_t block;     // next block to load, if in blocks
+  uint64_t next;      // next record in trace->rec, if fixed or in blocks
+  const uint8_t *data;  // next record, if delta encoded without blocks
+  const uint8_t *end;
+  trace_codec_state_t codec;
+  trace_decode_dict_t dict;
+  individual_trace_record_t rec;  // the current record
+  uint64_t time_ns;               // and its time on CLOCK_MONOTONIC
+} trace_merge_input_t;
+
+typedef struct trace_merge {
+  uint64_t num;
+  uint64_t size;
+  trace_merge_input_t **inputs;
+  uint64_t heap_len;
+  trace_merge_input_t **heap;     // inputs that are not done, earliest first
+  trace_merge_input_t *current;   // whose record was handed out last
+  int started;
+} trace_merge_t;
+
+typedef struct trace_merge_record {
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t time_ns;  // CLOCK_MONOTONIC
+  individual_trace_record_t *rec;
+} trace_merge_record_t;
+
+trace_merge_t *trace_merge_open(void);
+int trace_merge_add_file(trace_merge_t *m, char *file);  // before the first trace_merge_next()
+int trace_merge_next(trace_merge_t *m, trace_merge_record_t *r);
+void trace_merge_close(trace_merge_t *m);
+
+int trace_merge_map(char **files, int n, void (*filter)(trace_merge_record_t *, void *), void *);
+
+// Container files (FPSPY_CONTAINER) hold the traces of all the threads
+// of a process.   The threads can be enumerated, and the trace of each
+// attached as if it were its own file (and detached with trace_detach)
+int trace_is_container(char *file);
+trace_container_t *trace_container_attach(char *file);
+void trace_container_detach(trace_container_t *c);
+uint64_t trace_container_num_threads(trace_container_t *c);
+int trace_container_tid(trace_container_t *c, uint64_t i);  // -1 if no such thread
+trace_t *trace_container_attach_thread(trace_container_t *c, int tid);
+trace_t *trace_container_attach_thread_blocks(trace_container_t *c, int tid);
+// the thread's trace as a standalone trace file
+int trace_container_write_thread(trace_container_t *c, int tid, FILE *dest);
+
+// tid = 0 => all threads, one after another
+int trace_container_map(char *file, int tid,
+    void (*filter)(int tid, individual_trace_record_t *, void *), void *);
+int trace_container_print_header(trace_container_t *c, FILE *dest);
+
 // select = 0 => all
 int trace_print(char *file, FILE *dest, int (*select)(individual_trace_record_t *));
+int trace_print_range(char *file, uint64_t start, uint64_t end, FILE *dest,
+    int (*select)(individual_trace_record_t *));
+// records of all the files, in time order, each prefixed by pid, tid,
+// and time on CLOCK_MONOTONIC (ns)
+int trace_print_merged(char **files, int n, FILE *dest,
+    int (*select)(individual_trace_record_t *));
+// tid = 0 => all threads, one after another
+int trace_print_container(char *file, int tid, FILE *dest,
+    int (*select)(individual_trace_record_t *));
 
 #endif
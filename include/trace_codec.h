@@ -0,0 +1,355 @@
+//  Part of FPSpy
+//
+//  Preload library with floating point exception interception
+//  aggregation via FPE sticky behavior and trap-and-emulate
+//
+//  Copyright (c) 2018 Peter A. Dinda - see LICENSE
+
+#ifndef __TRACE_CODEC
+#define __TRACE_CODEC
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace_record.h"
+
+//
+// Delta encoding of trace records (TRACE_RECORD_DELTA)
+//
+// Each record is a tag byte followed by LEB128 varints.   Signed
+// quantities are zigzag encoded.   Fields are relative to the previous
+// record in the stream, so a decoder must see the stream from its start
+// (or from wherever the encoder's state was last reset).
+//
+//   EVENT:  tag  time-delta  rip-delta  rsp-delta  code  csr-xor  len  instruction[len]
+//   ABORT:  tag  time-delta
+//   INSTR:  tag  index  rip  len  instruction[len]
+//   REF:    tag  time-delta  index  rsp-delta  code  csr-xor
+//   GOVERN: tag  time-delta  overhead  level
+//
+// Trailing zero instruction bytes are not stored.
+//
+// INSTR defines an entry of the stream's instruction dictionary, and
+// a REF is an EVENT whose rip and instruction are those of a dictionary
+// entry.   The encoder writes an INSTR just ahead of the first REF to
+// each entry, and the decoder treats the pair as one record.
+//
+
+#define TRACE_TAG_EVENT  0x01
+#define TRACE_TAG_ABORT  0x02
+#define TRACE_TAG_INSTR  0x03
+#define TRACE_TAG_REF    0x04
+#define TRACE_TAG_GOVERN 0x05
+
+// largest possible encoding of one record (INSTR + REF)
+#define TRACE_MAX_ENCODED ((1 + 10 + 10 + 1 + MAX_INSTR_SIZE) + (1 + 10 + 10 + 10 + 10 + 10))
+
+// decoders refuse dictionaries larger than this
+#define TRACE_MAX_DICT (1 << 24)
+
+// An instruction dictionary entry
+typedef struct trace_instr {
+  uint64_t rip;     // 0 => unused
+  uint8_t len;      // of bytes
+  uint8_t emitted;  // encoder has written the INSTR for it
+  uint8_t bytes[MAX_INSTR_SIZE];
+} trace_instr_t;
+
+// Before it is encoded, a record can refer to an instruction
+// dictionary entry instead of carrying the instruction bytes.  Such a
+// record has pad == TRACE_PAD_INDEXED, and the index in instruction[]
+#define TRACE_PAD_INDEXED 0x1
+
+static inline void trace_record_set_index(individual_trace_record_t *r, uint32_t index) {
+  memcpy(r->instruction, &index, sizeof(index));
+  r->pad = TRACE_PAD_INDEXED;
+}
+
+static inline uint32_t trace_record_index(const individual_trace_record_t *r) {
+  uint32_t index;
+  memcpy(&index, r->instruction, sizeof(index));
+  return index;
+}
+
+// A decoder's copy of the dictionary, which grows as needed
+typedef struct trace_decode_dict {
+  uint32_t size;
+  trace_instr_t *entry;
+} trace_decode_dict_t;
+
+typedef struct trace_codec_state {
+  uint64_t time;
+  uint64_t rip;
+  uint64_t rsp;
+  uint64_t csr;
+} trace_codec_state_t;
+
+static inline void trace_codec_reset(trace_codec_state_t *s) { memset(s, 0, sizeof(*s)); }
+
+static inline uint8_t *trace_put_varint(uint8_t *p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = (uint8_t)v | 0x80;
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+// returns 0 if the varint runs past end
+static inline const uint8_t *trace_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+  uint64_t x = 0;
+  int shift = 0;
+
+  while (p < end && shift < 64) {
+    x |= (uint64_t)(*p & 0x7f) << shift;
+    if (!(*p++ & 0x80)) {
+      *v = x;
+      return p;
+    }
+    shift += 7;
+  }
+  return 0;
+}
+
+static inline uint64_t trace_zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+
+static inline int64_t trace_unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+static inline int trace_record_is_abort(const individual_trace_record_t *r) {
+  return r->code == TRACE_CODE_ABORT && (uint64_t)r->rip == (uint64_t)-1;
+}
+
+static inline int trace_record_is_govern(const individual_trace_record_t *r) {
+  return r->code == TRACE_CODE_GOVERN && (uint64_t)r->rip == (uint64_t)-1;
+}
+
+// returns the number of bytes written to out (at most TRACE_MAX_ENCODED)
+// dict holds the entries indexed records refer to, and may be 0 if
+// there are none
+static inline int trace_encode_record(trace_codec_state_t *s, trace_instr_t *dict,
+    const individual_trace_record_t *r, uint8_t *out) {
+  uint8_t *p = out;
+  int len;
+
+  if (trace_record_is_abort(r)) {
+    *p++ = TRACE_TAG_ABORT;
+    p = trace_put_varint(p, trace_zigzag((int64_t)(r->time - s->time)));
+    s->time = r->time;
+    return p - out;
+  }
+
+  if (trace_record_is_govern(r)) {
+    *p++ = TRACE_TAG_GOVERN;
+    p = trace_put_varint(p, trace_zigzag((int64_t)(r->time - s->time)));
+    p = trace_put_varint(p, (uint64_t)r->rsp);
+    p = trace_put_varint(p, (uint32_t)r->mxcsr);
+    s->time = r->time;
+    return p - out;
+  }
+
+  if (r->pad == TRACE_PAD_INDEXED) {
+    uint32_t index = trace_record_index(r);
+    trace_instr_t *e = &dict[index];
+
+    if (!e->emitted) {
+      *p++ = TRACE_TAG_INSTR;
+      p = trace_put_varint(p, index);
+      p = trace_put_varint(p, e->rip);
+      *p++ = e->len;
+      memcpy(p, e->bytes, e->len);
+      p += e->len;
+      e->emitted = 1;
+    }
+
+    *p++ = TRACE_TAG_REF;
+    p = trace_put_varint(p, trace_zigzag((int64_t)(r->time - s->time)));
+    p = trace_put_varint(p, index);
+    p = trace_put_varint(p, trace_zigzag((int64_t)((uint64_t)r->rsp - s->rsp)));
+    p = trace_put_varint(p, trace_zigzag(r->code));
+    p = trace_put_varint(p, (uint32_t)r->mxcsr ^ s->csr);
+
+    s->time = r->time;
+    s->rip = e->rip;
+    s->rsp = (uint64_t)r->rsp;
+    s->csr = (uint32_t)r->mxcsr;
+
+    return p - out;
+  }
+
+  for (len = MAX_INSTR_SIZE; len > 0 && !r->instruction[len - 1]; len--) {
+  }
+
+  *p++ = TRACE_TAG_EVENT;
+  p = trace_put_varint(p, trace_zigzag((int64_t)(r->time - s->time)));
+  p = trace_put_varint(p, trace_zigzag((int64_t)((uint64_t)r->rip - s->rip)));
+  p = trace_put_varint(p, trace_zigzag((int64_t)((uint64_t)r->rsp - s->rsp)));
+  p = trace_put_varint(p, trace_zigzag(r->code));
+  p = trace_put_varint(p, (uint32_t)r->mxcsr ^ s->csr);
+  *p++ = len;
+  memcpy(p, r->instruction, len);
+  p += len;
+
+  s->time = r->time;
+  s->rip = (uint64_t)r->rip;
+  s->rsp = (uint64_t)r->rsp;
+  s->csr = (uint32_t)r->mxcsr;
+
+  return p - out;
+}
+
+// store an INSTR's entry in the decoder's dictionary
+static inline int trace_decode_dict_store(
+    trace_decode_dict_t *d, uint64_t index, uint64_t rip, const uint8_t *bytes, int len) {
+  if (index >= TRACE_MAX_DICT) {
+    return -1;
+  }
+  if (index >= d->size) {
+    uint32_t size = d->size ? d->size : 64;
+    trace_instr_t *e;
+    while (size <= index) {
+      size *= 2;
+    }
+    if (!(e = realloc(d->entry, size * sizeof(trace_instr_t)))) {
+      return -1;
+    }
+    memset(e + d->size, 0, (size - d->size) * sizeof(trace_instr_t));
+    d->entry = e;
+    d->size = size;
+  }
+  d->entry[index].rip = rip;
+  d->entry[index].len = len;
+  memset(d->entry[index].bytes, 0, MAX_INSTR_SIZE);
+  memcpy(d->entry[index].bytes, bytes, len);
+  d->entry[index].emitted = 1;
+  return 0;
+}
+
+// returns the number of bytes consumed, 0 if the record is
+// truncated, and -1 if it is not a record we understand
+// dict may be 0 if the stream is known to have no INSTRs
+static inline int trace_decode_record(trace_codec_state_t *s, trace_decode_dict_t *d,
+    const uint8_t *in, const uint8_t *end, individual_trace_record_t *r) {
+  const uint8_t *p = in;
+  uint64_t v, rip;
+
+  if (p >= end) {
+    return 0;
+  }
+
+  if (*p == TRACE_TAG_INSTR) {
+    p++;
+    if (!(p = trace_get_varint(p, end, &v)) || !(p = trace_get_varint(p, end, &rip))) {
+      return 0;
+    }
+    if (p >= end || *p > MAX_INSTR_SIZE || p + 1 + *p > end) {
+      return p < end && *p > MAX_INSTR_SIZE ? -1 : 0;
+    }
+    if (!d || trace_decode_dict_store(d, v, rip, p + 1, *p)) {
+      return -1;
+    }
+    p += 1 + *p;
+    if (p >= end) {
+      return 0;
+    }
+  }
+
+  switch (*p++) {
+    case TRACE_TAG_ABORT:
+      if (!(p = trace_get_varint(p, end, &v))) {
+        return 0;
+      }
+      memset(r, 0xff, sizeof(*r));
+      s->time += trace_unzigzag(v);
+      r->time = s->time;
+      return p - in;
+
+    case TRACE_TAG_GOVERN:
+      memset(r, 0xff, sizeof(*r));
+      if (!(p = trace_get_varint(p, end, &v))) {
+        return 0;
+      }
+      s->time += trace_unzigzag(v);
+      r->time = s->time;
+      if (!(p = trace_get_varint(p, end, &v))) {
+        return 0;
+      }
+      r->rsp = (void *)v;
+      if (!(p = trace_get_varint(p, end, &v))) {
+        return 0;
+      }
+      r->mxcsr = (int)v;
+      r->code = TRACE_CODE_GOVERN;
+      return p - in;
+
+    case TRACE_TAG_EVENT:
+      if (!(p = trace_get_varint(p, end, &v))) {
+        return 0;
+      }
+      s->time += trace_unzigzag(v);
+      if (!(p = trace_get_varint(p, end, &v))) {
+        return 0;
+      }
+      s->rip += trace_unzigzag(v);
+      if (!(p = trace_get_varint(p, end, &v))) {
+        return 0;
+      }
+      s->rsp += trace_unzigzag(v);
+      if (!(p = trace_get_varint(p, end, &v))) {
+        return 0;
+      }
+      r->code = (int)trace_unzigzag(v);
+      if (!(p = trace_get_varint(p, end, &v))) {
+        return 0;
+      }
+      s->csr ^= v;
+      if (p >= end || *p > MAX_INSTR_SIZE || p + 1 + *p > end) {
+        return p < end && *p > MAX_INSTR_SIZE ? -1 : 0;
+      }
+      memset(r->instruction, 0, MAX_INSTR_SIZE);
+      memcpy(r->instruction, p + 1, *p);
+      p += 1 + *p;
+      r->time = s->time;
+      r->rip = (void *)s->rip;
+      r->rsp = (void *)s->rsp;
+      r->mxcsr = (int)s->csr;
+      r->pad = 0;
+      return p - in;
+
+    case TRACE_TAG_REF:
+      if (!(p = trace_get_varint(p, end, &v))) {
+        return 0;
+      }
+      s->time += trace_unzigzag(v);
+      if (!(p = trace_get_varint(p, end, &v))) {
+        return 0;
+      }
+      if (!d || v >= d->size || !d->entry[v].emitted) {
+        return -1;
+      }
+      s->rip = d->entry[v].rip;
+      memcpy(r->instruction, d->entry[v].bytes, MAX_INSTR_SIZE);
+      if (!(p = trace_get_varint(p, end, &v))) {
+        return 0;
+      }
+      s->rsp += trace_unzigzag(v);
+      if (!(p = trace_get_varint(p, end, &v))) {
+        return 0;
+      }
+      r->code = (int)trace_unzigzag(v);
+      if (!(p = trace_get_varint(p, end, &v))) {
+        return 0;
+      }
+      s->csr ^= v;
+      r->time = s->time;
+      r->rip = (void *)s->rip;
+      r->rsp = (void *)s->rsp;
+      r->mxcsr = (int)s->csr;
+      r->pad = 0;
+      return p - in;
+
+    default:
+      return -1;
+  }
+}
+
+#endif
@@ -0,0 +1,189 @@
+//  Part of FPSpy
+//
+//  Preload library with floating point exception interception
+//  aggregation via FPE sticky behavior and trap-and-emulate
+//
+//  Copyright (c) 2018 Peter A. Dinda - see LICENSE
+
+#ifndef __TRACE_LZ
+#define __TRACE_LZ
+
+#include <stdint.h>
+#include <string.h>
+
+//
+// Block compression of trace data (TRACE_BLOCK_LZ)
+//
+// This is a greedy, single-probe LZ77 compressor producing the LZ4
+// block format, which is fast, needs no allocation, and is good at the
+// repetition in delta encoded records.   Each block is independent.
+//
+// A block is a sequence of sequences, each
+//
+//   token  [literal-length...]  literals  offset(2, LE)  [match-length...]
+//
+// where the token holds the literal length and match length - 4 in its
+// high and low nibbles, a nibble of 15 is continued in following bytes
+// (each added, until one is not 255), and the last sequence has only
+// literals.   Matches end at least 5 bytes from the end of the block.
+//
+
+#define TRACE_LZ_HASH_LOG 12
+#define TRACE_LZ_HASH_SIZE (1 << TRACE_LZ_HASH_LOG)
+
+// the most n bytes can compress to
+#define TRACE_LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+static inline uint32_t trace_lz_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t trace_lz_hash(uint32_t v) {
+  return (v * 2654435761U) >> (32 - TRACE_LZ_HASH_LOG);
+}
+
+static inline uint8_t *trace_lz_put_len(uint8_t *op, uint32_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+static inline uint8_t *trace_lz_put_literals(
+    uint8_t *op, const uint8_t *lit, uint32_t len, uint32_t match_len) {
+  *op++ = (len >= 15 ? 15 : len) << 4 | (match_len >= 15 ? 15 : match_len);
+  if (len >= 15) {
+    op = trace_lz_put_len(op, len - 15);
+  }
+  memcpy(op, lit, len);
+  return op + len;
+}
+
+// compress n bytes from in into out, which must have room for
+// TRACE_LZ_BOUND(n) bytes, using hash (TRACE_LZ_HASH_SIZE entries)
+// as scratch.  Returns the compressed length
+static inline uint32_t trace_lz_compress(
+    const uint8_t *in, uint32_t n, uint8_t *out, uint32_t *hash) {
+  const uint8_t *ip = in;
+  const uint8_t *anchor = in;
+  const uint8_t *end = in + n;
+  uint8_t *op = out;
+
+  if (n > 12) {
+    const uint8_t *mflimit = end - 12;    // last position a match may start
+    const uint8_t *matchlimit = end - 5;  // last position a match may reach
+
+    memset(hash, 0, TRACE_LZ_HASH_SIZE * sizeof(uint32_t));
+    ip++;
+
+    while (ip < mflimit) {
+      uint32_t h = trace_lz_hash(trace_lz_read32(ip));
+      const uint8_t *ref = in + hash[h];
+      const uint8_t *mp;
+      uint32_t off;
+
+      hash[h] = ip - in;
+
+      if (ref >= ip || ip - ref > 65535 || trace_lz_read32(ref) != trace_lz_read32(ip)) {
+        ip++;
+        continue;
+      }
+
+      while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+
+      for (mp = ip + 4; mp < matchlimit && *mp == ref[mp - ip]; mp++) {
+      }
+
+      off = ip - ref;
+      op = trace_lz_put_literals(op, anchor, ip - anchor, mp - ip - 4);
+      *op++ = off & 0xff;
+      *op++ = off >> 8;
+      if (mp - ip - 4 >= 15) {
+        op = trace_lz_put_len(op, mp - ip - 4 - 15);
+      }
+
+      ip = anchor = mp;
+    }
+  }
+
+  op = trace_lz_put_literals(op, anchor, end - anchor, 0);
+
+  return op - out;
+}
+
+// decompress n bytes from in into out, which has room for cap bytes
+// returns the decompressed length, or -1 if in is malformed or
+// does not fit
+static inline int64_t trace_lz_decompress(
+    const uint8_t *in, uint32_t n, uint8_t *out, uint32_t cap) {
+  const uint8_t *ip = in;
+  const uint8_t *iend = in + n;
+  uint8_t *op = out;
+  uint8_t *oend = out + cap;
+  const uint8_t *ref;
+  uint32_t token, len, off, b;
+
+  while (ip < iend) {
+    token = *ip++;
+
+    len = token >> 4;
+    if (len == 15) {
+      do {
+        if (ip >= iend) {
+          return -1;
+        }
+        b = *ip++;
+        len += b;
+      } while (b == 255);
+    }
+    if (len > iend - ip || len > oend - op) {
+      return -1;
+    }
+    memcpy(op, ip, len);
+    op += len;
+    ip += len;
+
+    if (ip == iend) {
+      break;  // the last sequence
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+    off = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (!off || off > op - out) {
+      return -1;
+    }
+
+    len = token & 15;
+    if (len == 15) {
+      do {
+        if (ip >= iend) {
+          return -1;
+        }
+        b = *ip++;
+        len += b;
+      } while (b == 255);
+    }
+    len += 4;
+    if (len > oend - op) {
+      return -1;
+    }
+    // may overlap
+    for (ref = op - off; len; len--) {
+      *op++ = *ref++;
+    }
+  }
+
+  return op - out;
+}
+
+#endif
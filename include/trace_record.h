@@ -10,7 +10,15 @@
 
 #define MAX_INSTR_SIZE 15
 
-// all bits set indicates an abort
+// all bits set indicates an abort, and a record whose rip and
+// instruction are all ones, but whose code is TRACE_CODE_GOVERN, notes
+// a decision of the overhead governor.  Its rsp is the overhead measured
+// over the governor's last window (parts per million), and its mxcsr is
+// the governor's new level.  At level L > 0, the thread has stopped
+// monitoring for 2^(L-1) off periods
+#define TRACE_CODE_ABORT  -1
+#define TRACE_CODE_GOVERN -2
+
 struct individual_trace_record {
   uint64_t time;  // cycles from start of monitoring
   void *rip;
@@ -23,4 +31,147 @@ struct individual_trace_record {
 
 typedef struct individual_trace_record individual_trace_record_t;
 
+// A trace file may begin with this header, in which case the records
+// follow it at header_size.   A file without one (no magic) is simply
+// an array of fixed size records.   If TRACE_FILE_COUNTED is set,
+// record_count and data_len describe what has been committed, and a
+// reader of a partially written file (e.g., after a crash) should
+// believe them rather than the file size.  Otherwise, the records
+// run to the end of the file.
+#define TRACE_FILE_MAGIC   "FPSPYTRC"
+#define TRACE_FILE_VERSION 2
+
+// flags
+#define TRACE_FILE_COUNTED      0x1  // record_count and data_len are valid
+#define TRACE_FILE_FORCED_ROUND 0x2  // FPSpy forced round_config on the thread
+#define TRACE_FILE_BLOCKS       0x4  // records are in blocks (see below)
+
+// architectures
+#define TRACE_ARCH_X64     1
+#define TRACE_ARCH_ARM64   2
+#define TRACE_ARCH_RISCV64 3
+
+// classes of exceptions, for sampling
+#define TRACE_SAMPLE_INV     0  // invalid
+#define TRACE_SAMPLE_DEN     1  // denormal operand
+#define TRACE_SAMPLE_DIV     2  // divide by zero
+#define TRACE_SAMPLE_OVER    3  // overflow
+#define TRACE_SAMPLE_UNDER   4  // underflow
+#define TRACE_SAMPLE_PREC    5  // precision (inexact)
+#define TRACE_SAMPLE_OTHER   6  // anything else
+#define TRACE_SAMPLE_CLASSES 8  // room for more
+
+// record formats
+#define TRACE_RECORD_FIXED 1  // individual_trace_record_t
+#define TRACE_RECORD_DELTA 2  // variable length, delta encoded (see trace_codec.h)
+
+struct trace_file_header {
+  char magic[8];          // TRACE_FILE_MAGIC (not NUL terminated)
+  uint32_t version;       // TRACE_FILE_VERSION
+  uint32_t header_size;   // offset of the first record
+  uint32_t record_size;   // size of each record, 0 if variable
+  uint32_t flags;         // TRACE_FILE_*
+  uint64_t record_count;  // records committed so far
+  uint64_t data_len;      // bytes of records committed so far
+  // version 1 headers end here (with padding to 64 bytes)
+  uint32_t arch;                // TRACE_ARCH_*
+  uint32_t record_format;       // TRACE_RECORD_*
+  uint32_t pid;                 // process and thread traced
+  uint32_t tid;
+  uint64_t cycle_freq;          // cycles per second of record times, 0 if unknown
+  uint64_t start_cycles;        // cycle count record times are relative to
+  uint64_t start_realtime_ns;   // CLOCK_REALTIME at start_cycles
+  uint64_t start_monotonic_ns;  // CLOCK_MONOTONIC at start_cycles
+  uint32_t except_mask;         // FE_* exceptions being trapped
+  uint32_t round_config;        // arch-specific rounding configuration
+  uint64_t index_offset;        // TRACE_FILE_BLOCKS: file offset of the block index, 0 if none
+  uint64_t block_count;         // TRACE_FILE_BLOCKS: entries in the block index
+  uint32_t site_throttle;       // events recorded in full at each rip, 0 => all
+  uint32_t overhead_budget;     // of the overhead governor, parts per million, 0 => off
+  uint8_t pad[8];
+  // headers of at least TRACE_FILE_HEADER_SAMPLED_SIZE bytes also have
+  // the sampling of each class of exception (TRACE_SAMPLE_*), so that
+  // the real rates can be reconstructed
+  uint32_t sample_period[TRACE_SAMPLE_CLASSES];    // 1 => every event, k => every kth, 0 => none
+  uint64_t sample_seen[TRACE_SAMPLE_CLASSES];      // events that occurred
+  uint64_t sample_recorded[TRACE_SAMPLE_CLASSES];  // events that were recorded
+} __attribute__((packed));
+
+typedef struct trace_file_header trace_file_header_t;
+
+// With TRACE_FILE_BLOCKS, the data following the header (data_len
+// bytes of it, if counted) is a sequence of blocks, each a
+// trace_block_header_t followed by stored_len bytes.   Each block
+// holds raw_len bytes of delta encoded records, compressed unless
+// flags say otherwise (see trace_lz.h), and is decoded with fresh
+// codec state and instruction dictionary.   After the blocks comes an
+// index of them, which allows a reader to find the blocks covering
+// a range of time without decoding the others.   A file whose writer
+// died has no index, but can still be read by walking the blocks.
+#define TRACE_BLOCK_MAGIC 0x4b4c4246  // "FBLK"
+
+#define TRACE_BLOCK_LZ 0x1  // stored data is compressed
+
+struct trace_block_header {
+  uint32_t magic;          // TRACE_BLOCK_MAGIC
+  uint32_t flags;          // TRACE_BLOCK_*
+  uint32_t stored_len;     // bytes following this header
+  uint32_t raw_len;        // bytes of encoded records
+  uint64_t record_count;   // records in the block
+  uint64_t first_time;     // time of its first record
+  uint64_t last_time;      // time of its last record
+} __attribute__((packed));
+
+typedef struct trace_block_header trace_block_header_t;
+
+struct trace_block_index {
+  uint64_t offset;  // of the block's header in the file
+  uint64_t record_count;
+  uint64_t first_time;
+  uint64_t last_time;
+} __attribute__((packed));
+
+typedef struct trace_block_index trace_block_index_t;
+
+// A container file (FPSPY_CONTAINER) holds the traces of all the
+// threads of a process.   It starts with a trace_container_header_t,
+// which is followed by chunks, each a trace_chunk_header_t followed by
+// len bytes.   A chunk places its bytes at offset in the trace of thread
+// tid, which is laid out exactly as that thread's trace file would be.
+// Chunks are applied in the order they appear, so a later chunk
+// supersedes an earlier one, which is how a thread's header is updated
+// at teardown.   A trace thus reads the same whether it comes from its
+// own file or from a container.   A container whose writer died ends
+// at the last complete chunk.
+#define TRACE_CONTAINER_MAGIC   "FPSPYCTR"
+#define TRACE_CONTAINER_VERSION 1
+
+#define TRACE_CHUNK_MAGIC 0x4b484346  // "FCHK"
+
+struct trace_container_header {
+  char magic[8];               // TRACE_CONTAINER_MAGIC (not NUL terminated)
+  uint32_t version;            // TRACE_CONTAINER_VERSION
+  uint32_t header_size;        // offset of the first chunk
+  uint32_t arch;               // TRACE_ARCH_*
+  uint32_t pid;                // process traced
+  uint64_t start_realtime_ns;  // CLOCK_REALTIME when the container was created
+  uint8_t pad[32];
+} __attribute__((packed));
+
+typedef struct trace_container_header trace_container_header_t;
+
+struct trace_chunk_header {
+  uint32_t magic;   // TRACE_CHUNK_MAGIC
+  uint32_t tid;     // whose trace the bytes belong to
+  uint32_t len;     // bytes following this header
+  uint32_t flags;   // none yet, 0
+  uint64_t offset;  // where the bytes go in the thread's trace
+} __attribute__((packed));
+
+typedef struct trace_chunk_header trace_chunk_header_t;
+
+#define TRACE_FILE_HEADER_V1_SIZE      64
+#define TRACE_FILE_HEADER_V2_SIZE      128  // without sampling
+#define TRACE_FILE_HEADER_SAMPLED_SIZE 288
+
 #endif
@@ -5,6 +5,13 @@
 #include <linux/fs.h>
 #include <linux/device.h>
 #include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/spinlock.h>
+#include <linux/tracepoint.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/refcount.h>
 #include <linux/types.h>
 #include <linux/mm_types.h>
 #include <linux/signal.h>
@@ -20,11 +27,14 @@
 #include <asm/cpu_entry_area.h>
 #include <asm/page.h>
 #include <asm/apic.h>
+#include <asm/debugreg.h>
+#include <asm/msr.h>
 
 #include <uapi/asm-generic/errno-base.h>
 
 #include "fpvm_ioctl.h"
 
+#define X86_TRAP_DB 1
 #define X86_TRAP_XF 19
 
 unsigned long fpvm_error_entry;
@@ -47,14 +57,23 @@ unsigned long fpvm_irqentry_exit;
 module_param_named(fpvm_irqentry_exit, fpvm_irqentry_exit, ulong, 0);
 MODULE_PARM_DESC(fpvm_irqentry_exit, "Address of the `fpvm_irqentry_exit` symbol");
 
+unsigned long fpvm_noist_exc_debug;
+module_param_named(fpvm_noist_exc_debug, fpvm_noist_exc_debug, ulong, 0);
+MODULE_PARM_DESC(fpvm_noist_exc_debug, "Address of the `noist_exc_debug` symbol (needed for hook_db)");
+
+int hook_db = 0;
+module_param_named(hook_db, hook_db, int, 0);
+MODULE_PARM_DESC(hook_db, "Also short circuit single step traps (#DB) of registered threads");
 
 unsigned long error_entry;
 unsigned long error_return;
 
 extern void *_fpvm_idt_entry;
 extern void *_fpvm_hw_timing_idt_entry;
+extern void *_fpvm_db_idt_entry;
 
 uint64_t original_xf_handler = 0;
+uint64_t original_db_handler = 0;
 
 
 /*
@@ -63,40 +82,133 @@ Handler Stuff
 ==================
 */
 
+// A ring is shared by a registration and any mappings of it, and
+// freed when the last of them goes.  User space maps the ring
+// read-write, so everything the module indexes it by is kept here,
+// and the ring's own head and dropped fields are only published
+struct fpvm_kring {
+  refcount_t ref;
+  fpvm_ring_t *ring;  // vmalloc_user()
+  unsigned long len;
+  uint64_t size;      // records, fixed at registration
+  uint64_t head;      // next record the module writes
+  uint64_t dropped;
+};
+
 struct user_proc_info {
-  struct list_head node;
+  struct hlist_node node;
+  struct rcu_head rcu;
   void (*user_handler)(void);
+  void (*user_db_handler)(void);  // if hook_db
+  uint64_t __user *armed;         // user_db_handler only when *armed
+  struct fpvm_kring *kring;       // if events are recorded here
+  uint32_t saved_masks;           // mxcsr trap masks while stepping
+  int stepping;                   // after a recorded event, until the #DB
+  int step_shared;                // TF was already set, by the thread or a debugger
   pid_t pid;
 };
 
-DEFINE_MUTEX(fpvm_dev_lock);
+// Registrations are in a hash table keyed by pid (the kernel's, so
+// one per thread).  The #XF hook looks them up without a lock, as
+// an RCU reader, while registration and removal (under upi_lock)
+// free entries only after a grace period.  The hook runs with
+// interrupts off, which makes it an RCU-sched reader, so the
+// grace period call_rcu() waits for covers it
+#define UPI_HASH_BITS 10
 
-// TODO: use a red-black tree instead
-static struct list_head upi_list = LIST_HEAD_INIT(upi_list);
+static DEFINE_HASHTABLE(upi_table, UPI_HASH_BITS);
+static DEFINE_SPINLOCK(upi_lock);
 
 
+// caller must be an RCU reader or hold upi_lock
 static struct user_proc_info *upi_find(pid_t target_pid) {
-  struct user_proc_info *cur = NULL;
-  struct user_proc_info *n = NULL;
-  int found = 0;
+  struct user_proc_info *cur;
 
-  // BUG?: deletion from list by another thread?
-  // TODO: add read-write lock
-  list_for_each_entry_safe(cur, n, &upi_list, node) {
+  hash_for_each_possible_rcu_notrace(upi_table, cur, node, target_pid) {
     if (cur->pid == target_pid) {
-      found = 1;
-      break;
+      return cur;
     }
   }
-  if (found) {
-    return cur;
-  }
   return NULL;
 }
 
-static void upi_add(struct user_proc_info *upi) { list_add(&upi->node, &upi_list); }
+// caller must hold upi_lock
+static void upi_add(struct user_proc_info *upi) { hash_add_rcu(upi_table, &upi->node, upi->pid); }
+
+static void kring_put(struct fpvm_kring *kr) {
+  if (kr && refcount_dec_and_test(&kr->ref)) {
+    // vfree defers the work if this is in interrupt context
+    vfree(kr->ring);
+    kfree(kr);
+  }
+}
+
+static void upi_free_rcu(struct rcu_head *rcu) {
+  struct user_proc_info *upi = container_of(rcu, struct user_proc_info, rcu);
+
+  kring_put(upi->kring);
+  kfree(upi);
+}
+
+// caller must hold upi_lock
+static void upi_del(struct user_proc_info *upi) {
+  hash_del_rcu(&upi->node);
+  call_rcu(&upi->rcu, upi_free_rcu);
+}
 
-static void upi_del(struct user_proc_info *upi) { list_del(&upi->node); }
+// Threads that exit without unregistering are removed when they exit,
+// so that a recycled pid never inherits a stale handler.   The hook is
+// on the sched_process_exit tracepoint, which is not exported to
+// modules, and so is found by name
+static struct tracepoint *upi_exit_tp;
+
+static void upi_exit_probe(void *data, struct task_struct *task) {
+  struct user_proc_info *upi;
+  unsigned long flags;
+
+  spin_lock_irqsave(&upi_lock, flags);
+  upi = upi_find(task->pid);
+  if (upi) {
+    upi_del(upi);
+  }
+  spin_unlock_irqrestore(&upi_lock, flags);
+}
+
+static void upi_find_exit_tp(struct tracepoint *tp, void *priv) {
+  if (!strcmp(tp->name, "sched_process_exit")) {
+    *(struct tracepoint **)priv = tp;
+  }
+}
+
+static void upi_start_exit_cleanup(void) {
+  for_each_kernel_tracepoint(upi_find_exit_tp, &upi_exit_tp);
+  if (!upi_exit_tp || tracepoint_probe_register(upi_exit_tp, upi_exit_probe, NULL)) {
+    printk("[!] Unable to hook thread exit, handlers are removed only on unregister\n");
+    upi_exit_tp = NULL;
+  }
+}
+
+static void upi_stop_exit_cleanup(void) {
+  if (upi_exit_tp) {
+    tracepoint_probe_unregister(upi_exit_tp, upi_exit_probe, NULL);
+    tracepoint_synchronize_unregister();
+    upi_exit_tp = NULL;
+  }
+}
+
+// only once the hook can no longer run
+static void upi_del_all(void) {
+  struct user_proc_info *cur;
+  struct hlist_node *n;
+  unsigned long flags;
+  int bkt;
+
+  spin_lock_irqsave(&upi_lock, flags);
+  hash_for_each_safe(upi_table, bkt, n, cur, node) {
+    upi_del(cur);
+  }
+  spin_unlock_irqrestore(&upi_lock, flags);
+}
 
 
 
@@ -107,32 +219,149 @@ static inline uint64_t my_rdtsc(void) {
 }
 
 
+// Return to user_handler instead of the interrupted instruction, with
+// the interrupted rsp and rip on the stack below the red zone
+static void redirect_to_user(struct pt_regs *regs, void (*user_handler)(void)) {
+  /* saving RIP to stack */
+  uint64_t old_sp = regs->sp;
+  uint64_t state[2] = {old_sp, regs->ip};
+  regs->sp -= 152;
+  // Because we need to do alignment, I need to give myself a little buffer
+  // for copying the saved RIP
+
+  regs->sp -= 0x8;
+  regs->sp &= 0xFFFFFFFFFFFFFFF0;  // This alignment is why I need to copy the RIP 2x
+
+  // Copy %rip here for our state save area
+  regs->sp -= 0x10;
+  if (copy_to_user((void *)regs->sp, &state, sizeof(state))) {
+    printk("copy to user..\n");
+  }
+
+  /* setting RIP to user proc's handler */
+  regs->ip = (long unsigned int)user_handler;
+}
+
+
+//
+// In-kernel event recording
+//
+
+#define MXCSR_FLAG_MASK 0x003fU
+#define MXCSR_MASK_MASK 0x1f80U
+
+static inline uint32_t read_mxcsr(void) {
+  uint32_t val;
+  asm volatile("stmxcsr %0" : "=m"(val));
+  return val;
+}
+
+static inline void write_mxcsr(uint32_t val) { asm volatile("ldmxcsr %0" ::"m"(val)); }
+
+// as FPSpy's short circuit handler does
+static int mxcsr_to_code(uint32_t mxcsr) {
+  uint32_t err = ~(mxcsr >> 7) & mxcsr;
+
+  if (err & 0x001) {
+    return FPE_FLTINV;
+  } else if (err & 0x004) {
+    return FPE_FLTDIV;
+  } else if (err & 0x008) {
+    return FPE_FLTOVF;
+  } else if (err & 0x012) {
+    return FPE_FLTUND;
+  } else if (err & 0x020) {
+    return FPE_FLTRES;
+  }
+  return 0;
+}
+
+// The thread's FP state is still live in the registers, as we came
+// straight from user mode, so the trap is recorded, the traps are
+// masked, and the instruction is single-stepped, all with the
+// registers themselves.  Returns 0 if the event must go the usual way
+static int ring_event(struct user_proc_info *upi, struct fpvm_kring *kr, struct pt_regs *regs) {
+  fpvm_ring_t *r = kr->ring;
+  fpvm_ring_record_t *rec;
+  uint64_t head, tail;
+  uint32_t mxcsr;
+
+  if (test_thread_flag(TIF_NEED_FPU_LOAD)) {
+    return 0;
+  }
+
+  mxcsr = read_mxcsr();
+
+  // the consumer's tail is the only thing we take from the shared
+  // ring, and it is only trusted to be within the ring
+  head = kr->head;
+  tail = READ_ONCE(r->tail);
+  if (tail > head) {
+    tail = head;
+  } else if (head - tail > kr->size) {
+    tail = head - kr->size;
+  }
+  if (head - tail < kr->size) {
+    rec = &r->rec[head % kr->size];
+    rec->time = rdtsc();
+    rec->rip = regs->ip;
+    rec->rsp = regs->sp;
+    rec->code = mxcsr_to_code(mxcsr);
+    rec->mxcsr = mxcsr;
+    if (copy_from_user_nofault(rec->instruction, (void __user *)regs->ip, sizeof(rec->instruction))) {
+      memset(rec->instruction, 0, sizeof(rec->instruction));
+    }
+    rec->pad = 0;
+    kr->head = head + 1;
+    smp_store_release(&r->head, kr->head);
+  } else {
+    kr->dropped++;
+    WRITE_ONCE(r->dropped, kr->dropped);
+  }
+
+  upi->saved_masks = mxcsr & MXCSR_MASK_MASK;
+  upi->stepping = 1;
+  upi->step_shared = !!(regs->flags & X86_EFLAGS_TF);
+  write_mxcsr((mxcsr & ~MXCSR_FLAG_MASK) | MXCSR_MASK_MASK);
+  regs->flags |= X86_EFLAGS_TF;
+
+  return 1;
+}
+
+// the #DB after a recorded event.  If a debugger is also stepping
+// the thread, the step is its as well, and TF stays
+static void ring_step_done(struct user_proc_info *upi, struct pt_regs *regs, int keep_tf) {
+  uint32_t mxcsr = read_mxcsr();
+
+  write_mxcsr((mxcsr & ~(MXCSR_FLAG_MASK | MXCSR_MASK_MASK)) | upi->saved_masks);
+  if (!keep_tf) {
+    regs->flags &= ~X86_EFLAGS_TF;
+  }
+  upi->stepping = 0;
+}
+
 void the_fpvm_hook(struct pt_regs *regs) {
   /* if (regs->r15 == 0xFFEEFF) { */
   /*   regs->r15 = my_rdtsc(); // Record the hw->kernel time into r15 */
   /*   regs->ip += 4; // Skip the instruction which caused the fault */
   /* } */
 
-  struct user_proc_info *upi = upi_find(current->pid);
+  struct user_proc_info *upi;
+  struct fpvm_kring *kr;
+  void (*user_handler)(void) = NULL;
+
+  // interrupts are off, so this is an RCU reader
+  upi = upi_find(current->pid);
   if (upi) {
-    /* saving RIP to stack */
-    uint64_t old_sp = regs->sp;
-    uint64_t state[2] = {old_sp, regs->ip};
-    regs->sp -= 152;
-    // Because we need to do alignment, I need to give myself a little buffer
-    // for copying the saved RIP
-
-    regs->sp -= 0x8;
-    regs->sp &= 0xFFFFFFFFFFFFFFF0;  // This alignment is why I need to copy the RIP 2x
-
-    // Copy %rip here for our state save area
-    regs->sp -= 0x10;
-    if (copy_to_user((void *)regs->sp, &state, sizeof(state))) {
-      printk("copy to user..\n");
+    kr = READ_ONCE(upi->kring);
+    if (kr && ring_event(upi, kr, regs)) {
+      return;
     }
+    user_handler = READ_ONCE(upi->user_handler);
+  }
 
-    /* setting RIP to user proc's handler */
-    regs->ip = (long unsigned int)upi->user_handler;
+  if (user_handler) {
+    redirect_to_user(regs, user_handler);
     return;
   }
 
@@ -144,31 +373,198 @@ void the_fpvm_hook(struct pt_regs *regs) {
 
 EXPORT_SYMBOL(the_fpvm_hook);
 
+// #DB from user mode only.  Only a plain single step of a thread that
+// is not being debugged, and whose armed word says the step is FPSpy's,
+// goes to the user handler.  Everything else, including a failure to
+// read the armed word, goes the usual way, to SIGTRAP or the debugger
+void the_fpvm_db_hook(struct pt_regs *regs) {
+  struct user_proc_info *upi;
+  void (*user_handler)(void) = NULL;
+  uint64_t __user *armed = NULL;
+  unsigned long dr6;
+  uint64_t val = 0;
+
+  get_debugreg(dr6, 6);
+
+  if ((regs->flags & X86_EFLAGS_TF) && (dr6 & DR_STEP) && !(dr6 & DR_TRAP_BITS)) {
+    // interrupts are off, so this is an RCU reader
+    upi = upi_find(current->pid);
+    if (upi && upi->stepping) {
+      // the step is ours, after an event we recorded, but it may
+      // also be a debugger's, which must still see it
+      if (upi->step_shared || test_thread_flag(TIF_SINGLESTEP)) {
+        ring_step_done(upi, regs, 1);
+        goto out;
+      }
+      set_debugreg(DR6_RESERVED, 6);
+      ring_step_done(upi, regs, 0);
+      return;
+    }
+    if (upi && !current->ptrace && !test_thread_flag(TIF_SINGLESTEP)) {
+      user_handler = READ_ONCE(upi->user_db_handler);
+      armed = READ_ONCE(upi->armed);
+    }
+  }
+
+  if (user_handler && armed && !copy_from_user_nofault(&val, armed, sizeof(val)) && val) {
+    // as the kernel would have done
+    set_debugreg(DR6_RESERVED, 6);
+    // the handler must not step itself, and will see TF clear
+    regs->flags &= ~X86_EFLAGS_TF;
+    redirect_to_user(regs, user_handler);
+    return;
+  }
+
+out:
+  ((void (*)(struct pt_regs *))fpvm_noist_exc_debug)(regs);
+}
+
+EXPORT_SYMBOL(the_fpvm_db_hook);
+
 static void fpvm_remove_handlers(pid_t target) {
-  struct user_proc_info *upi = upi_find(target);
-  mutex_lock_interruptible(&fpvm_dev_lock);
-  while (upi) {
+  struct user_proc_info *upi;
+  unsigned long flags;
+
+  spin_lock_irqsave(&upi_lock, flags);
+  upi = upi_find(target);
+  if (upi) {
     upi_del(upi);
-    kfree(upi);
-    upi = upi_find(target);
   }
-  mutex_unlock(&fpvm_dev_lock);
+  spin_unlock_irqrestore(&upi_lock, flags);
   printk("Removed all handlers for %ld\n", (long int)target);
   return;
 }
 
-static void fpvm_add_handler(void *handle_func) {
+static int fpvm_add_handler(void *handle_func) {
   struct user_proc_info *new_upi;
-  mutex_lock_interruptible(&fpvm_dev_lock);
+  struct user_proc_info *upi;
+  unsigned long flags;
 
-  new_upi = kmalloc(sizeof(struct user_proc_info), GFP_KERNEL);
+  new_upi = kzalloc(sizeof(struct user_proc_info), GFP_KERNEL);
+  if (!new_upi) {
+    return -ENOMEM;
+  }
   new_upi->user_handler = handle_func;
   new_upi->pid = current->pid;
-  upi_add(new_upi);
 
-  mutex_unlock(&fpvm_dev_lock);
-  printk("PID %ld registered handler at %px\n", (long int)new_upi->pid, new_upi->user_handler);
-  return;
+  // registering again replaces the handler
+  spin_lock_irqsave(&upi_lock, flags);
+  upi = upi_find(new_upi->pid);
+  if (upi) {
+    WRITE_ONCE(upi->user_handler, new_upi->user_handler);
+  } else {
+    upi_add(new_upi);
+  }
+  spin_unlock_irqrestore(&upi_lock, flags);
+
+  if (upi) {
+    kfree(new_upi);
+  }
+
+  printk("PID %ld registered handler at %px\n", (long int)current->pid, handle_func);
+  return 0;
+}
+
+static int fpvm_add_db_handler(struct fpvm_db_reg __user *ureg) {
+  struct user_proc_info *new_upi;
+  struct user_proc_info *upi;
+  struct fpvm_db_reg reg;
+  unsigned long flags;
+
+  if (!hook_db) {
+    return -ENODEV;
+  }
+
+  if (copy_from_user(&reg, ureg, sizeof(reg))) {
+    return -EFAULT;
+  }
+
+  new_upi = kzalloc(sizeof(struct user_proc_info), GFP_KERNEL);
+  if (!new_upi) {
+    return -ENOMEM;
+  }
+  new_upi->user_db_handler = (void (*)(void))reg.handler;
+  new_upi->armed = (uint64_t __user *)reg.armed;
+  new_upi->pid = current->pid;
+
+  spin_lock_irqsave(&upi_lock, flags);
+  upi = upi_find(new_upi->pid);
+  if (upi) {
+    WRITE_ONCE(upi->armed, new_upi->armed);
+    WRITE_ONCE(upi->user_db_handler, new_upi->user_db_handler);
+  } else {
+    upi_add(new_upi);
+  }
+  spin_unlock_irqrestore(&upi_lock, flags);
+
+  if (upi) {
+    kfree(new_upi);
+  }
+
+  printk("PID %ld registered single step handler at %px\n", (long int)current->pid,
+      (void *)reg.handler);
+  return 0;
+}
+
+static int fpvm_add_ring(unsigned long records) {
+  struct user_proc_info *new_upi;
+  struct user_proc_info *upi;
+  struct fpvm_kring *kr;
+  unsigned long flags;
+  int rc = 0;
+
+  // the step after each event must come back to us
+  if (!hook_db) {
+    return -ENODEV;
+  }
+
+  if (!records || records > (64UL << 20) / sizeof(fpvm_ring_record_t)) {
+    return -EINVAL;
+  }
+
+  kr = kzalloc(sizeof(struct fpvm_kring), GFP_KERNEL);
+  new_upi = kzalloc(sizeof(struct user_proc_info), GFP_KERNEL);
+  if (!kr || !new_upi) {
+    kfree(kr);
+    kfree(new_upi);
+    return -ENOMEM;
+  }
+
+  kr->len = PAGE_ALIGN(sizeof(fpvm_ring_t) + records * sizeof(fpvm_ring_record_t));
+  kr->ring = vmalloc_user(kr->len);
+  if (!kr->ring) {
+    kfree(kr);
+    kfree(new_upi);
+    return -ENOMEM;
+  }
+  kr->size = records;
+  kr->ring->size = records;
+  refcount_set(&kr->ref, 1);
+
+  new_upi->kring = kr;
+  new_upi->pid = current->pid;
+
+  spin_lock_irqsave(&upi_lock, flags);
+  upi = upi_find(new_upi->pid);
+  if (upi && upi->kring) {
+    rc = -EBUSY;
+  } else if (upi) {
+    WRITE_ONCE(upi->kring, kr);
+  } else {
+    upi_add(new_upi);
+  }
+  spin_unlock_irqrestore(&upi_lock, flags);
+
+  if (upi) {
+    kfree(new_upi);
+  }
+  if (rc) {
+    kring_put(kr);
+    return rc;
+  }
+
+  printk("PID %ld recording events in a ring of %lu records\n", (long int)current->pid, records);
+  return 0;
 }
 
 /*
@@ -182,6 +578,54 @@ static struct class *fpvm_class;
 
 static int fpvm_open(struct inode *inode, struct file *file) { return 0; }
 
+static void fpvm_vma_open(struct vm_area_struct *vma) {
+  struct fpvm_kring *kr = vma->vm_private_data;
+  refcount_inc(&kr->ref);
+}
+
+static void fpvm_vma_close(struct vm_area_struct *vma) { kring_put(vma->vm_private_data); }
+
+static const struct vm_operations_struct fpvm_vm_ops = {
+    .open = fpvm_vma_open, .close = fpvm_vma_close};
+
+// maps the calling thread's ring
+static int fpvm_mmap(struct file *file, struct vm_area_struct *vma) {
+  struct user_proc_info *upi;
+  struct fpvm_kring *kr = NULL;
+  unsigned long flags;
+  int rc;
+
+  spin_lock_irqsave(&upi_lock, flags);
+  upi = upi_find(current->pid);
+  if (upi && upi->kring) {
+    kr = upi->kring;
+    refcount_inc(&kr->ref);
+  }
+  spin_unlock_irqrestore(&upi_lock, flags);
+
+  if (!kr) {
+    return -ENODEV;
+  }
+
+  if (vma->vm_pgoff || vma->vm_end - vma->vm_start > kr->len) {
+    kring_put(kr);
+    return -EINVAL;
+  }
+
+  rc = remap_vmalloc_range(vma, kr->ring, 0);
+  if (rc) {
+    kring_put(kr);
+    return rc;
+  }
+
+  // a child gets a ring of its own
+  vma->vm_flags |= VM_DONTCOPY | VM_DONTEXPAND;
+  vma->vm_private_data = kr;
+  vma->vm_ops = &fpvm_vm_ops;
+
+  return 0;
+}
+
 static int fpvm_release(struct inode *inode, struct file *file) {
   fpvm_remove_handlers(current->pid);
   printk("Released FPVM Dev\n");
@@ -191,8 +635,11 @@ static int fpvm_release(struct inode *inode, struct file *file) {
 static long fpvm_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
   switch (cmd) {
     case FPVM_IOCTL_REG:
-      fpvm_add_handler((void *)arg);
-      break;
+      return fpvm_add_handler((void *)arg);
+    case FPVM_IOCTL_REG_DB:
+      return fpvm_add_db_handler((struct fpvm_db_reg __user *)arg);
+    case FPVM_IOCTL_REG_RING:
+      return fpvm_add_ring(arg);
     case FPVM_IOCTL_UNREG:
       fpvm_remove_handlers(current->pid);
       break;
@@ -204,7 +651,11 @@ static long fpvm_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
 }
 
 static struct file_operations fops = {
-    .owner = THIS_MODULE, .open = fpvm_open, .unlocked_ioctl = fpvm_ioctl, .release = fpvm_release};
+    .owner = THIS_MODULE,
+    .open = fpvm_open,
+    .unlocked_ioctl = fpvm_ioctl,
+    .mmap = fpvm_mmap,
+    .release = fpvm_release};
 
 static int create_fpvm_dev(void) {
   int err = register_chrdev_region(MKDEV(MAJOR_NUM, 0), MAX_MINORS, "fpvm_device_driver");
@@ -283,58 +734,56 @@ Modify & Restore IDT
 ==================
 */
 
-static void modify_idt(void) {
+// Point the gate of vector at handler, returning the original handler
+static uint64_t modify_idt(int vector, unsigned long handler) {
   struct desc_ptr IDTR;
   gate_desc *idt;
-  gate_desc *XF_gate_desc;
-  uint64_t new_XF_handler;
+  gate_desc *gd;
+  uint64_t original_handler;
+  uint64_t new_handler;
 
   // Get IDTR to find IDT base
   IDTR = get_idtr();
   idt = (gate_desc *)IDTR.address;
-  // Offset into IDT to #XF Gate Desc
-  XF_gate_desc = idt + X86_TRAP_XF;
+  // Offset into IDT to the Gate Desc
+  gd = idt + vector;
 
   // Save the old gate descriptor info in case
-  original_xf_handler = extract_handler_address(XF_gate_desc);
-  printk("Old XF handler: 0x%llx\n", original_xf_handler);
+  original_handler = extract_handler_address(gd);
+  printk("Old handler for vector %d: 0x%llx\n", vector, original_handler);
 
   // Disable write protections
   force_write_cr0(force_read_cr0() & ~(CR0_WP));
 
   // Put our fake gate descriptor in
-#if 1
-  write_handler_address_to_gd(XF_gate_desc, (unsigned long)&_fpvm_idt_entry);
-#else
-  write_handler_address_to_gd(XF_gate_desc, (unsigned long)&_fpvm_hw_timing_idt_entry);
-#endif
-  new_XF_handler = extract_handler_address(XF_gate_desc);
-  printk("New XF handler: 0x%llx\n", new_XF_handler);
+  write_handler_address_to_gd(gd, handler);
+  new_handler = extract_handler_address(gd);
+  printk("New handler for vector %d: 0x%llx\n", vector, new_handler);
 
   // Enable write protections
   force_write_cr0(force_read_cr0() | CR0_WP);
 
   // Profit
   printk("[!] IDT Modification done!\n");
-  return;
+  return original_handler;
 }
 
-// Called during our cleanup. Restore the original xf handler.
-static void restore_idt(void) {
+// Called during our cleanup. Restore the original handler.
+static void restore_idt(int vector, uint64_t original_handler) {
   struct desc_ptr IDTR;
   gate_desc *idt;
-  gate_desc *XF_gate_desc;
+  gate_desc *gd;
 
-  if (original_xf_handler == 0) {
+  if (original_handler == 0) {
     return;
   }
   IDTR = get_idtr();
   idt = (gate_desc *)IDTR.address;
-  XF_gate_desc = idt + X86_TRAP_XF;
+  gd = idt + vector;
 
-  printk("[*] Restoring original XF handler\n");
+  printk("[*] Restoring original handler for vector %d\n", vector);
   force_write_cr0(force_read_cr0() & ~(CR0_WP));
-  write_handler_address_to_gd(XF_gate_desc, (unsigned long)original_xf_handler);
+  write_handler_address_to_gd(gd, (unsigned long)original_handler);
   force_write_cr0(force_read_cr0() | CR0_WP);
   return;
 }
@@ -350,15 +799,29 @@ static int __init test_init(void) {
   int err;
   unsigned long flags;
 
-  local_irq_save(flags);
-
   if (!fpvm_error_entry || !fpvm_error_return || !fpvm_math_error || !fpvm_irqentry_enter ||
       !fpvm_irqentry_exit) {
     printk("[X] fpvm_dev: invalid params\n");
     return -1;
   }
+  if (hook_db && !fpvm_noist_exc_debug) {
+    printk("[X] fpvm_dev: hook_db needs fpvm_noist_exc_debug\n");
+    return -1;
+  }
+
+  local_irq_save(flags);
+
   /* replace default xf handler with _fpvm_idt_entry */
-  modify_idt();
+#if 1
+  original_xf_handler = modify_idt(X86_TRAP_XF, (unsigned long)&_fpvm_idt_entry);
+#else
+  original_xf_handler = modify_idt(X86_TRAP_XF, (unsigned long)&_fpvm_hw_timing_idt_entry);
+#endif
+
+  /* and the default db handler with _fpvm_db_idt_entry, if asked */
+  if (hook_db) {
+    original_db_handler = modify_idt(X86_TRAP_DB, (unsigned long)&_fpvm_db_idt_entry);
+  }
 
   /* register the device and stuff */
   err = create_fpvm_dev();
@@ -367,21 +830,34 @@ static int __init test_init(void) {
   }
 
   local_irq_restore(flags);
+
+  upi_start_exit_cleanup();
+
   return 0;
 }
 
 
 static void __exit test_exit(void) {
   unsigned long flags;
+
+  upi_stop_exit_cleanup();
+
   local_irq_save(flags);
 
-  /* restore original xf handler into idt */
-  restore_idt();
+  /* restore original xf and db handlers into idt */
+  restore_idt(X86_TRAP_XF, original_xf_handler);
+  restore_idt(X86_TRAP_DB, original_db_handler);
 
   /* unregister the device */
   destroy_fpvm_dev();
 
   local_irq_restore(flags);
+
+  /* the hook will not run again, so the handlers can go */
+  upi_del_all();
+
+  /* and the frees must be done before our code goes */
+  rcu_barrier();
 }
 
 module_init(test_init);
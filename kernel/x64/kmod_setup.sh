@@ -1,7 +1,15 @@
 #!/bin/bash
 
+# "./kmod_setup.sh db" also short circuits single step traps
+HOOK_DB=0
+if [ "$1" == "db" ]; then
+  HOOK_DB=1
+fi
+
 pushd fpvm-kmod
   sudo insmod fpvm_dev.ko \
+    hook_db=$HOOK_DB \
+    fpvm_noist_exc_debug=0x$(sudo grep ' noist_exc_debug$' /proc/kallsyms | cut -d' ' -f1) \
     fpvm_error_entry=0x$(sudo grep ' error_entry$' /proc/kallsyms | cut -d' ' -f1) \
     fpvm_error_return=0x$(sudo grep ' error_return$' /proc/kallsyms | cut -d' ' -f1) \
     fpvm_math_error=0x$(sudo grep ' math_error$' /proc/kallsyms | cut -d' ' -f1) \
@@ -1,8 +1,46 @@
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define MAJOR_NUM 17
 #define MAX_MINORS 1
 
 #define FPVM_IOC_TYPE 0x44
 #define FPVM_IOCTL_REG _IOW(FPVM_IOC_TYPE, 1, void *)
-#define FPVM_IOCTL_UNREG _IOW(FPVM_IOC_TYPE, 2, void *)
\ No newline at end of file
+#define FPVM_IOCTL_UNREG _IOW(FPVM_IOC_TYPE, 2, void *)
+#define FPVM_IOCTL_REG_DB _IOW(FPVM_IOC_TYPE, 3, struct fpvm_db_reg *)
+#define FPVM_IOCTL_REG_RING _IOW(FPVM_IOC_TYPE, 4, unsigned long)
+
+// A single step trap (#DB) of the registering thread is delivered to
+// handler, instead of as a SIGTRAP, whenever *armed is nonzero.
+// The handler is entered like the one for FPVM_IOCTL_REG.  The module
+// must have been loaded with hook_db=1
+struct fpvm_db_reg {
+  __u64 handler;
+  __u64 armed;  // address of the thread's armed word
+};
+
+// With FPVM_IOCTL_REG_RING (argument: number of records), the module
+// handles the registering thread's FP traps entirely by itself: the
+// #XF hook appends a record to a ring, masks the traps, and single
+// steps the instruction, and the #DB hook then unmasks them again.
+// The thread then maps the ring by mmap()ing the device (offset 0).
+// The module must have been loaded with hook_db=1.  A record is laid
+// out like FPSpy's individual_trace_record_t, with the time in cycles
+typedef struct fpvm_ring_record {
+  __u64 time;  // tsc
+  __u64 rip;
+  __u64 rsp;
+  __s32 code;  // as in siginfo_t->si_code
+  __u32 mxcsr;
+  __u8 instruction[15];
+  __u8 pad;
+} fpvm_ring_record_t;
+
+typedef struct fpvm_ring {
+  __u64 head;     // next record the module writes
+  __u64 tail;     // next record the consumer reads
+  __u64 size;     // in records
+  __u64 dropped;  // records lost because the ring was full
+  __u64 pad[4];
+  fpvm_ring_record_t rec[];
+} fpvm_ring_t;
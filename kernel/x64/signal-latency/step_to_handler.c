@@ -0,0 +1,93 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <stdint.h>
+#include <string.h>
+#include "fpvm_ioctl.h"
+
+// Latency of a single step trap (#DB), as FPSpy takes after each
+// trapping FP instruction, delivered either as a SIGTRAP
+// (-DUSE_SIGNALS) or by the kernel module (loaded with hook_db=1)
+// straight to _user_step_entry
+
+#define N 100000
+
+uint64_t t_a, t_c;
+
+// armed word for the kernel module
+uint64_t armed = 1;
+
+extern void *_user_step_entry;
+
+static inline uint64_t my_rdtsc(void) {
+  uint32_t lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return lo | ((uint64_t)(hi) << 32);
+}
+
+#ifdef USE_SIGNALS
+void our_handler(int sig, siginfo_t *si, void *priv) {
+  ucontext_t *uc = (ucontext_t *)priv;
+  t_c = my_rdtsc();
+  uc->uc_mcontext.gregs[REG_EFL] &= ~0x100UL;  // stop stepping
+  return;
+}
+#endif
+
+struct result {
+  uint64_t to_user;
+  uint64_t total;
+};
+struct result results[N];
+
+int main() {
+  int file_desc;
+
+#ifdef USE_SIGNALS
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = our_handler;
+  sa.sa_flags = SA_SIGINFO;
+  sigaction(SIGTRAP, &sa, 0);
+#else
+  struct fpvm_db_reg reg = {.handler = (uint64_t)&_user_step_entry, .armed = (uint64_t)&armed};
+
+  file_desc = open("/dev/fpvm_dev", O_RDWR);
+
+  if (file_desc < 0 || ioctl(file_desc, FPVM_IOCTL_REG_DB, &reg)) {
+    fprintf(stderr, "cannot register with /dev/fpvm_dev (loaded with hook_db=1?)\n");
+    return -1;
+  }
+#endif
+
+  for (int i = 0; i < N; i++) {
+    t_a = my_rdtsc();
+
+    asm volatile(
+        "pushf\n\t"
+        "orq $0x100, (%%rsp)\n\t"  // set TF
+        "popf\n\t"
+        "nop\n\t"  // the trap is taken after this instruction
+        "nop\n\t" ::
+            : "memory", "cc");
+
+    struct result res;
+    res.to_user = t_c - t_a;
+    res.total = my_rdtsc() - t_a;
+    results[i] = res;
+  }
+
+  printf("trial,to_user,total\n");
+  for (int i = 0; i < N; i++) {
+    struct result r = results[i];
+    printf("%d, %zu, %zu\n", i, r.to_user, r.total);
+  }
+
+  return 0;
+}
@@ -0,0 +1,27 @@
+.code64
+.section .text
+.global _user_step_entry
+
+// The kernel module leaves the stepped thread's rsp and rip on
+// the stack, TF already clear.  Note the time, and go back
+// (the benchmark is single threaded)
+
+_user_step_entry:
+  pushf
+  pushq %rax
+  pushq %rdx
+  rdtsc
+  shlq $32, %rdx
+  orq %rdx, %rax
+  movq %rax, t_c(%rip)
+  popq %rdx
+  popq %rax
+  popf
+  popq step_sp(%rip)
+  popq step_ip(%rip)
+  movq step_sp(%rip), %rsp
+  jmp *step_ip(%rip)
+
+.section .bss
+step_sp: .quad 0
+step_ip: .quad 0
@@ -1,5 +1,7 @@
 #!/usr/bin/perl -w
 
+use IPC::Open2;
+
 #
 # Part of FPSpy
 #
@@ -31,11 +33,26 @@ while (<S>) {
 
 close(S);
 
+# all the instructions are disassembled in one batch
+if ($dis) {
+    @keys = keys %insts;
+    $pid = open2(\*DO, \*DI, "disassem_instr.pl") or die "can't disassemble\n";
+    map { print DI $_, "\n"; } @keys;
+    close(DI);
+    map {
+	$dis_instr = <DO>;
+	defined($dis_instr) or $dis_instr = "";
+	chomp($dis_instr);
+	$dis_instr =~ s/.*\t(.*)/$1/g;
+	$dis_instrs{$_} = $dis_instr;
+    } @keys;
+    close(DO);
+    waitpid($pid,0);
+}
+
 map {
     if ($dis) {
-	$dis_instr = `disassem_instr.pl $_`;
-	$dis_instr =~ s/.*\t(.*)/$1/g;
-	chomp($dis_instr);
+	$dis_instr = $dis_instrs{$_};
 	print  $insts{$_}, "\t", $_, "\t", $dis_instr, "\n";
     } else {
 	print  $insts{$_}, "\t", $_, "\n";
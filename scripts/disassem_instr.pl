@@ -6,6 +6,9 @@
 # Copyright (c) 2023 Peter Dinda - see LICENSE
 #
 
+use Fcntl qw(:flock);
+use IPC::Open2;
+
 $#ARGV==-1 or $#ARGV==0 or die "usage: decode_instr.pl hexbytes or < hexbytes\n";
 
 if ($ENV{FPSPY_ARCH}) {
@@ -17,12 +20,62 @@ if ($ENV{FPSPY_ARCH}) {
     if ($myarch eq "aarch64") { $myarch = "arm64";}
     if ($myarch eq "riscv64") { $myarch = "riscv64";}
 }
-    
 
-$cmd = "disassem_instr_$myarch.pl";
+# disassemblies are kept in a cache, one per line as
+# arch, hexbytes, decoded hexbytes, and instruction, separated by tabs
+if (defined($ENV{FPSPY_DISASSEM_CACHE})) {
+    $cache = $ENV{FPSPY_DISASSEM_CACHE};
+} elsif ($ENV{HOME}) {
+    $cache = "$ENV{HOME}/.fpspy_disassem_cache";
+} else {
+    $cache = "";
+}
+
 if ($#ARGV==0) {
-    $cmd .= " ".$ARGV[0];
-} 
+    $hex = shift; chomp($hex);
+    @hexes = ($hex);
+} else {
+    @hexes = <STDIN>;
+    chomp(@hexes);
+}
 
-system $cmd;
+if ($cache ne "" && open(C,"<$cache")) {
+    while (my $l=<C>) {
+	chomp($l);
+	my ($arch,$hex,$dechex,$instr) = split(/\t/,$l,-1);
+	if (defined($instr) && $arch eq $myarch) {
+	    $dis{$hex} = "$dechex\t$instr";
+	}
+    }
+    close(C);
+}
+
+# what is not in the cache is disassembled in one batch
+map { $miss{$_}=1 if !defined($dis{$_}); } @hexes;
+@misses = sort keys %miss;
+
+if ($#misses>=0) {
+    $pid = open2(\*OUT, \*IN, "disassem_instr_$myarch.pl") or die "can't disassemble\n";
+    map { print IN $_,"\n"; } @misses;
+    close(IN);
+    @lines = <OUT>;
+    close(OUT);
+    waitpid($pid,0);
+    chomp(@lines);
+
+    @new = ();
+    for ($j=0;$j<=$#misses;$j++) {
+	next if !defined($lines[$j]);
+	$dis{$misses[$j]} = $lines[$j];
+	# failures are not remembered
+	push @new, "$myarch\t$misses[$j]\t$lines[$j]\n" if $lines[$j]=~/\t\S/;
+    }
+
+    if ($cache ne "" && $#new>=0 && open(C,">>$cache")) {
+	flock(C,LOCK_EX);
+	print C @new;
+	close(C);
+    }
+}
 
+map { print defined($dis{$_}) ? $dis{$_} : "\t", "\n"; } @hexes;
@@ -10,29 +10,40 @@ $#ARGV==-1 or $#ARGV==0 or die "usage: decode_instr_arm64.pl hexbytes or < hexby
 
 if ($#ARGV==0) {
     $hex = shift; chomp($hex);
-    ($dechex,$instr) = doit($hex);
-    print $dechex,"\t",$instr,"\n";
+    @hexes = ($hex);
 } else {
-    while ($hex=<STDIN>) {
-	chomp($hex);
-	($dechex,$instr) = doit($hex);
-	print $dechex,"\t",$instr,"\n";
-    }
+    @hexes = <STDIN>;
+    chomp(@hexes);
 }
-	
+
+# all the instructions are disassembled in one pass
+@out = doit(@hexes);
+
+for ($j=0;$j<=$#hexes;$j++) {
+    ($dechex,$instr) = defined($out[$j]) ? @{$out[$j]} : ("","");
+    print $dechex,"\t",$instr,"\n";
+}
+
 
 sub doit {
-    my $hex = shift;
-    my $i;
+    my @hexes = @_;
+    my @out;
+    my ($i, $j, $cur);
+
+    return () if $#hexes<0;
 
     open(S,">__test.S") or die "Can't open intermediate file\n";
 
     
-    print S ".text\n.global foo\nfoo:\n";
-    # we care only about the first 4 bytes in all cases
-    # since instructions are always the same length
-    for ($i=0;$i<8;$i+=2) {
-	print S "  .byte 0x", substr($hex,$i,2),"\n";
+    # each instruction gets a section of its own, so that each
+    # is disassembled from its first byte
+    for ($j=0;$j<=$#hexes;$j++) {
+	print S ".section .text.$j,\"ax\"\n";
+	# we care only about the first 4 bytes in all cases
+	# since instructions are always the same length
+	for ($i=0;$i<8;$i+=2) {
+	    print S "  .byte 0x", substr($hexes[$j],$i,2),"\n";
+	}
     }
     
     close(S);
@@ -45,19 +56,25 @@ sub doit {
     
     while (my $l=<D>) {
 	chomp($l);
+	if ($l=~/^Disassembly of section \.text\.(\d+)\:/) {
+	    $cur = $1;
+	    next;
+	}
 	# on ARM, the instruction will aways be on one line...
-	if ($l =~ /^\s+0\:\s+(\S+)\s+(\S.*)$/) {
+	if (defined($cur) && $l =~ /^\s+0\:\s+(\S+)\s+(\S.*)$/) {
 	    my $outhex = $1;
 	    my $instr = $2;
 
 	    $instr=~s/\t/ /g;
 #	    print "outhex=$outhex, instr=$instr\n";
 	    
-	    return ($outhex,$instr);
+	    $out[$cur] = [$outhex,$instr];
+	    $cur = undef;
 	}
     }
     close(D);
-    return undef;
+    system("rm -f __test.o __test.S");
+    return @out;
 }
 
 
@@ -14,29 +14,39 @@ $#ARGV==-1 or $#ARGV==0 or die "usage: decode_instr_riscv64.pl hexbytes or < hex
 
 if ($#ARGV==0) {
     $hex = shift; chomp($hex);
-    ($dechex,$instr) = doit($hex);
-    print $dechex,"\t",$instr,"\n";
+    @hexes = ($hex);
 } else {
-    while ($hex=<STDIN>) {
-	chomp($hex);
-	($dechex,$instr) = doit($hex);
-	print $dechex,"\t",$instr,"\n";
-    }
+    @hexes = <STDIN>;
+    chomp(@hexes);
+}
+
+# all the instructions are disassembled in one pass
+@out = doit(@hexes);
+
+for ($j=0;$j<=$#hexes;$j++) {
+    ($dechex,$instr) = defined($out[$j]) ? @{$out[$j]} : ("","");
+    print $dechex,"\t",$instr,"\n";
 }
 
 sub doit {
-    my $hex = shift;
-    my $i;
+    my @hexes = @_;
+    my @out;
+    my ($i, $j, $cur);
 
-    open(S,">__test.S") or die "Can't open intermediate file\n";
+    return () if $#hexes<0;
 
-    print S ".text\n.global foo\nfoo:\n";
+    open(S,">__test.S") or die "Can't open intermediate file\n";
 
     # this assumes the instruction is 4 bytes long which
     # is the case for all F,D,G instructions
 
-    for ($i=0;$i<8;$i+=2) {
-	print S "  .byte 0x", substr($hex,$i,2),"\n";
+    # each instruction gets a section of its own, so that each
+    # is disassembled from its first byte
+    for ($j=0;$j<=$#hexes;$j++) {
+	print S ".section .text.$j,\"ax\"\n";
+	for ($i=0;$i<8;$i+=2) {
+	    print S "  .byte 0x", substr($hexes[$j],$i,2),"\n";
+	}
     }
 
     close(S);
@@ -49,17 +59,23 @@ sub doit {
 
     while (my $l=<D>) {
 	chomp($l);
+	if ($l=~/^Disassembly of section \.text\.(\d+)\:/) {
+	    $cur = $1;
+	    next;
+	}
 	# on RISC-V the instruction should aways be on one line...
-	if ($l =~ /^\s+0\:\s+(\S+)\s+(\S.*)$/) {
+	if (defined($cur) && $l =~ /^\s+0\:\s+(\S+)\s+(\S.*)$/) {
 	    my $outhex = $1;
 	    my $instr = $2;
 
 	    $instr=~s/\t/ /g;
 #	    print "outhex=$outhex, instr=$instr\n";
 
-	    return ($outhex,$instr);
+	    $out[$cur] = [$outhex,$instr];
+	    $cur = undef;
 	}
     }
     close(D);
-    return undef;
+    system("rm -f __test.o __test.S");
+    return @out;
 }
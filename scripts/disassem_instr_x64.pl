@@ -10,26 +10,38 @@ $#ARGV==-1 or $#ARGV==0 or die "usage: decode_instr_x64.pl hexbytes or < hexbyte
 
 if ($#ARGV==0) {
     $hex = shift; chomp($hex);
-    ($dechex,$instr) = doit($hex);
-    print $dechex,"\t",$instr,"\n";
+    @hexes = ($hex);
 } else {
-    while ($hex=<STDIN>) {
-	chomp($hex);
-	($dechex,$instr) = doit($hex);
-	print $dechex,"\t",$instr,"\n";
-    }
+    @hexes = <STDIN>;
+    chomp(@hexes);
+}
+
+# all the instructions are disassembled in one pass
+@out = doit(@hexes);
+
+for ($j=0;$j<=$#hexes;$j++) {
+    ($dechex,$instr) = defined($out[$j]) ? @{$out[$j]} : ("","");
+    print $dechex,"\t",$instr,"\n";
 }
 	
 
 sub doit {
-    my $hex = shift;
-    my $i;
+    my @hexes = @_;
+    my @out;
+    my ($i, $j, $cur);
+
+    return () if $#hexes<0;
     
     open(S,">__test.S") or die "Can't open intermediate file\n";
     
-    print S ".code64\n.text\n.global foo\nfoo:\n";
-    for ($i=0;$i<length($hex);$i+=2) {
-	print S "  .byte 0x", substr($hex,$i,2),"\n";
+    print S ".code64\n";
+    # each instruction gets a section of its own, so that each
+    # is disassembled from its first byte
+    for ($j=0;$j<=$#hexes;$j++) {
+	print S ".section .text.$j,\"ax\"\n";
+	for ($i=0;$i<length($hexes[$j]);$i+=2) {
+	    print S "  .byte 0x", substr($hexes[$j],$i,2),"\n";
+	}
     }
     
     close(S);
@@ -40,7 +52,11 @@ sub doit {
     
     while (my $l=<D>) {
 	chomp($l);
-	if ($l=~/^\s+0\:/) {
+	if ($l=~/^Disassembly of section \.text\.(\d+)\:/) {
+	    $cur = $1;
+	    next;
+	}
+	if (defined($cur) && $l=~/^\s+0\:/) {
 	    my @cols = split(/\t/,$l);
 	    $cols[2]=~s/\#.*$//g;
 	    my $outhex = $cols[1];
@@ -58,18 +74,11 @@ sub doit {
 		    }
 		}
 	    }
-	    system("rm -f __test.o __test.S");
-	    close(D);
-	    return ($outhex,$instr);
+	    $out[$cur] = [$outhex,$instr];
+	    $cur = undef;
 	}
     }
     close(D);
-    return undef;
+    system("rm -f __test.o __test.S");
+    return @out;
 }
-
-
-
-	
-
-
-    
@@ -17,6 +17,7 @@ $#ARGV==0 or die "usage: parse_individual.pl file\n";
 	    6 => "FPE_FLTRES",
 	    7 => "FPE_FLTINV",
 	    8 => "FPE_FLTSUB",
+            0xfffffffe => "***GOVERN",
             0xffffffff => "***ABORT!!");
 
 $file = shift;
@@ -33,26 +34,193 @@ if ($ENV{FPSPY_ARCH}) {
 
 open(RAW,'<:raw', $file) or die "Failed to open $file\n";
 
+# a file may start with a header that says how many records
+# have been committed, and how they are encoded; otherwise it is
+# just fixed size records
+$left = -1;
+$format = 1;
+if (read(RAW,$magic,8)==8 && $magic eq "FPSPYTRC") {
+    read(RAW,$hdr,32)==32 or die "Truncated header in $file\n";
+    ($version, $hsize, $rsize, $flags, $left, $datalen) = unpack("LLLLQQ",$hdr);
+    if ($version==1) {
+	$rsize==48 or die "Unsupported trace format in $file\n";
+    } elsif ($version==2) {
+	read(RAW,$hdr,8)==8 or die "Truncated header in $file\n";
+	(undef, $format) = unpack("LL",$hdr);
+	($format==1 && $rsize==48) || $format==2 or die "Unsupported trace format in $file\n";
+	if (!($flags & 1)) { $left = -1; }
+    } else {
+	die "Unsupported trace format in $file\n";
+    }
+    seek(RAW,$hsize,0);
+} else {
+    seek(RAW,0,0);
+}
 
-while (1) {
-    $n = read(RAW,$rec, 32);
-    last if ($n!=32);
-    ($time, $rip, $rsp, $code, $mxcsr) = unpack("QQQLL",$rec);
-    $n = read(RAW,$instr, 15);
-    last if ($n!=15);
-    $n = read(RAW,$junk, 1); undef($junk);
-    last if ($n!=1);
-    $dec = $decode{$code};
+sub emit {
+    my ($time, $rip, $rsp, $code, $mxcsr, $instr) = @_;
+    my $dec = $decode{$code};
     if (!defined($dec)) {
 	$dec = "UNDEF"
     }
     if ($myarch eq "x64") {
 	# captures denorm distinction, but only in
 	# the fcsr/mxcsr
-	if (($code != 0xffffffff) && ($mxcsr & 0x2)) {
+	if (($code < 0xfffffffe) && ($mxcsr & 0x2)) {
 	    $dec.="-FPE_DENORM";
 	}
     }
     print sprintf("%-16ld\t%s\t%016x\t%016x\t%08x\t%08x\t",$time, $dec, $rip,$rsp,$code,$mxcsr);
     print unpack("H*",$instr), "\n";
 }
+
+if ($format==1) {
+    while ($left--) {
+	$n = read(RAW,$rec, 32);
+	last if ($n!=32);
+	($time, $rip, $rsp, $code, $mxcsr) = unpack("QQQLL",$rec);
+	$n = read(RAW,$instr, 15);
+	last if ($n!=15);
+	$n = read(RAW,$junk, 1); undef($junk);
+	last if ($n!=1);
+	emit($time, $rip, $rsp, $code, $mxcsr, $instr);
+    }
+} else {
+    local $/;
+    $file_data = <RAW>;
+    $file_data = "" if (!defined($file_data));
+    if ($flags & 1 && $datalen < length($file_data)) {
+	$file_data = substr($file_data, 0, $datalen);
+    }
+    if ($flags & 4) {
+	# blocks (see include/trace_record.h), each independently
+	# decodable, and perhaps compressed
+	$bpos = 0;
+	while ($bpos + 40 <= length($file_data)) {
+	    ($bmagic, $bflags, $stored, $raw) = unpack("LLLL", substr($file_data, $bpos, 16));
+	    last if ($bmagic != 0x4b4c4246 || $bpos + 40 + $stored > length($file_data));
+	    $data = substr($file_data, $bpos + 40, $stored);
+	    $data = lz_decompress($data) if ($bflags & 1);
+	    length($data) == $raw or die "Corrupt block in $file\n";
+	    $left = -1;
+	    decode_records();
+	    $bpos += 40 + $stored;
+	}
+    } else {
+	$data = $file_data;
+	decode_records();
+    }
+}
+
+sub decode_records {
+    # delta encoded (see include/trace_codec.h), with
+    # 64 bit wraparound arithmetic
+    use integer;
+    $pos = 0;
+    $end = length($data);
+    ($time, $rip, $rsp, $mxcsr) = (0, 0, 0, 0);
+    %dict = ();
+    while ($left-- && $pos < $end) {
+	$tag = ord(substr($data,$pos++,1));
+	if ($tag==3) {
+	    # instruction dictionary entry, which precedes a reference
+	    defined($index = varint()) or last;
+	    defined($v = varint()) or last;
+	    last if ($pos >= $end);
+	    $len = ord(substr($data,$pos++,1));
+	    last if ($len > 15 || $pos + $len > $end);
+	    $dict{$index} = [$v, substr($data,$pos,$len) . ("\0" x (15-$len))];
+	    $pos += $len;
+	    last if ($pos >= $end);
+	    $tag = ord(substr($data,$pos++,1));
+	}
+	if ($tag==2) {
+	    defined($v = varint()) or last;
+	    $time += unzigzag($v);
+	    emit($time, -1, -1, 0xffffffff, 0xffffffff, "\xff" x 15);
+	} elsif ($tag==5) {
+	    # overhead governor decision
+	    defined($v = varint()) or last; $time += unzigzag($v);
+	    defined($gov_overhead = varint()) or last;
+	    defined($gov_level = varint()) or last;
+	    emit($time, -1, $gov_overhead, 0xfffffffe, $gov_level, "\xff" x 15);
+	} elsif ($tag==1) {
+	    defined($v = varint()) or last; $time += unzigzag($v);
+	    defined($v = varint()) or last; $rip += unzigzag($v);
+	    defined($v = varint()) or last; $rsp += unzigzag($v);
+	    defined($v = varint()) or last; $code = unzigzag($v) & 0xffffffff;
+	    defined($v = varint()) or last; $mxcsr ^= $v;
+	    last if ($pos >= $end);
+	    $len = ord(substr($data,$pos++,1));
+	    last if ($len > 15 || $pos + $len > $end);
+	    $instr = substr($data,$pos,$len) . ("\0" x (15-$len));
+	    $pos += $len;
+	    emit($time, $rip, $rsp, $code, $mxcsr, $instr);
+	} elsif ($tag==4) {
+	    defined($v = varint()) or last; $time += unzigzag($v);
+	    defined($index = varint()) or last;
+	    defined($dict{$index}) or die "Corrupt trace in $file\n";
+	    ($rip, $instr) = @{$dict{$index}};
+	    defined($v = varint()) or last; $rsp += unzigzag($v);
+	    defined($v = varint()) or last; $code = unzigzag($v) & 0xffffffff;
+	    defined($v = varint()) or last; $mxcsr ^= $v;
+	    emit($time, $rip, $rsp, $code, $mxcsr, $instr);
+	} else {
+	    die "Corrupt trace in $file\n";
+	}
+    }
+}
+
+sub varint {
+    use integer;
+    my $v = 0;
+    my $shift = 0;
+    while ($pos < $end) {
+	my $b = ord(substr($data,$pos++,1));
+	$v |= ($b & 0x7f) << $shift;
+	return $v if (!($b & 0x80));
+	$shift += 7;
+    }
+    return undef;
+}
+
+sub unzigzag {
+    use integer;
+    my $v = shift;
+    return (($v >> 1) & ~(1 << 63)) ^ -($v & 1);
+}
+
+# LZ4 block format (see include/trace_lz.h)
+sub lz_decompress {
+    my $in = shift;
+    my $out = "";
+    my $ip = 0;
+    my $n = length($in);
+    while ($ip < $n) {
+	my $token = ord(substr($in,$ip++,1));
+	my $len = $token >> 4;
+	if ($len == 15) {
+	    my $b;
+	    do { $b = ord(substr($in,$ip++,1)); $len += $b; } while ($b == 255 && $ip < $n);
+	}
+	$out .= substr($in,$ip,$len);
+	$ip += $len;
+	last if ($ip >= $n);
+	my $off = ord(substr($in,$ip,1)) | (ord(substr($in,$ip+1,1)) << 8);
+	$ip += 2;
+	($off && $off <= length($out)) or die "Corrupt block in $file\n";
+	$len = $token & 15;
+	if ($len == 15) {
+	    my $b;
+	    do { $b = ord(substr($in,$ip++,1)); $len += $b; } while ($b == 255 && $ip < $n);
+	}
+	$len += 4;
+	# the match may overlap what it produces
+	while ($len > 0) {
+	    my $chunk = substr($out, length($out) - $off, $len > $off ? $off : $len);
+	    $out .= $chunk;
+	    $len -= length($chunk);
+	}
+    }
+    return $out;
+}
@@ -27,9 +27,11 @@ else:
 	if(debug==1):
 		print(instrcounts)
 
-	instr = []
-	for cmd in instrcounts:
-		statusdis, outputinstr = commands.getstatusoutput("disassem_instr.pl  "+cmd[1])	
+	# all the instructions are disassembled in one batch
+	dis = subprocess.Popen(["disassem_instr.pl"], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+	outputinstrs, errinstrs = dis.communicate("".join([cmd[1]+"\n" for cmd in instrcounts]))
+	outputinstrs = outputinstrs.splitlines()
+	for cmd, outputinstr in zip(instrcounts, outputinstrs):
 		print(cmd[0]+"\t"+ outputinstr)
 
 
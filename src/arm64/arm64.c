@@ -172,7 +172,7 @@ void arch_config_machine_fp_csr_for_local(arch_fp_csr_t *old) {
 
 int arch_have_special_fp_csr_exception(int which) {
   if (which == FE_DENORM) {
-    return !!(get_fpsr_machine() & 0x100);  // bit 8, IDC
+    return !!(get_fpsr_machine() & 0x80);  // bit 7, IDC
   } else {
     return 0;
   }
@@ -274,6 +274,31 @@ static int get_fpcsr(const ucontext_t *uc, arch_fp_csr_t *f) {
   return get_fpsr(uc, &f->fpsr) || get_fpcr(uc, &f->fpcr);
 }
 
+int arch_have_special_fp_csr_exception_in_context(const ucontext_t *uc, int which) {
+  arch_fp_csr_t f;
+
+  if (which == FE_DENORM && !get_fpcsr(uc, &f)) {
+    return !!(f.fpsr.val & 0x80);  // bit 7, IDC
+  } else {
+    return 0;
+  }
+}
+
+// the fpsr flags are laid out as the fenv values, with
+// IDC at bit 7
+int arch_get_fp_exceptions_in_context(const ucontext_t *uc) {
+  fpsr_t f;
+  uint32_t flags;
+
+  if (get_fpsr(uc, &f)) {
+    return 0;
+  }
+
+  flags = f.val & FPSR_FLAG_MASK;
+
+  return (flags & FE_ALL_EXCEPT) | (flags & 0x80 ? FE_DENORM : 0);
+}
+
 // not currently used but kept here for later
 __attribute__((unused))
 static int set_fpcsr(ucontext_t *uc, const arch_fp_csr_t *f) {
@@ -351,10 +376,14 @@ void arch_dump_fp_csr(const char *pre, const ucontext_t *uc) {
   (inst) = (uint32_t)((*(uint64_t *)(p)) >> 32); \
   (data) = (uint32_t)((*(uint64_t *)(p)));
 
-void arch_set_trap_mode(ucontext_t *uc, uint64_t *state) {
+int arch_set_trap_mode(ucontext_t *uc, uint64_t *state) {
   uint32_t *target = (uint32_t *)(uc->uc_mcontext.pc + 4);  // all instructions are 4 bytes
 
   if (state) {
+    if (make_code_writeable(target, 4)) {
+      ERROR("cannot insert breakpoint at %p\n", target);
+      return -1;
+    }
     // it should be the case that were are in TRAP_MODE_OFF
     // uint32_t old = *target;
     ENCODE(state, *target, TRAP_MODE_ON);
@@ -365,6 +394,7 @@ void arch_set_trap_mode(ucontext_t *uc, uint64_t *state) {
   } else {
     ERROR("no state on set trap - just ignoring\n");
   }
+  return 0;
 }
 
 void arch_reset_trap_mode(ucontext_t *uc, uint64_t *state) {
@@ -602,6 +632,9 @@ int arch_get_instr_bytes(const ucontext_t *uc, uint8_t *dest, int size) {
   }
 }
 
+// no emulation support, we always single step past the instruction
+int arch_emulate_instruction(ucontext_t *uc) { return -1; }
+
 
 // representation is as 2 back to back 32 bit regs
 // FPCR : FPSR
@@ -620,76 +653,48 @@ uint64_t arch_get_fp_csr(const ucontext_t *uc) {
 }
 
 /*
-  The following is done because single step mode is typically not available for
-  user programs, so, outside of a kernel module that enables it, we need to
-  use breakpoint instructions to clean up, and thus we need to be able
-  to write executable regions.
-
-  An alternative to this, which would work for post startup loads of code as well,
-  would be to handle SEGV and then edit regions
-
   A kernel module could also provide us with direct access to the cycle
   counter so that we could have a real arch_cycle_count() - see HAVE_EL0_COUNTER_ACCESS
   in arm64.h.
+*/
+int arch_process_init(void) {
+  DEBUG("arm64 process init\n");
+  return 0;
+}
 
+void arch_process_deinit(void) { DEBUG("arm64 process deinit\n"); }
 
+int arch_thread_init(ucontext_t *uc) {
+  DEBUG("arm64 thread init\n");
+  return 0;
+}
 
- */
-static int make_my_exec_regions_writeable() {
-  DEBUG("making executable regions of memory map writeable to allow breakpoint insertion...\n");
-  DEBUG("yes, this is as hideous as it sounds...\n");
+void arch_thread_deinit(void) { DEBUG("arm64 thread deinit\n"); }
 
-  FILE *f = fopen("/proc/self/maps", "r");
+// no breakpoint has been inserted yet, so there is nothing to rewrite
+int arch_thread_init_direct(const fpspy_round_config_t *round_config, uint64_t *state) {
+  uint64_t fpcr;
 
-  if (!f) {
-    ERROR("cannot open /proc/self/maps\n");
+  if (arch_thread_init(0)) {
     return -1;
   }
 
-  char line_buf[256];
+  set_fpsr_machine(get_fpsr_machine() & ~FPSR_FLAG_MASK);
 
-  while (!feof(f)) {
-    off_t start, end;
-    char flags[5];  // "rwxp\0"
-    if (fgets(line_buf, 256, f) == 0) {
-      // DEBUG("cannot fetch line... (soft failure)\n");
-      break;
-    }
-    int count = sscanf(line_buf, "%lx-%lx %s\n", &start, &end, flags);
-    if (count == 3) {
-      if (flags[2] == 'x' && flags[0] == 'r' && flags[1] != 'w') {
-        DEBUG("mprotecting this region as rwx: %s", line_buf);
-        void *s = (void *)start;
-        off_t len = end - start;
-        int flags = PROT_READ | PROT_WRITE | PROT_EXEC;
-        //	DEBUG("mprotect(%p,0x%lx,0x%x)\n",s,len,flags);
-        if (mprotect(s, len, flags)) {
-          ERROR("failed to mptoect this region as rwx: %s", line_buf);
-          fclose(f);
-          return -1;
-        }
-      } else {
-        // DEBUG("ignoring this region: %s",line_buf);
-      }
-    } else {
-      DEBUG("unparseable region: %s\n", line_buf);
-    }
+  fpcr = get_fpcr_machine();
+  fpcr |= FPCR_ENABLE_MASK;
+  if (round_config) {
+    fpcr &= ~FPCR_ROUND_DAZ_FTZ_MASK;
+    fpcr |= *round_config;
   }
-  DEBUG("completed mprotects\n");
-  fclose(f);
-  return 0;
-}
+  set_fpcr_machine(fpcr);
+  sync_fp();
 
-int arch_process_init(void) {
-  DEBUG("arm64 process init\n");
-  return make_my_exec_regions_writeable();
-}
+  if (state) {
+    ENCODE(state, 0, TRAP_MODE_OFF);
+  }
 
-void arch_process_deinit(void) { DEBUG("arm64 process deinit\n"); }
+  DEBUG("arm64 thread directly initialized (fpcr=0x%016lx)\n", fpcr);
 
-int arch_thread_init(ucontext_t *uc) {
-  DEBUG("arm64 thread init\n");
   return 0;
 }
-
-void arch_thread_deinit(void) { DEBUG("arm64 thread deinit\n"); }
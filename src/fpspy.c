@@ -18,7 +18,7 @@
     establishes its own floating point exception handler
   - removes itself at unload time of the target program, and records its observations
 
-  There are two modes of operation:
+  There are three modes of operation:
 
   - Aggregate.  Here all that is done is to capture fpe sticky exception state
     at program start, and then again at program end.   This lets us determine,
@@ -30,6 +30,11 @@
     restarting the instruction, then fauling on trap at the next instruction, then
     switching exceptions back on and switching traps off
 
+  - Sites.  Here we intercept each exception exactly as in individual mode,
+    but instead of recording each one, we count them per trapping
+    instruction (site) and per exception type, writing a compact
+    summary at thread exit
+
   Additionally, you can operate in "aggressive" mode (for individual mode), which
   means that it will not get out of the way if the target program sets a SIGFPE signal;
   instead, the target program will just never see any of its own SIGFPEs.
@@ -75,6 +80,8 @@
 #include <sys/syscall.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
 
 #include <math.h>
 
@@ -86,11 +93,17 @@
 #include "arch.h"
 #include "trace_record.h"
 
+// glibc does not always provide this
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 // trap short-circuiting support from FPVM
 // this allows much faster response to FP traps
 // when the kernel module is available
 #if CONFIG_TRAP_SHORT_CIRCUITING
 #include <sys/ioctl.h>
+#include <cpuid.h>
 #include "fpvm_ioctl.h"
 #endif
 
@@ -107,12 +120,24 @@ static uint32_t orig_round_config;  // the FP rounding setup encountered at star
 //
 volatile static int maxcount =
     -1;  // maximum number of events to record, per thread (-1=> no limit)
-volatile static int sample_period = 1;  // sample period 1 => record every event
+// sample period by class of exception (TRACE_SAMPLE_*)
+// 1 => record every event, k => every kth, 0 => none
+volatile static uint32_t sample_period[TRACE_SAMPLE_CLASSES] = {
+    [0 ... TRACE_SAMPLE_CLASSES - 1] = 1};
+static const char *sample_class_name[TRACE_SAMPLE_CLASSES] = {
+    "inv", "den", "div", "over", "under", "prec", "other", 0};
 
 volatile static int kernel = 0;  // are we using kernel support?
+volatile static int kernel_ring = 0;  // does the kernel module record the events itself?
 
 volatile static int kernel_fd = -1;
 
+#if CONFIG_INSTRUCTION_EMULATION
+volatile static int emulate = 1;  // will we try to emulate trapping instructions?
+#else
+volatile static int emulate = 0;
+#endif
+
 
 volatile static int timers = 0;                    // are we using timing-based sampling?
 volatile static uint64_t on_mean_us, off_mean_us;  // parameters for poisson sampling
@@ -126,7 +151,7 @@ volatile static int enabled_fp_traps = FE_ALL_EXCEPT;  // which FP exceptions to
 static int control_round_config = 0;   // will we control rounding+related (daz/ftz) or not
 static uint32_t our_round_config = 0;  // if we control, what is the config we will force
 
-volatile static enum { AGGREGATE, INDIVIDUAL } mode = AGGREGATE;  // our mode of operation
+volatile static enum { AGGREGATE, INDIVIDUAL, SITES } mode = AGGREGATE;  // our mode of operation
 volatile static int aggressive =
     0;  // whether we will ignore some target operations that would normally cause us to abort
 volatile static int disable_pthreads = 0;  // whether to avoid pthread override
@@ -135,6 +160,20 @@ volatile static int kickstart =
 volatile static int abort_on_fpe =
     0;  // whether we abort (ie. crash with SIGARBT) the program on the first FPE
 volatile static int create_monitor_file = 1;  // whether we write a monitor output file (*.fpemon)
+volatile static enum { OUTPUT_INLINE, OUTPUT_THREAD, OUTPUT_MMAP } output =
+    OUTPUT_THREAD;  // whether handlers write trace records, hand them to a writer thread, or map the file
+volatile static enum { BACKPRESSURE_BLOCK, BACKPRESSURE_DROP } backpressure =
+    BACKPRESSURE_BLOCK;  // what a handler does when the writer thread falls behind
+volatile static int trace_format = 2;  // 1 => legacy fixed records, 2 => header + delta encoded
+volatile static int compress = 0;      // write trace files in compressed blocks (thread output)
+volatile static int container = 0;     // write all threads' traces to one file per process (thread output)
+volatile static uint32_t site_throttle = 0;  // record only the first k events at a rip in full, 0 => off
+volatile static uint32_t overhead_budget = 0;  // handler cycles allowed, parts per million, 0 => off
+volatile static uint64_t poll_us = 0;  // aggregate mode: period of sticky flag polling, 0 => off
+// the range of FPSPY_POLL, as shorter periods would bury the thread in
+// timer signals, and longer ones would never poll
+#define POLL_US_MIN 10UL
+#define POLL_US_MAX 3600000000UL  // an hour
 
 unsigned char log_level = 2;  // how much log info
 
@@ -162,6 +201,7 @@ static int (*orig_fegetenv)(fenv_t *envp) = 0;
 static int (*orig_feholdexcept)(fenv_t *envp) = 0;
 static int (*orig_fesetenv)(const fenv_t *envp) = 0;
 static int (*orig_feupdateenv)(const fenv_t *envp) = 0;
+static int (*orig_dlclose)(void *handle) = 0;
 
 //
 // stashes of sigactions we override, available so that we can
@@ -211,62 +251,233 @@ static struct sigaction oldsa_fpe, oldsa_trap, oldsa_int, oldsa_alrm;
 //
 // Allocator for monitoring contexts
 //
+// Lookups happen on every SIGFPE/SIGTRAP, so they must be cheap and
+// async-signal-safe.  A thread finds its own context through a
+// thread-local pointer.  Everything else goes through an open-addressed
+// table keyed by tid.  Slots are released by leaving a tombstone, so
+// no lookup ever takes a lock, and a timer signal landing in the middle
+// of an allocation cannot deadlock us.   Claiming and releasing slots,
+// and any walk of the tables that looks at other threads' contexts, is
+// done with writer_lock held (see below), so a context is never freed
+// under someone looking at it, and tombstones can be reclaimed.
+//
+// Contexts themselves (and their trace buffers) are mapped on demand
+// by the thread that owns them, so they are page (and thus cache line)
+// aligned and first touched on that thread's NUMA node.   When a table
+// fills, a table twice its size is chained after it, so there is no
+// hard limit on the number of threads.
+//
 
-static int context_lock;
-static monitoring_context_t context[CONFIG_MAX_CONTEXTS];
+#define CONTEXT_FREE 0   // slot has never been used - ends a probe
+#define CONTEXT_DEAD -1  // slot was used and released - probes continue past it
 
+typedef struct context_slot {
+  int tid;
+  monitoring_context_t *mc;
+} context_slot_t;
+
+typedef struct context_table {
+  struct context_table *next;  // larger table to use once this one is full
+  int size;
+  int live;  // slots holding a tid
+  context_slot_t slot[];
+} context_table_t;
+
+static struct {
+  context_table_t table;
+  context_slot_t slot[CONFIG_MAX_CONTEXTS];
+} first_context_table;
+
+#define context_tables (&first_context_table.table)
+
+// initial-exec so that access is a simple fs-relative load, even in a handler
+static __thread monitoring_context_t *my_context __attribute__((tls_model("initial-exec")));
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lock_writer(sigset_t *old) {
+  sigset_t mask;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &mask, old);
+  pthread_mutex_lock(&writer_lock);
+}
+
+static void unlock_writer(sigset_t *old) {
+  pthread_mutex_unlock(&writer_lock);
+  pthread_sigmask(SIG_SETMASK, old, 0);
+}
+
+// number of trace records each context buffers before writing
+static uint64_t trace_buflen = CONFIG_TRACE_BUFLEN;
+// and the most FPSPY_TRACE_BUFLEN may ask for (768 MB per thread)
+#define TRACE_BUFLEN_MAX (1UL << 24)
 
 
 static void init_monitoring_contexts() {
-  memset(context, 0, sizeof(context));
-  context_lock = 0;
+  memset(&first_context_table, 0, sizeof(first_context_table));
+  context_tables->size = CONFIG_MAX_CONTEXTS;
+  my_context = 0;
 }
 
-static void lock_contexts() {
-  while (!__sync_bool_compare_and_swap(&context_lock, 0, 1)) {
+static inline int context_hash(int tid, int size) {
+  return (int)(((uint32_t)tid * 0x9e3779b1U) % size);
+}
+
+static context_slot_t *find_context_slot(int tid) {
+  context_table_t *t;
+  int i, h;
+
+  for (t = context_tables; t; t = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE)) {
+    h = context_hash(tid, t->size);
+    for (i = 0; i < t->size; i++) {
+      context_slot_t *s = &t->slot[(h + i) % t->size];
+      int cur = __atomic_load_n(&s->tid, __ATOMIC_ACQUIRE);
+      if (cur == tid) {
+        return s;
+      }
+      if (cur == CONTEXT_FREE) {
+        break;
+      }
+    }
   }
+  return 0;
 }
 
-static void unlock_contexts() { __sync_and_and_fetch(&context_lock, 0); }
+monitoring_context_t *find_monitoring_context(int tid) {
+  monitoring_context_t *mc = my_context;
+  context_slot_t *s;
 
+  // fast path - our own context.   The tid check catches a
+  // pointer inherited across fork()
+  if (mc && mc->tid == tid) {
+    return mc;
+  }
 
-monitoring_context_t *find_monitoring_context(int tid) {
-  int i;
-  lock_contexts();
-  for (i = 0; i < CONFIG_MAX_CONTEXTS; i++) {
-    if (context[i].tid == tid) {
-      unlock_contexts();
-      return &context[i];
+  s = find_context_slot(tid);
+
+  return s ? __atomic_load_n(&s->mc, __ATOMIC_ACQUIRE) : 0;
+}
+
+// invoked with writer_lock held
+static context_slot_t *claim_context_slot(int tid) {
+  context_table_t *t, *n;
+  int i, h;
+
+  for (t = context_tables;; t = n) {
+    h = context_hash(tid, t->size);
+    for (i = 0; i < t->size; i++) {
+      context_slot_t *s = &t->slot[(h + i) % t->size];
+      if (s->tid == CONTEXT_FREE || s->tid == CONTEXT_DEAD) {
+        __atomic_store_n(&s->tid, tid, __ATOMIC_RELEASE);
+        t->live++;
+        return s;
+      }
+    }
+    if (!(n = t->next)) {
+      // this table is full, so chain a larger one after it
+      size_t len = sizeof(context_table_t) + 2 * t->size * sizeof(context_slot_t);
+      n = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (n == MAP_FAILED) {
+        ERROR("Cannot allocate context table\n");
+        return 0;
+      }
+      n->size = 2 * t->size;
+      __atomic_store_n(&t->next, n, __ATOMIC_RELEASE);
+      DEBUG("context table grown to %d slots\n", n->size);
     }
   }
-  unlock_contexts();
-  return 0;
 }
 
-static monitoring_context_t *alloc_monitoring_context(int tid) {
+// invoked with writer_lock held
+static void release_context_slot(context_slot_t *s) {
+  context_table_t *t;
   int i;
-  lock_contexts();
-  for (i = 0; i < CONFIG_MAX_CONTEXTS; i++) {
-    if (!context[i].tid) {
-      context[i].tid = tid;
-      unlock_contexts();
-      return &context[i];
+
+  for (t = context_tables; s < t->slot || s >= t->slot + t->size; t = t->next) {
+  }
+
+  __atomic_store_n(&s->mc, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&s->tid, CONTEXT_DEAD, __ATOMIC_RELEASE);
+
+  if (!--t->live) {
+    // no tid left to find, so all the tombstones can go
+    for (i = 0; i < t->size; i++) {
+      __atomic_store_n(&t->slot[i].tid, CONTEXT_FREE, __ATOMIC_RELEASE);
     }
+    return;
+  }
+
+  // a tombstone followed by a never-used slot ends no probe that the
+  // latter would not end, so it can be made never-used too, and so
+  // can any tombstones that then precede it.   Otherwise, misses would
+  // come to scan the whole table once every slot had been used
+  i = s - t->slot;
+  while (t->slot[i].tid == CONTEXT_DEAD && t->slot[(i + 1) % t->size].tid == CONTEXT_FREE) {
+    __atomic_store_n(&t->slot[i].tid, CONTEXT_FREE, __ATOMIC_RELEASE);
+    i = (i + t->size - 1) % t->size;
   }
-  unlock_contexts();
-  return 0;
 }
 
+// always invoked by the thread that will own the context
+static monitoring_context_t *alloc_monitoring_context(int tid) {
+  monitoring_context_t *mc;
+  context_slot_t *s;
+  sigset_t old;
+  size_t len = sizeof(monitoring_context_t);
+
+  if (create_monitor_file && mode == INDIVIDUAL && output != OUTPUT_MMAP) {
+    len += trace_buflen * sizeof(individual_trace_record_t);
+  }
+  len = (len + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+
+  mc = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mc == MAP_FAILED) {
+    return 0;
+  }
+
+  mc->alloc_len = len;
+  mc->tid = tid;
+
+  lock_writer(&old);
+  if (!(s = claim_context_slot(tid))) {
+    unlock_writer(&old);
+    munmap(mc, len);
+    return 0;
+  }
+  __atomic_store_n(&s->mc, mc, __ATOMIC_RELEASE);
+  unlock_writer(&old);
+
+  my_context = mc;
+
+  return mc;
+}
+
+// invoked with writer_lock held
 static void free_monitoring_context(int tid) {
-  int i;
-  lock_contexts();
-  for (i = 0; i < CONFIG_MAX_CONTEXTS; i++) {
-    if (context[i].tid == tid) {
-      context[i].tid = 0;
-      unlock_contexts();
+  context_slot_t *s = find_context_slot(tid);
+  monitoring_context_t *mc;
+
+  if (s) {
+    mc = s->mc;
+    if (my_context == mc) {
+      my_context = 0;
+    }
+    release_context_slot(s);
+    if (mc) {
+      munmap(mc, mc->alloc_len);
     }
   }
-  unlock_contexts();
+}
+
+// for a context that bringup fails to finish
+static void discard_monitoring_context(int tid) {
+  sigset_t old;
+
+  lock_writer(&old);
+  free_monitoring_context(tid);
+  unlock_writer(&old);
 }
 
 //
@@ -357,87 +568,1087 @@ static uint64_t next_exp(sampler_state_t *s, uint64_t mean_us) {
 // Output helpers
 //
 
-static void stringify_current_fe_exceptions(char *buf) {
+// flags are FE_* values, plus FE_DENORM
+static void stringify_fe_exceptions(char *buf, int flags) {
   int have = 0;
   buf[0] = 0;
 
-#define FE_HANDLE(x)          \
-  if (orig_fetestexcept(x)) { \
-    if (!have) {              \
-      strcat(buf, #x);        \
-      have = 1;               \
-    } else {                  \
-      strcat(buf, " " #x);    \
-    }                         \
+#define FE_HANDLE(x)       \
+  if (flags & (x)) {       \
+    if (!have) {           \
+      strcat(buf, #x);     \
+      have = 1;            \
+    } else {               \
+      strcat(buf, " " #x); \
+    }                      \
   }
   FE_HANDLE(FE_DIVBYZERO);
   FE_HANDLE(FE_INEXACT);
   FE_HANDLE(FE_INVALID);
   FE_HANDLE(FE_OVERFLOW);
   FE_HANDLE(FE_UNDERFLOW);
-  if (arch_have_special_fp_csr_exception(FE_DENORM)) {
-    if (have) {
-      strcat(buf, " ");
+  FE_HANDLE(FE_DENORM);
+
+  if (!have) {
+    strcpy(buf, "NO_EXCEPTIONS_RECORDED");
+  }
+}
+
+static int current_fe_exceptions(void) {
+  return orig_fetestexcept(FE_ALL_EXCEPT) |
+         (arch_have_special_fp_csr_exception(FE_DENORM) ? FE_DENORM : 0);
+}
+
+static void stringify_current_fe_exceptions(char *buf) {
+  stringify_fe_exceptions(buf, current_fe_exceptions());
+}
+
+static __attribute__((unused)) void show_current_fe_exceptions() {
+  char buf[80];
+  stringify_current_fe_exceptions(buf);
+  INFO("%s\n", buf);
+}
+
+static int writeall(int fd, void *buf, int len) {
+  int n;
+  int left = len;
+
+  do {
+    n = write(fd, buf, left);
+    if (n < 0) {
+      return -1;
+    }
+    left -= n;
+    buf += n;
+  } while (left > 0);
+
+  return 0;
+}
+
+
+//
+// Process container files (thread output, FPSPY_CONTAINER)
+//
+// Instead of each thread having a trace file of its own, the traces of
+// all of a process's threads go into a single container file (see
+// trace_record.h).   What would be written to a thread's file is
+// instead staged in its chunk buffer, which is appended to the
+// container as a chunk when it fills, and when the thread's header is
+// rewritten, so chunks are large and never interleave.   Appends happen
+// under the writer lock, except for the header staged by a new thread
+// before it can have any records.
+//
+
+static int container_fd = -1;
+static uint32_t trace_chunk_size = (uint32_t)CONFIG_TRACE_CHUNK_SIZE * 1024;
+
+static trace_chunker_t *alloc_chunker(uint32_t size) {
+  trace_chunker_t *c;
+  size_t len = sizeof(trace_chunker_t) + size;
+
+  len = (len + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+
+  c = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (c == MAP_FAILED) {
+    return 0;
+  }
+
+  c->alloc_len = len;
+  c->size = size;
+
+  return c;
+}
+
+static void free_chunker(trace_chunker_t *c) {
+  if (c) {
+    munmap(c, c->alloc_len);
+  }
+}
+
+static int open_container(void) {
+  trace_container_header_t h;
+  struct timespec rt;
+  char name[80];
+
+  sprintf(name, "__%s.%lu.%d.container.fpemon", program_invocation_short_name, time(0), getpid());
+
+  if ((container_fd = open(name, O_CREAT | O_WRONLY | O_TRUNC | O_APPEND, 0666)) < 0) {
+    ERROR("Cannot open container file\n");
+    return -1;
+  }
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TRACE_CONTAINER_MAGIC, sizeof(h.magic));
+  h.version = TRACE_CONTAINER_VERSION;
+  h.header_size = sizeof(h);
+#if defined(x64)
+  h.arch = TRACE_ARCH_X64;
+#elif defined(arm64)
+  h.arch = TRACE_ARCH_ARM64;
+#elif defined(riscv64)
+  h.arch = TRACE_ARCH_RISCV64;
+#endif
+  h.pid = getpid();
+  clock_gettime(CLOCK_REALTIME, &rt);
+  h.start_realtime_ns = rt.tv_sec * 1000000000ULL + rt.tv_nsec;
+
+  if (writeall(container_fd, &h, sizeof(h))) {
+    ERROR("Cannot write container file header\n");
+    close(container_fd);
+    container_fd = -1;
+    return -1;
+  }
+
+  DEBUG("Writing traces to container %s\n", name);
+
+  return 0;
+}
+
+// append what the thread has staged as a chunk
+static int flush_trace_chunk(monitoring_context_t *mc) {
+  trace_chunker_t *c = mc->chunks;
+  int rc;
+
+  if (!c->len) {
+    return 0;
+  }
+
+  c->header.magic = TRACE_CHUNK_MAGIC;
+  c->header.tid = mc->tid;
+  c->header.len = c->len;
+  c->header.flags = 0;
+  c->header.offset = c->offset;
+
+  rc = writeall(container_fd, &c->header, sizeof(c->header) + c->len);
+
+  c->offset += c->len;
+  c->len = 0;
+
+  return rc;
+}
+
+// write to the thread's trace, wherever it lives
+static int write_trace(monitoring_context_t *mc, void *buf, uint64_t len) {
+  trace_chunker_t *c = mc->chunks;
+  int rc = 0;
+
+  if (!c) {
+    return writeall(mc->fd, buf, len);
+  }
+
+  while (len > 0) {
+    uint64_t n = c->size - c->len;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(c->data + c->len, buf, n);
+    c->len += n;
+    buf += n;
+    len -= n;
+    if (c->len == c->size) {
+      rc |= flush_trace_chunk(mc);
+    }
+  }
+
+  return rc;
+}
+
+// update the header at the start of the thread's trace
+static int rewrite_trace_header(monitoring_context_t *mc, trace_file_header_t *h) {
+  struct {
+    trace_chunk_header_t ch;
+    trace_file_header_t h;
+  } __attribute__((packed)) c;
+
+  if (!mc->chunks) {
+    return pwrite(mc->fd, h, sizeof(*h), 0) == sizeof(*h) ? 0 : -1;
+  }
+
+  if (flush_trace_chunk(mc)) {
+    return -1;
+  }
+
+  c.ch.magic = TRACE_CHUNK_MAGIC;
+  c.ch.tid = mc->tid;
+  c.ch.len = sizeof(*h);
+  c.ch.flags = 0;
+  c.ch.offset = 0;
+  c.h = *h;
+
+  return writeall(container_fd, &c, sizeof(c));
+}
+
+
+//
+// Trace file headers and record encoding
+//
+// Unless the legacy format is requested, a trace file starts with a
+// header describing the thread and how to interpret the records, and the
+// records themselves are delta encoded (see trace_codec.h).   For the
+// file-based outputs, the header is rewritten at teardown with the final
+// counts, and the cycle frequency measured over the thread's lifetime.
+//
+
+static void init_trace_header(monitoring_context_t *mc, trace_file_header_t *h) {
+  struct timespec rt, mt;
+
+  trace_codec_reset(&mc->codec);
+
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, TRACE_FILE_MAGIC, sizeof(h->magic));
+  h->version = TRACE_FILE_VERSION;
+  h->header_size = sizeof(*h);
+  h->record_size = trace_format == 1 ? sizeof(individual_trace_record_t) : 0;
+  h->record_format = trace_format == 1 ? TRACE_RECORD_FIXED : TRACE_RECORD_DELTA;
+#if defined(x64)
+  h->arch = TRACE_ARCH_X64;
+#elif defined(arm64)
+  h->arch = TRACE_ARCH_ARM64;
+#elif defined(riscv64)
+  h->arch = TRACE_ARCH_RISCV64;
+#endif
+  h->pid = getpid();
+  h->tid = mc->tid;
+  // record times are relative to start_cycles, which is read along
+  // with the clocks, so that traces can be put on a common timeline
+  clock_gettime(CLOCK_REALTIME, &rt);
+  clock_gettime(CLOCK_MONOTONIC, &mt);
+  mc->start_time = arch_cycle_count();
+  h->start_cycles = mc->start_time;
+  h->start_realtime_ns = rt.tv_sec * 1000000000ULL + rt.tv_nsec;
+  h->start_monotonic_ns = mt.tv_sec * 1000000000ULL + mt.tv_nsec;
+  h->except_mask = enabled_fp_traps;
+  memcpy(h->sample_period, (void *)sample_period, sizeof(h->sample_period));
+  h->site_throttle = site_throttle;
+  h->overhead_budget = overhead_budget;
+  if (compress) {
+    h->flags |= TRACE_FILE_BLOCKS;
+  }
+  if (control_round_config) {
+    h->flags |= TRACE_FILE_FORCED_ROUND;
+    h->round_config = our_round_config;
+  } else {
+    h->round_config = orig_round_config;
+  }
+}
+
+// fill in what we know only at the end
+static void finish_trace_header(monitoring_context_t *mc, trace_file_header_t *h) {
+  struct timespec mt;
+  uint64_t cycles = arch_cycle_count();
+  uint64_t ns;
+
+  clock_gettime(CLOCK_MONOTONIC, &mt);
+  ns = mt.tv_sec * 1000000000ULL + mt.tv_nsec - h->start_monotonic_ns;
+  if (ns > 0) {
+    // integer math, as we may be running with traps enabled
+    h->cycle_freq = (unsigned __int128)(cycles - h->start_cycles) * 1000000000ULL / ns;
+  }
+  if (!control_round_config) {
+    h->round_config = orig_round_config;
+  }
+  memcpy(h->sample_seen, mc->sample_seen, sizeof(h->sample_seen));
+  memcpy(h->sample_recorded, mc->sample_recorded, sizeof(h->sample_recorded));
+}
+
+//
+// Block compression (thread output, FPSPY_COMPRESS)
+//
+// The writer thread encodes records into a per-thread block buffer
+// instead of writing them, and when the buffer fills, compresses it
+// (trace_lz.h) and writes it as a block.   Each block starts with
+// fresh codec state and redefines the instructions it refers to, so
+// blocks can be decoded independently.   An index of the blocks is
+// appended at teardown.   None of this happens in a signal handler.
+//
+
+static uint32_t trace_block_size = (uint32_t)CONFIG_TRACE_BLOCK_SIZE * 1024;
+
+static trace_blocker_t *alloc_blocker(uint32_t size) {
+  trace_blocker_t *b;
+  size_t len = sizeof(trace_blocker_t) + size + TRACE_LZ_BOUND(size);
+
+  len = (len + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+
+  b = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (b == MAP_FAILED) {
+    return 0;
+  }
+
+  b->index = mmap(0, getpagesize(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (b->index == MAP_FAILED) {
+    munmap(b, len);
+    return 0;
+  }
+
+  b->alloc_len = len;
+  b->size = size;
+  b->index_alloc_len = getpagesize();
+  b->stored = b->raw + size;
+
+  return b;
+}
+
+static void free_blocker(trace_blocker_t *b) {
+  if (b) {
+    munmap(b->index, b->index_alloc_len);
+    munmap(b, b->alloc_len);
+  }
+}
+
+// compress and write out the current block, if any
+static int write_trace_block(monitoring_context_t *mc) {
+  trace_blocker_t *b = mc->blocks;
+  trace_block_header_t bh;
+  trace_block_index_t *e;
+  uint8_t *data;
+
+  if (!b->record_count) {
+    return 0;
+  }
+
+  bh.magic = TRACE_BLOCK_MAGIC;
+  bh.raw_len = b->raw_len;
+  bh.record_count = b->record_count;
+  bh.first_time = b->first_time;
+  bh.last_time = b->last_time;
+  bh.stored_len = trace_lz_compress(b->raw, b->raw_len, b->stored, b->hash);
+  if (bh.stored_len < b->raw_len) {
+    bh.flags = TRACE_BLOCK_LZ;
+    data = b->stored;
+  } else {
+    bh.flags = 0;
+    bh.stored_len = b->raw_len;
+    data = b->raw;
+  }
+
+  if ((b->index_count + 1) * sizeof(trace_block_index_t) > b->index_alloc_len) {
+    void *n = mremap(b->index, b->index_alloc_len, b->index_alloc_len * 2, MREMAP_MAYMOVE);
+    if (n == MAP_FAILED) {
+      ERROR("Failed to grow block index\n");
+      return -1;
+    }
+    b->index = n;
+    b->index_alloc_len *= 2;
+  }
+  e = &b->index[b->index_count++];
+  e->offset = mc->trace_header.header_size + mc->bytes_written;
+  e->record_count = b->record_count;
+  e->first_time = b->first_time;
+  e->last_time = b->last_time;
+
+  b->raw_len = 0;
+  b->record_count = 0;
+
+  mc->bytes_written += sizeof(bh) + bh.stored_len;
+
+  return write_trace(mc, &bh, sizeof(bh)) || write_trace(mc, data, bh.stored_len) ? -1 : 0;
+}
+
+// add n records to the current block, writing it out as it fills
+static int block_trace_records(monitoring_context_t *mc, individual_trace_record_t *r, uint64_t n) {
+  trace_blocker_t *b = mc->blocks;
+  uint64_t i;
+  uint32_t j;
+  int rc = 0;
+
+  for (i = 0; i < n; i++) {
+    if (b->raw_len + TRACE_MAX_ENCODED > b->size) {
+      rc |= write_trace_block(mc);
+    }
+    if (!b->record_count) {
+      // a new block knows nothing of the previous ones
+      trace_codec_reset(&mc->codec);
+      for (j = 0; j < __atomic_load_n(&mc->instrs->count, __ATOMIC_ACQUIRE); j++) {
+        mc->instrs->entry[j].emitted = 0;
+      }
+      b->first_time = r[i].time;
+    }
+    b->raw_len += trace_encode_record(&mc->codec, mc->instrs->entry, &r[i], b->raw + b->raw_len);
+    b->last_time = r[i].time;
+    b->record_count++;
+  }
+
+  return rc;
+}
+
+// flush the last block and append the index
+static int finish_trace_blocks(monitoring_context_t *mc) {
+  trace_blocker_t *b = mc->blocks;
+  trace_file_header_t *h = &mc->trace_header;
+  int rc = write_trace_block(mc);
+
+  h->index_offset = h->header_size + mc->bytes_written;
+  h->block_count = b->index_count;
+
+  return rc | write_trace(mc, b->index, b->index_count * sizeof(trace_block_index_t));
+}
+
+// write n records to the trace file, encoding them as needed
+static int write_trace_records(monitoring_context_t *mc, individual_trace_record_t *r, uint64_t n) {
+  uint8_t buf[4096];
+  uint64_t i;
+  int len = 0;
+  int rc = 0;
+
+  if (mc->blocks) {
+    rc = block_trace_records(mc, r, n);
+  } else if (trace_format == 1) {
+    rc = write_trace(mc, r, n * sizeof(individual_trace_record_t));
+    mc->bytes_written += n * sizeof(individual_trace_record_t);
+  } else {
+    for (i = 0; i < n; i++) {
+      if (len + TRACE_MAX_ENCODED > sizeof(buf)) {
+        rc |= write_trace(mc, buf, len);
+        mc->bytes_written += len;
+        len = 0;
+      }
+      len += trace_encode_record(&mc->codec, mc->instrs ? mc->instrs->entry : 0, &r[i], buf + len);
+    }
+    rc |= write_trace(mc, buf, len);
+    mc->bytes_written += len;
+  }
+
+  mc->records_written += n;
+
+  return rc;
+}
+
+static int flush_trace_records(monitoring_context_t *mc) {
+  if (trace_buflen == 0) {
+    return 0;
+  } else {
+    if (mc->trace_record_count > 0) {
+      int rc = write_trace_records(mc, mc->trace_records, mc->trace_record_count);
+      mc->trace_record_count = 0;
+      return rc;
+    } else {
+      return 0;
+    }
+  }
+}
+
+//
+// Background trace writer (thread output)
+//
+// Each thread publishes its trace records into a single-producer,
+// single-consumer ring (its trace_records buffer), and a writer thread
+// that FPSpy creates for itself drains all the rings to the trace files.
+// The handler thus normally makes no system calls: the writer wakes
+// periodically, and is only poked (futex) when a ring becomes half full.
+// When a ring is full, the handler either drops the record (and counts
+// it) or waits for the writer to catch up, depending on backpressure.
+//
+// The consumer side of the rings is serialized by writer_lock, which is
+// only taken by the writer, by threads tearing down their contexts, by
+// fork(), and at process exit.   The latter two also use it to keep
+// each other off the contexts they free or close, whatever the output
+// mode.   Process exit can be reached from our SIGINT handler, so
+// SIGINT is blocked whenever the lock is held, lest the handler find
+// its own thread holding it.
+//
+
+#define WRITER_PERIOD_NS 10000000ULL  // 10 ms
+
+static pthread_t writer_thread;
+volatile static int writer_running = 0;
+volatile static int writer_stop = 0;
+static uint32_t writer_signaled = 0;
+
+static inline long futex_wait(uint32_t *addr, uint32_t val, uint64_t timeout_ns) {
+  struct timespec ts = {timeout_ns / 1000000000ULL, timeout_ns % 1000000000ULL};
+  return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &ts, 0, 0);
+}
+
+static inline long futex_wake(uint32_t *addr, int count) {
+  return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, 0, 0, 0);
+}
+
+static void wake_writer(void) {
+  if (!__atomic_exchange_n(&writer_signaled, 1, __ATOMIC_ACQ_REL)) {
+    futex_wake(&writer_signaled, 1);
+  }
+}
+
+// producer side, only invoked by the thread that owns mc
+static int ring_push(monitoring_context_t *mc, individual_trace_record_t *tr) {
+  uint64_t head = mc->ring_head;
+  uint64_t tail = __atomic_load_n(&mc->ring_tail, __ATOMIC_ACQUIRE);
+
+  while (head - tail >= trace_buflen) {
+    uint32_t seq;
+    if (backpressure == BACKPRESSURE_DROP || !writer_running) {
+      mc->dropped++;
+      return 0;
+    }
+    seq = __atomic_load_n(&mc->ring_seq, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&mc->ring_waiting, 1, __ATOMIC_SEQ_CST);
+    wake_writer();
+    if (head - __atomic_load_n(&mc->ring_tail, __ATOMIC_SEQ_CST) >= trace_buflen) {
+      futex_wait(&mc->ring_seq, seq, WRITER_PERIOD_NS);
+    }
+    __atomic_store_n(&mc->ring_waiting, 0, __ATOMIC_RELEASE);
+    tail = __atomic_load_n(&mc->ring_tail, __ATOMIC_ACQUIRE);
+  }
+
+  mc->trace_records[head % trace_buflen] = *tr;
+  __atomic_store_n(&mc->ring_head, head + 1, __ATOMIC_RELEASE);
+
+  // poke the writer as we cross the high water mark
+  if (head + 1 - tail == (trace_buflen + 1) / 2) {
+    wake_writer();
+  }
+
+  return 0;
+}
+
+#if CONFIG_TRAP_SHORT_CIRCUITING
+#define KERNEL_RING_BATCH 64
+
+// The kernel module can record a thread's events itself, into a ring
+// the thread maps (kring), in which case the thread never sees them,
+// and the writer drains that ring as well, with writer_lock held.
+// Its records are trace records, but timed in absolute cycles
+static int drain_kernel_ring(monitoring_context_t *mc) {
+  fpvm_ring_t *r = mc->kring;
+  individual_trace_record_t buf[KERNEL_RING_BATCH];
+  uint64_t tail = r->tail;
+  uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  uint64_t n;
+  int rc = 0;
+
+  while (tail != head) {
+    for (n = 0; n < KERNEL_RING_BATCH && tail != head; n++, tail++) {
+      memcpy(&buf[n], &r->rec[tail % r->size], sizeof(buf[n]));
+      buf[n].time -= mc->start_time;
+    }
+    if (write_trace_records(mc, buf, n)) {
+      rc = -1;
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  return rc;
+}
+#endif
+
+// consumer side, invoked with writer_lock held
+static int drain_ring(monitoring_context_t *mc) {
+  uint64_t tail = mc->ring_tail;
+  uint64_t head;
+  int rc = 0;
+
+#if CONFIG_TRAP_SHORT_CIRCUITING
+  if (mc->kring && drain_kernel_ring(mc)) {
+    rc = -1;
+  }
+#endif
+
+  head = __atomic_load_n(&mc->ring_head, __ATOMIC_ACQUIRE);
+
+  if (tail == head) {
+    return rc;
+  }
+
+  while (tail != head) {
+    uint64_t i = tail % trace_buflen;
+    uint64_t n = head - tail;
+    if (n > trace_buflen - i) {
+      n = trace_buflen - i;
+    }
+    if (write_trace_records(mc, &mc->trace_records[i], n)) {
+      rc = -1;
+    }
+    tail += n;
+    __atomic_store_n(&mc->ring_tail, tail, __ATOMIC_RELEASE);
+  }
+
+  __atomic_add_fetch(&mc->ring_seq, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&mc->ring_waiting, __ATOMIC_SEQ_CST)) {
+    futex_wake(&mc->ring_seq, 1);
+  }
+
+  return rc;
+}
+
+static void flush_polls(monitoring_context_t *mc);
+
+// invoked with writer_lock held
+static void drain_all_rings(void) {
+  context_table_t *t;
+  int i;
+
+  for (t = context_tables; t; t = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE)) {
+    for (i = 0; i < t->size; i++) {
+      monitoring_context_t *mc = __atomic_load_n(&t->slot[i].mc, __ATOMIC_ACQUIRE);
+      if (mc && mc->poller) {
+        flush_polls(mc);
+      } else if (mc && drain_ring(mc)) {
+        ERROR("Failed to write trace records for thread %d\n", mc->tid);
+      }
+    }
+  }
+}
+
+static void *writer_main(void *arg) {
+  arch_fp_csr_t old;
+
+  // this thread must never see an FP trap
+  arch_config_machine_fp_csr_for_local(&old);
+
+  DEBUG("trace writer running as thread %d\n", gettid());
+
+  while (!writer_stop) {
+    futex_wait(&writer_signaled, 0, WRITER_PERIOD_NS);
+    __atomic_store_n(&writer_signaled, 0, __ATOMIC_RELEASE);
+    // all our signals are blocked, so no need for lock_writer()
+    pthread_mutex_lock(&writer_lock);
+    drain_all_rings();
+    pthread_mutex_unlock(&writer_lock);
+  }
+
+  return 0;
+}
+
+// the writer is created directly, so our pthread_create wrapper
+// does not see it, and with all signals blocked, so that it never
+// handles the target's signals or ours
+static int start_writer(void) {
+  sigset_t all, old;
+  int rc;
+
+  writer_stop = 0;
+  writer_signaled = 0;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  rc = orig_pthread_create(&writer_thread, 0, writer_main, 0);
+  pthread_sigmask(SIG_SETMASK, &old, 0);
+
+  if (rc) {
+    ERROR("Cannot create trace writer thread\n");
+    return -1;
+  }
+
+  writer_running = 1;
+
+  return 0;
+}
+
+static void stop_writer(void) {
+  if (writer_running) {
+    // producers stop waiting on the writer from here on
+    writer_running = 0;
+    writer_stop = 1;
+    wake_writer();
+    pthread_join(writer_thread, 0);
+    DEBUG("trace writer stopped\n");
+  }
+}
+
+//
+// Memory-mapped trace files (mmap output)
+//
+// The handler stores records directly into a shared mapping of the
+// trace file, so there is no buffering and no write() at all, and
+// everything committed survives the target crashing or being killed.
+// The file is extended, and the mapping moved, a chunk at a time, so
+// the handler only makes system calls once per chunk.  The header at
+// the start of the file, which is mapped separately, records how much
+// has been committed.
+//
+
+static uint64_t trace_mmap_chunk = (uint64_t)CONFIG_TRACE_MMAP_CHUNK * 1024;
+
+static int mmap_trace_open(monitoring_context_t *mc) {
+  trace_file_header_t *h;
+
+  if (ftruncate(mc->fd, trace_mmap_chunk)) {
+    return -1;
+  }
+
+  h = mmap(0, getpagesize(), PROT_READ | PROT_WRITE, MAP_SHARED, mc->fd, 0);
+  if (h == MAP_FAILED) {
+    return -1;
+  }
+
+  *h = mc->trace_header;
+  h->flags |= TRACE_FILE_COUNTED;
+
+  mc->header = h;
+  mc->window = 0;
+  mc->window_offset = 0;
+
+  return 0;
+}
+
+// map the chunk of the file containing offset, extending the file if needed
+static int mmap_trace_move_window(monitoring_context_t *mc, uint64_t offset) {
+  uint64_t start = offset - offset % trace_mmap_chunk;
+  uint8_t *w;
+
+  if (mc->window) {
+    munmap(mc->window, trace_mmap_chunk);
+    mc->window = 0;
+  }
+
+  if (ftruncate(mc->fd, start + trace_mmap_chunk)) {
+    return -1;
+  }
+
+  w = mmap(0, trace_mmap_chunk, PROT_READ | PROT_WRITE, MAP_SHARED, mc->fd, start);
+  if (w == MAP_FAILED) {
+    return -1;
+  }
+
+  mc->window = w;
+  mc->window_offset = start;
+
+  return 0;
+}
+
+static int mmap_trace_store(monitoring_context_t *mc, const void *data, uint64_t len) {
+  trace_file_header_t *h = mc->header;
+  uint64_t offset = h->header_size + h->data_len;
+  const uint8_t *p = data;
+
+  while (len > 0) {
+    uint64_t n;
+    if (!mc->window || offset >= mc->window_offset + trace_mmap_chunk) {
+      if (mmap_trace_move_window(mc, offset)) {
+        return -1;
+      }
+    }
+    n = mc->window_offset + trace_mmap_chunk - offset;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(mc->window + (offset - mc->window_offset), p, n);
+    offset += n;
+    p += n;
+    len -= n;
+  }
+
+  // the data must be in place before the counts that cover it
+  __atomic_store_n(&h->data_len, offset - h->header_size, __ATOMIC_RELEASE);
+  __atomic_store_n(&h->record_count, h->record_count + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+// trim trims the file to what has been committed
+static void mmap_trace_close(monitoring_context_t *mc, int trim) {
+  if (mc->window) {
+    munmap(mc->window, trace_mmap_chunk);
+    mc->window = 0;
+  }
+  if (mc->header) {
+    if (trim) {
+      finish_trace_header(mc, mc->header);
+      if (ftruncate(mc->fd, mc->header->header_size + mc->header->data_len)) {
+        ERROR("Failed to trim trace file\n");
+      }
+    }
+    munmap(mc->header, getpagesize());
+    mc->header = 0;
+  }
+}
+
+// A thread touches its files and its sites only between these, so
+// that process exit can take them over while the thread still runs
+// (close_running_context()), after which the thread records nothing
+static inline int begin_recording(monitoring_context_t *mc) {
+  __atomic_store_n(&mc->recording, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&mc->closed, __ATOMIC_SEQ_CST)) {
+    __atomic_store_n(&mc->recording, 0, __ATOMIC_RELEASE);
+    return 0;
+  }
+  return 1;
+}
+
+static inline void end_recording(monitoring_context_t *mc) {
+  __atomic_store_n(&mc->recording, 0, __ATOMIC_RELEASE);
+}
+
+#define CLOSE_WAIT_NS 1000000ULL  // 1 ms
+#define CLOSE_WAITS 100
+
+// 0 => the context of a running thread is now ours to finish
+static int close_running_context(monitoring_context_t *mc) {
+  struct timespec ts = {0, CLOSE_WAIT_NS};
+  int i;
+
+  __atomic_store_n(&mc->closed, 1, __ATOMIC_SEQ_CST);
+
+  // it may be in the middle of recording an event
+  for (i = 0; i < CLOSE_WAITS && __atomic_load_n(&mc->recording, __ATOMIC_SEQ_CST); i++) {
+    nanosleep(&ts, 0);
+  }
+
+  return __atomic_load_n(&mc->recording, __ATOMIC_SEQ_CST) ? -1 : 0;
+}
+
+static inline int push_trace_record(monitoring_context_t *mc, individual_trace_record_t *tr) {
+  if (output == OUTPUT_THREAD) {
+    return ring_push(mc, tr);
+  } else if (output == OUTPUT_MMAP) {
+    if (trace_format == 1) {
+      return mmap_trace_store(mc, tr, sizeof(*tr));
+    } else {
+      uint8_t buf[TRACE_MAX_ENCODED];
+      return mmap_trace_store(
+          mc, buf, trace_encode_record(&mc->codec, mc->instrs ? mc->instrs->entry : 0, tr, buf));
+    }
+  } else if (trace_buflen == 0) {
+    return write_trace_records(mc, tr, 1);
+  } else {
+    mc->trace_records[mc->trace_record_count] = *tr;
+    mc->trace_record_count++;
+    if (mc->trace_record_count >= trace_buflen) {  // should never be > ...
+      return flush_trace_records(mc);
+    } else {
+      return 0;
+    }
+  }
+}
+
+
+//
+// Site tables (sites mode, and per-site throttling)
+//
+// Instead of a trace record per event, each thread keeps one entry per
+// distinct trapping instruction (site), keyed by rip, with counts per
+// si_code.   A table is only touched by its owning thread, in the FP
+// trap handler and at teardown, so it needs no synchronization.
+// When a table is 3/4 full, it is replaced by one twice its size.
+//
+// In individual mode, with FPSPY_SITE_THROTTLE=k, the table is also
+// kept, and is used to throttle the recording of hot sites.   The first
+// k events at a site are recorded, and then every 2nd, then every 4th,
+// and so on, the gap doubling each time k/2 events have been recorded
+// at the current gap.   A hot site thus costs O(k log n) records for n
+// events, while every event is still counted, and the counts are
+// written to a sites file next to the trace.
+//
+
+static site_table_t *alloc_site_table(uint64_t size) {
+  site_table_t *t;
+  size_t len = sizeof(site_table_t) + size * sizeof(site_t);
+
+  len = (len + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+
+  t = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (t == MAP_FAILED) {
+    return 0;
+  }
+
+  t->alloc_len = len;
+  t->size = size;
+  t->count = 0;
+
+  return t;
+}
+
+static void free_site_table(site_table_t *t) {
+  if (t) {
+    munmap(t, t->alloc_len);
+  }
+}
+
+static inline uint64_t site_hash(void *rip, uint64_t size) {
+  return (((uint64_t)rip * 0x9e3779b97f4a7c15ULL) >> 32) & (size - 1);
+}
+
+// the slot holding rip, or the empty slot where it belongs
+static site_t *probe_site(site_table_t *t, void *rip) {
+  uint64_t i = site_hash(rip, t->size);
+
+  while (t->site[i].rip && t->site[i].rip != rip) {
+    i = (i + 1) & (t->size - 1);
+  }
+
+  return &t->site[i];
+}
+
+static int grow_site_table(monitoring_context_t *mc) {
+  site_table_t *old = mc->sites;
+  site_table_t *new;
+  uint64_t i;
+
+  if (!(new = alloc_site_table(old->size * 2))) {
+    return -1;
+  }
+
+  for (i = 0; i < old->size; i++) {
+    if (old->site[i].rip) {
+      *probe_site(new, old->site[i].rip) = old->site[i];
+    }
+  }
+  new->count = old->count;
+
+  mc->sites = new;
+  free_site_table(old);
+
+  DEBUG("site table grown to %lu sites\n", new->size);
+
+  return 0;
+}
+
+// the site for rip, which is created if needed
+static site_t *find_site(monitoring_context_t *mc, void *rip) {
+  site_t *s = probe_site(mc->sites, rip);
+
+  if (!s->rip) {
+    if (4 * (mc->sites->count + 1) > 3 * mc->sites->size) {
+      if (grow_site_table(mc)) {
+        return 0;
+      }
+      s = probe_site(mc->sites, rip);
+    }
+    s->rip = rip;
+    mc->sites->count++;
+  }
+
+  return s;
+}
+
+static site_t *record_site(monitoring_context_t *mc, siginfo_t *si, ucontext_t *uc) {
+  uint64_t now = arch_cycle_count() - mc->start_time;
+  site_t *s;
+  int len;
+
+  if (!(s = find_site(mc, (void *)arch_get_ip(uc)))) {
+    ERROR("Failed to find or create site\n");
+    return 0;
+  }
+
+  if (!s->count) {
+    // first time we have seen this site
+    if ((len = arch_get_instr_bytes(uc, s->instruction, MAX_INSTR_SIZE)) < 0) {
+      ERROR("Failed to fetch instruction bytes\n");
+      len = 0;
     }
-    strcat(buf, "FE_DENORM");
-    have = 1;
+    s->instruction_len = len;
+    s->first_time = now;
   }
 
-  if (!have) {
-    strcpy(buf, "NO_EXCEPTIONS_RECORDED");
+  s->last_time = now;
+  s->count++;
+  s->code_count[(si->si_code > 0 && si->si_code < SITE_CODES) ? si->si_code : 0]++;
+
+  return s;
+}
+
+// whether to record the event just counted at the site, as far as
+// throttling goes.  This must see every counted event, whether or not
+// sampling records it, or the schedule stops advancing
+static int throttle_site(site_t *s) {
+  if (s->count < site_throttle) {
+    return 1;
+  }
+  if (s->count == site_throttle) {
+    s->gap = 2;
+    s->next_record = s->count + s->gap;
+    s->at_gap = 0;
+    return 1;
+  }
+  if (s->count < s->next_record) {
+    return 0;
+  }
+  if (++s->at_gap >= (site_throttle + 1) / 2 && s->gap < (1ULL << 62)) {
+    s->gap *= 2;
+    s->at_gap = 0;
   }
+  s->next_record += s->gap;
+  return 1;
 }
 
-static __attribute__((unused)) void show_current_fe_exceptions() {
-  char buf[80];
-  stringify_current_fe_exceptions(buf);
-  INFO("%s\n", buf);
+static const char *site_code_name(int code) {
+  switch (code) {
+    case FPE_INTDIV:
+      return "FPE_INTDIV";
+    case FPE_INTOVF:
+      return "FPE_INTOVF";
+    case FPE_FLTDIV:
+      return "FPE_FLTDIV";
+    case FPE_FLTOVF:
+      return "FPE_FLTOVF";
+    case FPE_FLTUND:
+      return "FPE_FLTUND";
+    case FPE_FLTRES:
+      return "FPE_FLTRES";
+    case FPE_FLTINV:
+      return "FPE_FLTINV";
+    case FPE_FLTSUB:
+      return "FPE_FLTSUB";
+    default:
+      return "OTHER";
+  }
 }
 
-static int writeall(int fd, void *buf, int len) {
-  int n;
-  int left = len;
+// most frequent first
+static int site_compare(const void *a, const void *b) {
+  const site_t *l = a, *r = b;
+  return l->count < r->count ? 1 : l->count > r->count ? -1 : 0;
+}
 
-  do {
-    n = write(fd, buf, left);
-    if (n < 0) {
+// Sites file is text, one line per site, most frequent first:
+//   rip count first_time last_time instruction code:count ...
+// What is sorted and written is a copy of the table's sites
+static int write_sites(monitoring_context_t *mc, int fd) {
+  site_table_t *t = mc->sites;
+  size_t len = (t->count * sizeof(site_t) + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+  site_t *sorted = 0;
+  char buf[1024];
+  uint64_t i, count;
+  int j, n, rc = 0;
+
+  if (len) {
+    sorted = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (sorted == MAP_FAILED) {
       return -1;
     }
-    left -= n;
-    buf += n;
-  } while (left > 0);
+  }
 
-  return 0;
-}
+  for (i = count = 0; i < t->size && count < t->count; i++) {
+    if (t->site[i].rip) {
+      sorted[count++] = t->site[i];
+    }
+  }
 
+  qsort(sorted, count, sizeof(site_t), site_compare);
 
-static int flush_trace_records(monitoring_context_t *mc) {
-  if (CONFIG_TRACE_BUFLEN == 0) {
-    return 0;
-  } else {
-    if (mc->trace_record_count > 0) {
-      int rc = writeall(
-          mc->fd, mc->trace_records, mc->trace_record_count * sizeof(individual_trace_record_t));
-      mc->trace_record_count = 0;
-      return rc;
-    } else {
-      return 0;
+  for (i = 0; i < count; i++) {
+    site_t *s = &sorted[i];
+    n = sprintf(buf, "%016lx\t%lu\t%lu\t%lu\t", (uint64_t)s->rip, s->count, s->first_time,
+        s->last_time);
+    for (j = 0; j < s->instruction_len; j++) {
+      n += sprintf(buf + n, "%02x", s->instruction[j]);
+    }
+    for (j = 0; j < SITE_CODES; j++) {
+      if (s->code_count[j]) {
+        n += sprintf(buf + n, "\t%s:%lu", site_code_name(j), s->code_count[j]);
+      }
+    }
+    if (mode == INDIVIDUAL) {
+      n += sprintf(buf + n, "\tRECORDED:%lu", s->recorded);
+    }
+    buf[n++] = '\n';
+    if (writeall(fd, buf, n)) {
+      rc = -1;
+      break;
     }
   }
-}
 
-static inline int push_trace_record(monitoring_context_t *mc, individual_trace_record_t *tr) {
-  if (CONFIG_TRACE_BUFLEN == 0) {
-    return writeall(mc->fd, tr, sizeof(individual_trace_record_t));
-  } else {
-    mc->trace_records[mc->trace_record_count] = *tr;
-    mc->trace_record_count++;
-    if (mc->trace_record_count >= CONFIG_TRACE_BUFLEN) {  // should never be > ...
-      return flush_trace_records(mc);
-    } else {
-      return 0;
-    }
+  if (sorted) {
+    munmap(sorted, len);
   }
+
+  if (!rc && mc->state == ABORT) {
+    rc = writeall(fd, "ABORTED\n", 8);
+  }
+
+  return rc;
 }
 
 
@@ -449,12 +1660,106 @@ static void kick_self(void) {
 #endif
 }
 
+// Move the calling thread's monitoring context out of INIT state.
+// Where the architecture allows it, we set up its FP state directly,
+// otherwise we kick ourselves and brk_trap_handler does it
+static void start_self(void) {
+#if CONFIG_DIRECT_THREAD_BRINGUP
+  monitoring_context_t *mc = find_monitoring_context(gettid());
+
+  if (mc && mc->state == INIT) {
+    orig_round_config = arch_get_machine_round_config();
+    if (!arch_thread_init_direct(control_round_config ? &our_round_config : 0,
+            &mc->trap_mode_state)) {
+      mc->state = AWAIT_FPE;
+      DEBUG("state initialized directly - waiting for first SIGFPE\n");
+      return;
+    }
+    DEBUG("cannot initialize state directly, kicking instead\n");
+  }
+#endif
+  kick_self();
+}
+
 static __attribute__((constructor)) void fpspy_init(void);
 
 
+//
+// Instruction dictionaries (individual mode, v2 format)
+//
+// The trap handler fetches the bytes of an instruction only the first
+// time it traps, and afterwards hands the encoder the index of its
+// dictionary entry.   The encoder writes each entry into the trace
+// once, just ahead of the first record that refers to it.
+//
+
+static instr_dict_t *alloc_instr_dict(uint32_t size) {
+  instr_dict_t *d;
+  uint32_t capacity = size / 4 * 3;
+  size_t len = sizeof(instr_dict_t) + capacity * sizeof(trace_instr_t) + size * sizeof(uint32_t);
+
+  len = (len + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+
+  d = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (d == MAP_FAILED) {
+    return 0;
+  }
+
+  d->alloc_len = len;
+  d->size = size;
+  d->capacity = capacity;
+  d->count = 0;
+  d->slot = (uint32_t *)&d->entry[capacity];
+
+  return d;
+}
+
+static void free_instr_dict(instr_dict_t *d) {
+  if (d) {
+    munmap(d, d->alloc_len);
+  }
+}
+
+// fill in the instruction of r, as an index if possible
+static void get_record_instruction(
+    monitoring_context_t *mc, ucontext_t *uc, individual_trace_record_t *r) {
+  instr_dict_t *d = mc->instrs;
+  uint64_t i = 0;
+  int len;
+
+  if (d) {
+    i = site_hash(r->rip, d->size);
+    while (d->slot[i]) {
+      if (d->entry[d->slot[i] - 1].rip == (uint64_t)r->rip) {
+        trace_record_set_index(r, d->slot[i] - 1);
+        return;
+      }
+      i = (i + 1) & (d->size - 1);
+    }
+  }
+
+  if ((len = arch_get_instr_bytes(uc, (uint8_t *)r->instruction, MAX_INSTR_SIZE)) < 0) {
+    ERROR("Failed to fetch instruction bytes\n");
+    len = 0;
+  }
+  r->pad = 0;
+
+  if (d && d->count < d->capacity) {
+    trace_instr_t *e = &d->entry[d->count];
+    e->rip = (uint64_t)r->rip;
+    e->len = len;
+    memcpy(e->bytes, r->instruction, len);
+    d->slot[i] = ++d->count;
+    trace_record_set_index(r, d->count - 1);
+  }
+}
+
 //
 // Abort operation is invoked whenever FPSpy needs to "get out of the way"
 //
+static void stop_pollers(void);
+static int timer_signal(void);
+
 void abort_operation(char *reason) {
   if (!inited) {
     ERROR("Initializing before aborting\n");
@@ -467,11 +1772,18 @@ void abort_operation(char *reason) {
     ORIG_IF_CAN(feclearexcept, FE_ALL_EXCEPT);
     ORIG_IF_CAN(sigaction, SIGFPE, &oldsa_fpe, 0);
 
-    if (mode == INDIVIDUAL) {
+    if (mode == AGGREGATE && poll_us) {
+      stop_pollers();
+    }
+
+    if (mode != AGGREGATE) {
       monitoring_context_t *mc = find_monitoring_context(gettid());
 
       if (!mc) {
         ERROR("Cannot find monitoring context to write abort record\n");
+      } else if (mode == SITES) {
+        // the sites file notes the abort when it is written
+        mc->state = ABORT;
       } else {
         mc->state = ABORT;
 
@@ -481,8 +1793,11 @@ void abort_operation(char *reason) {
 
         r.time = arch_cycle_count() - mc->start_time;
 
-        if ((create_monitor_file != 0) && push_trace_record(mc, &r)) {
-          ERROR("Failed to push abort record\n");
+        if ((create_monitor_file != 0) && begin_recording(mc)) {
+          if (push_trace_record(mc, &r)) {
+            ERROR("Failed to push abort record\n");
+          }
+          end_recording(mc);
         }
       }
 
@@ -503,6 +1818,127 @@ void abort_operation(char *reason) {
   }
 }
 
+//
+// Code pages for breakpoints
+//
+// Where single stepping is not available to us, the architecture
+// backend inserts a breakpoint after the trapping instruction, and
+// thus needs to write to code pages.   Rather than making every
+// executable region writeable at startup, a page is made writeable
+// the first time a breakpoint goes into it, so that startup does not
+// depend on how many libraries are mapped, text pages that never hold
+// a breakpoint stay shared, and code loaded later (dlopen) is handled
+// the same way.   A breakpoint that straddles two pages (as after a
+// compressed riscv64 instruction) makes both writeable.
+//
+// The pages already made writeable are remembered in a fixed size,
+// open addressing table that is updated with compare and swap, since
+// the handlers of any thread come here.   Two threads racing to enable
+// the same page will both mprotect it, which is harmless.   If the
+// table fills, we simply mprotect every time.   What is remembered is
+// forgotten when the target unloads code with dlclose(), as something
+// else may be mapped there next, and when an mprotect fails.   Code
+// unmapped by other means (e.g., by a JIT) is not noticed.
+//
+#define CODE_PAGE_TABLE_SIZE 4096  // power of two
+
+// page address + 1 of each page made writeable, 0 => empty slot
+static uint64_t code_page_table[CODE_PAGE_TABLE_SIZE];
+static uint64_t code_page_count = 0;
+
+static inline uint64_t code_page_hash(uint64_t page) {
+  return ((page / getpagesize()) * 0x9e3779b97f4a7c15UL) >> 52;  // 12 bits
+}
+
+static int code_page_is_writeable(uint64_t page) {
+  uint64_t h = code_page_hash(page);
+  uint64_t key = page + 1;
+  uint64_t cur;
+  int i;
+
+  for (i = 0; i < CODE_PAGE_TABLE_SIZE; i++) {
+    cur = __atomic_load_n(&code_page_table[(h + i) & (CODE_PAGE_TABLE_SIZE - 1)], __ATOMIC_ACQUIRE);
+    if (cur == key) {
+      return 1;
+    }
+    if (!cur) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+static void code_page_set_writeable(uint64_t page) {
+  uint64_t h = code_page_hash(page);
+  uint64_t key = page + 1;
+  uint64_t cur;
+  int i;
+
+  for (i = 0; i < CODE_PAGE_TABLE_SIZE; i++) {
+    uint64_t *slot = &code_page_table[(h + i) & (CODE_PAGE_TABLE_SIZE - 1)];
+    cur = 0;
+    if (__atomic_compare_exchange_n(slot, &cur, key, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+      __atomic_add_fetch(&code_page_count, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    if (cur == key) {
+      return;
+    }
+  }
+  DEBUG("code page table full, page %p will be reenabled on each use\n", (void *)page);
+}
+
+static void forget_code_pages(void) {
+  int i;
+
+  if (__atomic_exchange_n(&code_page_count, 0, __ATOMIC_ACQ_REL)) {
+    for (i = 0; i < CODE_PAGE_TABLE_SIZE; i++) {
+      __atomic_store_n(&code_page_table[i], 0, __ATOMIC_RELEASE);
+    }
+    DEBUG("forgot which code pages are writeable\n");
+  }
+}
+
+// make the code from addr to addr+len writeable, page by page
+int make_code_writeable(void *addr, size_t len) {
+  uint64_t size = getpagesize();
+  uint64_t page = (uint64_t)addr & ~(size - 1);
+  uint64_t end = (uint64_t)addr + len;
+
+  for (; page < end; page += size) {
+    if (code_page_is_writeable(page)) {
+      continue;
+    }
+    if (mprotect((void *)page, size, PROT_READ | PROT_WRITE | PROT_EXEC)) {
+      ERROR("failed to mprotect code page %p as rwx\n", (void *)page);
+      // what we remember may be just as out of date
+      forget_code_pages();
+      return -1;
+    }
+    DEBUG("made code page %p writeable\n", (void *)page);
+    code_page_set_writeable(page);
+  }
+  return 0;
+}
+
+int dlclose(void *handle) {
+  int rc;
+
+  DEBUG("dlclose\n");
+
+  if (!orig_dlclose) {
+    ERROR("cannot call orig_dlclose returning -1\n");
+    return -1;
+  }
+
+  rc = orig_dlclose(handle);
+
+  forget_code_pages();
+
+  return rc;
+}
+
+
 //
 // function intercepts to manage FPSpy functionality
 // (handling processes/threads, in particular), and to
@@ -512,18 +1948,38 @@ void abort_operation(char *reason) {
 
 
 static int bringup_monitoring_context(int tid);
+static void forget_monitoring_contexts(void);
+static int bringup_poller(int tid);
+static int init_aggregate_rollup(void);
+static void reset_aggregate_rollup(void);
 
 //
 // fork() is wrapped so that we can bring up FPSpy on the child process
 //
 
 int fork() {
+  sigset_t old;
   int rc;
 
   DEBUG("fork\n");
 
+  // the child must not inherit a ring in the middle of being drained
+  if (output == OUTPUT_THREAD) {
+    lock_writer(&old);
+  }
+
   rc = orig_fork();
 
+  if (output == OUTPUT_THREAD) {
+    unlock_writer(&old);
+  } else if (rc == 0) {
+    // otherwise, a thread of the parent may have held writer_lock
+    // (to change the context tables, which the child forgets) and
+    // is not around to let go of it.   Holding it across the fork
+    // instead would deadlock atfork handlers that make us abort
+    pthread_mutex_init(&writer_lock, 0);
+  }
+
   if (aborted) {
     return rc;
   }
@@ -544,21 +2000,45 @@ int fork() {
     ORIG_IF_CAN(feclearexcept, enabled_fp_traps);
 
     // in aggregate mode, a distinct log file will be generated by the destructor
+    if (mode == AGGREGATE) {
+      reset_aggregate_rollup();
+    }
 
-    // make new context for individual mode
-    if (mode == INDIVIDUAL) {
+    // make new context for individual and sites modes
+    if (mode != AGGREGATE) {
+      // the contexts of the parent's threads are the parent's to flush
+      forget_monitoring_contexts();
+      // and the child has no writer thread yet
+      if (output == OUTPUT_THREAD) {
+        writer_running = 0;
+        if (start_writer()) {
+          ERROR("Failed to start trace writer at fork\n");
+          output = OUTPUT_INLINE;
+          compress = 0;
+          container = 0;
+          kernel_ring = 0;
+        }
+      }
+      // nor its own container
+      if (container) {
+        close(container_fd);
+        if (open_container()) {
+          ERROR("Failed to open container at fork\n");
+          container = 0;
+        }
+      }
       if (bringup_monitoring_context(gettid())) {
         ERROR("Failed to start up monitoring context at fork\n");
         // we won't break, however..
       } else {
         // we should have inherited all the sighandlers, etc, from our parent
 
-        // now kick ourselves to set the sse bits; we are currently in state INIT
+        // now set the sse bits; we are currently in state INIT
         // this will also do the architectural init
 
         // note that kickstart only applies to "top-level" process
         // not this child
-        kick_self();
+        start_self();
         // we should now be in the right state
       }
 
@@ -568,6 +2048,20 @@ int fork() {
         ERROR("Failed to bring up architectural state for thread\n");
         // we are doomed from this point
       }
+      if (poll_us) {
+        // the pollers of the parent's threads are the parent's to flush,
+        // and their timers did not come with us, nor the writer thread
+        forget_monitoring_contexts();
+        if (writer_running) {
+          writer_running = 0;
+          if (start_writer()) {
+            ERROR("Failed to start trace writer at fork\n");
+          }
+        }
+        if (bringup_poller(gettid())) {
+          ERROR("Failed to start polling at fork\n");
+        }
+      }
     }
 
     DEBUG("Done with setup on fork\n");
@@ -586,13 +2080,16 @@ int fork() {
 // context for the new thread, and tear it down on exit
 //
 
+#define TRAMP_WAIT_NS 1000000ULL  // 1 ms, just in case
+
 struct tramp_context {
   void *(*start)(void *);
   void *arg;
-  int done;
+  uint32_t done;
 };
 
 static void handle_aggregate_thread_exit();
+static int bringup_poller(int tid);
 
 // This is where a new thread stars now
 static void *trampoline(void *p) {
@@ -602,30 +2099,35 @@ static void *trampoline(void *p) {
   void *ret;
 
   // let our wrapper go - this must also be a software barrier
+  // c may be gone after this, but a stray wake is harmless
   __sync_fetch_and_or(&c->done, 1);
+  futex_wake(&c->done, 1);
 
   DEBUG("Setting up thread %d\n", gettid());
 
   // clear exceptions just in case
   ORIG_IF_CAN(feclearexcept, enabled_fp_traps);
 
-  if (mode == INDIVIDUAL) {
-    // make new context for individual mode
+  if (mode != AGGREGATE) {
+    // make new context for individual and sites modes
     if (bringup_monitoring_context(gettid())) {
       ERROR("Failed to start up monitoring context on thread creation\n");
       // we won't break, however..
     } else {
       // we should have inherited all the sighandlers, etc, from the spawning thread
 
-      // now kick ourselves to set the sse bits; we are currently in state INIT
-      kick_self();
+      // now set the sse bits; we are currently in state INIT
+      start_self();
       // we should now be in the right state
-      // the architecure init is done in the trap handler
+      // the architecure init is done there too
     }
     DEBUG("Done with setup on thread creation\n");
   } else {
     // we need to do the architecture init here
     arch_thread_init(0);
+    if (poll_us && bringup_poller(gettid())) {
+      ERROR("Failed to start polling on thread creation\n");
+    }
   }
 
   DEBUG("leaving trampoline\n");
@@ -654,8 +2156,9 @@ int pthread_create(pthread_t *tid, const pthread_attr_t *attr, void *(*start)(vo
   int rc = orig_pthread_create(tid, attr, trampoline, &c);
 
   if (!rc) {
-    // don't race on the tramp context - wait for thread to copy out
+    // don't race on the tramp context - sleep until thread copies out
     while (!__sync_fetch_and_and(&c.done, 1)) {
+      futex_wait(&c.done, 0, TRAMP_WAIT_NS);
     }
   }
 
@@ -674,7 +2177,7 @@ __attribute__((noreturn)) void pthread_exit(void *ret) {
 
   // we will process this even if we have aborted, since
   // we want to flush aggregate info even if it's just an abort record
-  if (mode == INDIVIDUAL) {
+  if (mode != AGGREGATE) {
     teardown_monitoring_context(gettid());
   } else {
     handle_aggregate_thread_exit();
@@ -689,7 +2192,7 @@ __attribute__((noreturn)) void pthread_exit(void *ret) {
 sighandler_t signal(int sig, sighandler_t func) {
   DEBUG("signal(%d,%p)\n", sig, func);
   SHOW_CALL_STACK();
-  if ((sig == SIGFPE || sig == SIGTRAP) && mode == INDIVIDUAL && !aborted) {
+  if ((sig == SIGFPE || sig == SIGTRAP) && mode != AGGREGATE && !aborted) {
     if (!aggressive) {
       abort_operation("target is using sigaction with SIGFPE or SIGTRAP (nonaggressive)");
     } else {
@@ -698,6 +2201,14 @@ sighandler_t signal(int sig, sighandler_t func) {
       return 0;
     }
   }
+  if (poll_us && sig == timer_signal() && mode == AGGREGATE && !aborted) {
+    if (!aggressive) {
+      abort_operation("target is using signal with the poll timer's signal");
+    } else {
+      DEBUG("not overriding poll timer signal because we are in aggressive mode\n");
+      return 0;
+    }
+  }
   ORIG_RETURN(signal, sig, func);
 }
 
@@ -708,7 +2219,7 @@ sighandler_t signal(int sig, sighandler_t func) {
 int sigaction(int sig, const struct sigaction *act, struct sigaction *oldact) {
   DEBUG("sigaction(%d,%p,%p)\n", sig, act, oldact);
   SHOW_CALL_STACK();
-  if ((sig == SIGVTALRM || sig == SIGFPE || sig == SIGTRAP) && mode == INDIVIDUAL && !aborted) {
+  if ((sig == SIGVTALRM || sig == SIGFPE || sig == SIGTRAP) && mode != AGGREGATE && !aborted) {
     if (!aggressive) {
       abort_operation("target is using sigaction with SIGFPE, SIGTRAP, or SIGVTALRM");
     } else {
@@ -717,6 +2228,14 @@ int sigaction(int sig, const struct sigaction *act, struct sigaction *oldact) {
       return 0;
     }
   }
+  if (poll_us && sig == timer_signal() && mode == AGGREGATE && !aborted) {
+    if (!aggressive) {
+      abort_operation("target is using sigaction with the poll timer's signal");
+    } else {
+      DEBUG("not overriding poll timer signal because we are in aggressive mode\n");
+      return 0;
+    }
+  }
   ORIG_RETURN(sigaction, sig, act, oldact);
 }
 
@@ -867,6 +2386,7 @@ static int setup_shims() {
   SHIMIFY(feholdexcept);
   SHIMIFY(fesetenv);
   SHIMIFY(feupdateenv);
+  SHIMIFY(dlclose);
 
   return 0;
 }
@@ -876,7 +2396,36 @@ static int setup_shims() {
 // Poisson Sampler
 //
 
+// Each thread has its own POSIX timer, which signals only that
+// thread, so that the threads' ON/OFF schedules are independent.
+// The real timer runs on elapsed time, while the virtual and
+// profiling timers run on the thread's own CPU time
+static int timer_signal(void) {
+  return timer_type == ITIMER_REAL      ? SIGALRM
+         : timer_type == ITIMER_VIRTUAL ? SIGVTALRM
+         : timer_type == ITIMER_PROF    ? SIGPROF
+                                        : SIGALRM;
+}
+
+static clockid_t timer_clock(void) {
+  return timer_type == ITIMER_REAL ? CLOCK_MONOTONIC : CLOCK_THREAD_CPUTIME_ID;
+}
+
+// n = 0 disarms the timer
+static void set_sampler_timer(sampler_state_t *s, uint64_t n) {
+  s->it.it_interval.tv_sec = 0;
+  s->it.it_interval.tv_nsec = 0;
+  s->it.it_value.tv_sec = n / 1000000;
+  s->it.it_value.tv_nsec = (n % 1000000) * 1000;
+
+  if (s->have_timer && timer_settime(s->timer, 0, &s->it, NULL)) {
+    ERROR("Failed to set timer?!\n");
+  }
+}
+
 void init_sampler(sampler_state_t *s) {
+  struct sigevent sev;
+
   DEBUG("Init sampler (%p)\n", s);
 
   init_random(s);
@@ -885,26 +2434,39 @@ void init_sampler(sampler_state_t *s) {
   s->off_mean_us = off_mean_us;
 
   s->state = ON;
+  s->have_timer = 0;
 
   if (!timers) {
     DEBUG("Sampler without timing\n");
     return;
   }
 
-  uint64_t n = next_exp(s, s->on_mean_us);
-
-  s->it.it_interval.tv_sec = 0;
-  s->it.it_interval.tv_usec = 0;
-  s->it.it_value.tv_sec = n / 1000000;
-  s->it.it_value.tv_usec = n % 1000000;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = timer_signal();
+  sev.sigev_notify_thread_id = gettid();
 
-  if (setitimer(timer_type, &(s->it), NULL)) {
-    ERROR("Failed to set timer?!\n");
+  if (timer_create(timer_clock(), &sev, &s->timer)) {
+    ERROR("Failed to create timer?!\n");
+    return;
   }
 
+  s->have_timer = 1;
+
+  uint64_t n = next_exp(s, s->on_mean_us);
+
+  set_sampler_timer(s, n);
+
   DEBUG("Timer initialized for %lu us\n", n);
 }
 
+void deinit_sampler(sampler_state_t *s) {
+  if (s->have_timer) {
+    timer_delete(s->timer);
+    s->have_timer = 0;
+  }
+}
+
 // n.b: is it really the case we cannot meaningfully manipulate ucontext
 // here to change the FP engine?  Really?   Why would this work in
 // both SIGFPE and SIGTRAP but not here?
@@ -934,53 +2496,203 @@ static void update_sampler(monitoring_context_t *mc, ucontext_t *uc) {
     arch_reset_trap_mode(uc, &mc->trap_mode_state);  // disable trap mode */
   }
 
-  // schedule next wakeup
-
-  uint64_t n = next_exp(s, s->state == ON ? s->off_mean_us : s->on_mean_us);
+  // schedule next wakeup
+
+  uint64_t n;
+
+  if (s->state == ON && s->forced_off_us) {
+    n = s->forced_off_us;
+    s->forced_off_us = 0;
+  } else {
+    n = next_exp(s, s->state == ON ? s->off_mean_us : s->on_mean_us);
+  }
+
+  if (!n) {
+    // make sure we do actually wake up again
+    // n = 0 would disable timer...
+    n = 1;
+  }
+
+  if (s->state == OFF && n > CONFIG_MAX_US_ON) {
+    // about to turn on for too long, limit:
+    n = CONFIG_MAX_US_ON;
+  }
+
+  if (s->state == ON && n > CONFIG_MAX_US_OFF) {
+    // about to turn off for too long, limit:
+    n = CONFIG_MAX_US_OFF;
+  }
+
+  if (s->state == OFF && !s->on_mean_us) {
+    // not Poisson sampling, so we stay on until the governor
+    // switches us off again; n = 0 disables the timer
+    n = 0;
+  }
+
+  // flip state
+  s->state = s->state == ON ? OFF : ON;
+
+  // don't reprocess again in case we are running delayed because
+  // we were not intially in an AWAIT_FPE
+  if (s->delayed_processing) {
+    DEBUG("Completed delayed processing\n");
+    s->delayed_processing = 0;
+  }
+
+  set_sampler_timer(s, n);
+
+  // arch_dump_gp_csr("update after",uc);
+  // arch_dump_fp_csr("update after",uc);
+
+  DEBUG("Timer reinitialized for %lu us state %s\n", n, s->state == ON ? "ON" : "off");
+}
+
+
+//
+// Overhead governor
+//
+// With an overhead budget (FPSPY_OVERHEAD_BUDGET), each thread
+// accounts for the cycles it spends in FPSpy's handlers.   Once the
+// thread has been on for a window (CONFIG_GOVERNOR_WINDOW_US), the
+// governor compares them with the cycles that have passed since the
+// last window was evaluated, including any time the thread was off.
+// Over the budget, it raises its level, and under half of it, it
+// lowers it.   At level L > 0, after each window the thread is
+// switched off (via the sampler) for 2^(L-1) windows, so the level
+// settles where the duty cycle keeps the thread within the budget,
+// and falls back to 0 when the load drops.   Each change of level is
+// recorded in the trace, so that rates can be corrected afterward.
+//
+// The governor can only act between events, when a handler is
+// returning to AWAIT_FPE with the sampler on.   The cycles spent
+// in the kernel delivering signals are not seen by it.
+//
+
+#define GOVERNOR_MAX_LEVEL 20
+
+static inline uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void init_governor(governor_state_t *g) {
+  memset(g, 0, sizeof(*g));
+  g->window_start = arch_cycle_count();
+  g->deadline_ns = monotonic_ns() + CONFIG_GOVERNOR_WINDOW_US * 1000ULL;
+}
+
+// record a change of level in the trace
+static void record_governor(monitoring_context_t *mc, uint64_t now) {
+  struct individual_trace_record r;
+
+  if (mode != INDIVIDUAL || !create_monitor_file) {
+    return;
+  }
+
+  memset(&r, 0xff, sizeof(r));
+  r.time = now - mc->start_time;
+  r.rsp = (void *)mc->governor.overhead;
+  r.code = TRACE_CODE_GOVERN;
+  r.mxcsr = mc->governor.level;
 
-  if (!n) {
-    // make sure we do actually wake up again
-    // n = 0 would disable timer...
-    n = 1;
+  if (begin_recording(mc)) {
+    if (push_trace_record(mc, &r)) {
+      ERROR("Failed to push governor record\n");
+    }
+    end_recording(mc);
   }
+}
 
-  if (s->state == OFF && n > CONFIG_MAX_US_ON) {
-    // about to turn on for too long, limit:
-    n = CONFIG_MAX_US_ON;
+// Invoked on the way out of a handler, with the cycle count
+// from the way in
+static void govern(ucontext_t *uc, uint64_t entry) {
+  monitoring_context_t *mc;
+  governor_state_t *g;
+  uint64_t now, now_ns, elapsed;
+  uint32_t old_level;
+
+  if (!overhead_budget || aborted || !(mc = find_monitoring_context(gettid()))) {
+    return;
   }
 
-  if (s->state == ON && n > CONFIG_MAX_US_OFF) {
-    // about to turn off for too long, limit:
-    n = CONFIG_MAX_US_OFF;
+  g = &mc->governor;
+  now = arch_cycle_count();
+  g->handler_cycles += now - entry;
+
+  if (mc->state != AWAIT_FPE || mc->sampler.state != ON || mc->sampler.delayed_processing) {
+    return;
   }
 
-  s->it.it_interval.tv_sec = 0;
-  s->it.it_interval.tv_usec = 0;
-  s->it.it_value.tv_sec = n / 1000000;
-  s->it.it_value.tv_usec = n % 1000000;
+  now_ns = monotonic_ns();
+  if (now_ns < g->deadline_ns) {
+    return;
+  }
 
-  // flip state
-  s->state = s->state == ON ? OFF : ON;
+  // integer math, as we may be running with traps enabled
+  elapsed = now - g->window_start;
+  g->overhead = elapsed ? (unsigned __int128)g->handler_cycles * 1000000 / elapsed : 0;
 
-  // don't reprocess again in case we are running delayed because
-  // we were not intially in an AWAIT_FPE
-  if (s->delayed_processing) {
-    DEBUG("Completed delayed processing\n");
-    s->delayed_processing = 0;
+  old_level = g->level;
+  if (g->overhead > overhead_budget) {
+    if (g->level < GOVERNOR_MAX_LEVEL) {
+      g->level++;
+    }
+  } else if (g->overhead < overhead_budget / 2 && g->level > 0) {
+    g->level--;
   }
 
-  if (setitimer(timer_type, &s->it, NULL)) {
-    ERROR("Failed to set timer?!\n");
+  if (g->level != old_level) {
+    DEBUG("Governor: overhead %lu ppm, level %u -> %u\n", g->overhead, old_level, g->level);
+    g->changes++;
+    record_governor(mc, now);
   }
 
-  // arch_dump_gp_csr("update after",uc);
-  // arch_dump_fp_csr("update after",uc);
+  g->window_start = now;
+  g->handler_cycles = 0;
+  g->deadline_ns = now_ns + CONFIG_GOVERNOR_WINDOW_US * 1000ULL;
 
-  DEBUG("Timer reinitialized for %lu us state %s\n", n, s->state == ON ? "ON" : "off");
+  if (g->level) {
+    uint64_t off_us = (uint64_t)CONFIG_GOVERNOR_WINDOW_US << (g->level - 1);
+    if (off_us > CONFIG_MAX_US_OFF) {
+      off_us = CONFIG_MAX_US_OFF;
+    }
+    // the window restarts once we are back on
+    g->deadline_ns += off_us * 1000ULL;
+    g->offs++;
+    mc->sampler.forced_off_us = off_us;
+    update_sampler(mc, uc);
+  }
 }
 
 // Shared handling of a breakpoint trap, which occurs on the
 // instruction immediately after one that had a floating point trap
+// Once we are past the instruction that caused the FP trap,
+// either by single-stepping it or by emulating it, we
+// re-arm (or not) and wait for the next FP trap
+static void complete_fp_event(monitoring_context_t *mc, ucontext_t *uc) {
+  mc->count++;
+  arch_clear_fp_exceptions(uc);
+  if (maxcount != -1 && mc->count >= maxcount) {
+    // disable further operation since we've recorded enough
+    arch_mask_fp_traps(uc);
+    if (control_round_config) {
+      arch_set_round_config(uc, orig_round_config);
+    }
+  } else {
+    arch_unmask_fp_traps(uc);
+    if (control_round_config) {
+      arch_set_round_config(uc, our_round_config);
+    }
+  }
+  arch_reset_trap_mode(uc, &mc->trap_mode_state);
+  mc->state = AWAIT_FPE;
+  if (mc->sampler.delayed_processing) {
+    DEBUG("Delayed sampler handling\n");
+    update_sampler(mc, uc);
+  }
+}
+
 // A breakpoint trap might be intiated by a SIGTRAP or other mechanisms,
 // see below.
 // The default use of a breakpoint trap is to transition to AWAIT_FPE state.
@@ -1024,26 +2736,7 @@ void brk_trap_handler(siginfo_t *si, ucontext_t *uc) {
   }
 
   if (mc->state == AWAIT_TRAP) {
-    mc->count++;
-    arch_clear_fp_exceptions(uc);
-    if (maxcount != -1 && mc->count >= maxcount) {
-      // disable further operation since we've recorded enough
-      arch_mask_fp_traps(uc);
-      if (control_round_config) {
-        arch_set_round_config(uc, orig_round_config);
-      }
-    } else {
-      arch_unmask_fp_traps(uc);
-      if (control_round_config) {
-        arch_set_round_config(uc, our_round_config);
-      }
-    }
-    arch_reset_trap_mode(uc, &mc->trap_mode_state);
-    mc->state = AWAIT_FPE;
-    if (mc->sampler.delayed_processing) {
-      DEBUG("Delayed sampler handling\n");
-      update_sampler(mc, uc);
-    }
+    complete_fp_event(mc, uc);
   } else {
     arch_clear_fp_exceptions(uc);
     arch_mask_fp_traps(uc);
@@ -1061,9 +2754,9 @@ void brk_trap_handler(siginfo_t *si, ucontext_t *uc) {
 // instruction for which we took a SIGFPE.
 //
 static void sigtrap_handler(int sig, siginfo_t *si, void *priv) {
+  uint64_t entry = arch_cycle_count();
   ucontext_t *uc = (ucontext_t *)priv;
 
-
   DEBUG("TRAP signo 0x%x errno 0x%x code 0x%x ip %p\n", si->si_signo, si->si_errno, si->si_code,
       si->si_addr);
   DEBUG("TRAP ip=%p sp=%p fpcsr=%016lx gpcsr=%016lx\n", (void *)arch_get_ip(uc),
@@ -1071,11 +2764,51 @@ static void sigtrap_handler(int sig, siginfo_t *si, void *priv) {
 
   brk_trap_handler(si, uc);
 
-
+  govern(uc, entry);
 
   DEBUG("TRAP done\n");
 }
 
+// The sampling class of an exception
+static int sample_class(siginfo_t *si, ucontext_t *uc) {
+  switch (si->si_code) {
+    case FPE_FLTINV:
+      return TRACE_SAMPLE_INV;
+    case FPE_FLTDIV:
+    case FPE_INTDIV:
+      return TRACE_SAMPLE_DIV;
+    case FPE_FLTOVF:
+      return TRACE_SAMPLE_OVER;
+    case FPE_FLTUND:
+      // the kernel reports a denormal operand as an underflow
+      return arch_have_special_fp_csr_exception_in_context(uc, FE_DENORM) ? TRACE_SAMPLE_DEN
+                                                                         : TRACE_SAMPLE_UNDER;
+    case FPE_FLTRES:
+      return TRACE_SAMPLE_PREC;
+    default:
+      return TRACE_SAMPLE_OTHER;
+  }
+}
+
+// Count the event, and decide whether to record it
+static int sample_event(monitoring_context_t *mc, siginfo_t *si, ucontext_t *uc) {
+  int c = sample_class(si, uc);
+  int record = sample_period[c] && !(mc->sample_seen[c] % sample_period[c]);
+
+  if (mc->sites) {
+    site_t *s = record_site(mc, si, uc);
+    if (s) {
+      record = throttle_site(s) && record;
+      s->recorded += record;
+    }
+  }
+
+  mc->sample_seen[c]++;
+  mc->sample_recorded[c] += record;
+
+  return record;
+}
+
 // FPSpy gets here when the current instruction is a FP instruction that
 // has generated an FP trap we care about.
 // This should only happen in the AWAIT_FPE state.
@@ -1099,34 +2832,52 @@ void fp_trap_handler(siginfo_t *si, ucontext_t *uc) {
     return;
   }
 
-  if (!(mc->count % sample_period)) {
-    individual_trace_record_t r;
-    r.time = arch_cycle_count() - mc->start_time;
-    r.rip = (void *)arch_get_ip(uc);
-    r.rsp = (void *)arch_get_sp(uc);
-    r.code = si->si_code;
-    r.mxcsr = arch_get_fp_csr(uc);
-    if (arch_get_instr_bytes(uc, (uint8_t *)r.instruction, MAX_INSTR_SIZE) < 0) {
-      ERROR("Failed to fetch instruction bytes\n");
-    }
-    r.pad = 0;
-
-    //    DEBUG("writing record: %lu ip=%p sp=%p code=0x%x, fpcsr=%08x, inst=%08x\n",
-    //           r.time, r.rip, r.rsp, r.code, r.mxcsr, *(uint32_t*)r.instruction);
-
-    if ((create_monitor_file != 0) && push_trace_record(mc, &r)) {
-      ERROR("Failed to push record\n");
+  if (!begin_recording(mc)) {
+    // the process is exiting, and has finished our files
+  } else if (mode == SITES) {
+    record_site(mc, si, uc);
+    end_recording(mc);
+  } else {
+    if (sample_event(mc, si, uc)) {
+      individual_trace_record_t r;
+      r.time = arch_cycle_count() - mc->start_time;
+      r.rip = (void *)arch_get_ip(uc);
+      r.rsp = (void *)arch_get_sp(uc);
+      r.code = si->si_code;
+      r.mxcsr = arch_get_fp_csr(uc);
+      get_record_instruction(mc, uc, &r);
+
+      //    DEBUG("writing record: %lu ip=%p sp=%p code=0x%x, fpcsr=%08x, inst=%08x\n",
+      //           r.time, r.rip, r.rsp, r.code, r.mxcsr, *(uint32_t*)r.instruction);
+
+      if ((create_monitor_file != 0) && push_trace_record(mc, &r)) {
+        ERROR("Failed to push record\n");
+      }
     }
+    end_recording(mc);
   }
 
 
   if (mc->state == AWAIT_FPE) {
+    if (emulate && !arch_emulate_instruction(uc)) {
+      // we are already past the instruction, so no need to trap after it
+      complete_fp_event(mc, uc);
+      return;
+    }
     arch_clear_fp_exceptions(uc);
     arch_mask_fp_traps(uc);
     if (control_round_config) {
       arch_set_round_config(uc, our_round_config);
     }
-    arch_set_trap_mode(uc, &mc->trap_mode_state);
+    if (arch_set_trap_mode(uc, &mc->trap_mode_state)) {
+      // we cannot see the instruction through, so get out of the way
+      if (control_round_config) {
+        arch_set_round_config(uc, orig_round_config);
+      }
+      mc->aborting_in_trap = 1;
+      abort_operation("Cannot set trap mode after fp_trap_handler exec");
+      return;
+    }
     mc->state = AWAIT_TRAP;
   } else {
     arch_clear_fp_exceptions(uc);
@@ -1144,6 +2895,7 @@ void fp_trap_handler(siginfo_t *si, ucontext_t *uc) {
 // This is the entry for FP traps when regular SIGFPEs are used
 //
 static void sigfpe_handler(int sig, siginfo_t *si, void *priv) {
+  uint64_t entry = arch_cycle_count();
   ucontext_t *uc = (ucontext_t *)priv;
 
   DEBUG("SIGFPE signo 0x%x errno 0x%x code 0x%x ip %p \n", si->si_signo, si->si_errno, si->si_code,
@@ -1189,6 +2941,8 @@ static void sigfpe_handler(int sig, siginfo_t *si, void *priv) {
 
   fp_trap_handler(si, uc);
 
+  govern(uc, entry);
+
   DEBUG("SIGFPE done\n");
 
   // copy back our limited gregset_t
@@ -1255,31 +3009,166 @@ static void memfault_handler(int sig, siginfo_t *si, void *priv) {
 #if CONFIG_TRAP_SHORT_CIRCUITING
 // this is currently completely x64-specific
 
-// no need to manipulate mxcsr since all code here
-// that might affect it should already safely wrap
-// what is doing
+// Nonzero when the handler below has left the trap flag set, so the
+// single step trap that follows is ours.  The kernel module reads it
+// (registered with FPVM_IOCTL_REG_DB) to decide whether to deliver
+// the trap to _user_fpspy_db_entry or as a SIGTRAP
+static __thread uint64_t sc_step_armed __attribute__((tls_model("initial-exec")));
+
+// How we preserve the FP and vector state across the handlers below.
+// The handlers are ordinary C code, and both the compiler and libc
+// (its string functions pick AVX/AVX-512 variants at load time) are
+// free to use the vector registers, so the state we are not
+// supposed to change still has to be saved and restored.   Which
+// instruction we use is chosen from CPUID when the kernel module is
+// opened (sc_state_init):
+//
+//   SC_SAVE_FXSAVE   no OS-enabled XSAVE, legacy SSE state only
+//   SC_SAVE_XSAVE    standard layout, which is what a signal frame
+//                    has, and so what the instruction emulation
+//                    expects to find the ymm/zmm upper halves in
+//   SC_SAVE_XSAVEC   compacted layout, with the init optimization,
+//                    so components the application is not using
+//                    (typically the AVX-512 ones) are not written
+//
+// Either XSAVE form is limited to the x87, SSE, AVX, and AVX-512
+// components, which are all the handlers can touch, so, for example,
+// AMX tile data is never saved
+typedef enum { SC_SAVE_FXSAVE = 0, SC_SAVE_XSAVE, SC_SAVE_XSAVEC } sc_save_t;
+
+#define SC_XFEATURES      0xe7UL  // x87, sse, ymm, opmask, zmm_hi256, hi16_zmm
+#define SC_XSAVE_LEGACY   512     // legacy (FXSAVE) region
+#define SC_XSAVE_SW       464     // software reserved bytes within it
+#define SC_XSAVE_HDR      64      // XSAVE header that follows it
+#define SC_XSAVE_ALIGN    64
+#define SC_XSTATE_MAGIC1  0x46505853U
+
+static sc_save_t sc_save = SC_SAVE_FXSAVE;
+static uint64_t sc_xfeatures = 0;               // requested-feature bitmap for (X)SAVE/XRSTOR
+static uint32_t sc_save_size = SC_XSAVE_LEGACY;  // bytes of save area needed
+
+// software reserved bytes at the end of the legacy region, which
+// the kernel fills in on a signal frame to describe the XSAVE area
+typedef struct {
+  uint32_t magic1;
+  uint32_t extended_size;
+  uint64_t xfeatures;
+  uint32_t xstate_size;
+  uint32_t padding[7];
+} __attribute__((packed)) sc_sw_bytes_t;
+
+static void sc_state_init(void) {
+  uint32_t eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+  uint32_t size = SC_XSAVE_LEGACY + SC_XSAVE_HDR;
+  int compact;
+  int i;
 
-static uint32_t get_mxcsr() {
-  uint32_t val = 0;
-  __asm__ __volatile__("stmxcsr %0" : "=m"(val) : : "memory");
-  return val;
-}
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE) ||
+      __get_cpuid_max(0, 0) < 0xd) {
+    DEBUG("SC state save using fxsave\n");
+    return;
+  }
+
+  __asm__ __volatile__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  sc_xfeatures = (((uint64_t)xcr0_hi << 32) | xcr0_lo) & SC_XFEATURES;
+
+  // the emulation needs the layout of a signal frame
+  __cpuid_count(0xd, 1, eax, ebx, ecx, edx);
+  compact = !emulate && (eax & bit_XSAVEC);
 
+  for (i = 2; i < 64; i++) {
+    if (!(sc_xfeatures & (1UL << i))) {
+      continue;
+    }
+    __cpuid_count(0xd, i, eax, ebx, ecx, edx);
+    if (compact) {
+      // ecx bit 1: component is 64 byte aligned in the compacted form
+      if (ecx & 0x2) {
+        size = (size + SC_XSAVE_ALIGN - 1) & ~(SC_XSAVE_ALIGN - 1);
+      }
+      size += eax;
+    } else if (ebx + eax > size) {
+      size = ebx + eax;
+    }
+  }
 
-static inline void fxsave(struct _libc_fpstate *fpregs) {
-  __asm__ __volatile__("fxsave (%0)" ::"r"(fpregs));
+  sc_save = compact ? SC_SAVE_XSAVEC : SC_SAVE_XSAVE;
+  sc_save_size = size;
+
+  DEBUG("SC state save using %s, features 0x%lx, %u bytes\n", compact ? "xsavec" : "xsave",
+      sc_xfeatures, sc_save_size);
 }
 
-static inline void fxrstor(const struct _libc_fpstate *fpvm_fpregs) {
-  __asm__ __volatile__("fxrstor (%0)" ::"r"(fpvm_fpregs));
+// Save area for the handlers, on the stack just as the kernel would
+// put it in a signal frame.   This must be done before any other code
+// in the handler, since that code may use the vector registers
+#define SC_SAVE_AREA()                                                                  \
+  ((uint8_t *)(((uint64_t)__builtin_alloca(sc_save_size + SC_XSAVE_ALIGN - 1) +         \
+                   SC_XSAVE_ALIGN - 1) &                                                \
+               ~(uint64_t)(SC_XSAVE_ALIGN - 1)))
+
+// These are written entirely in asm so that the compiler has no
+// opportunity to use a vector register before the save or after the
+// restore.   The parts of the XSAVE header these instructions do not
+// write must be zeroed first, or XRSTOR will fault.  XSAVE writes
+// only the XSTATE_BV bits of the requested features, XSAVEC writes
+// all of XSTATE_BV and XCOMP_BV
+static inline __attribute__((always_inline)) void sc_save_state(uint8_t *area) {
+  uint32_t lo = (uint32_t)sc_xfeatures, hi = (uint32_t)(sc_xfeatures >> 32);
+
+  switch (sc_save) {
+    case SC_SAVE_XSAVE:
+      __asm__ __volatile__(
+          "movq $0, 512(%0); movq $0, 520(%0); movq $0, 528(%0); movq $0, 536(%0);"
+          "movq $0, 544(%0); movq $0, 552(%0); movq $0, 560(%0); movq $0, 568(%0);"
+          "xsave64 (%0)" ::"r"(area),
+          "a"(lo), "d"(hi)
+          : "memory");
+      break;
+    case SC_SAVE_XSAVEC:
+      __asm__ __volatile__(
+          "movq $0, 528(%0); movq $0, 536(%0); movq $0, 544(%0);"
+          "movq $0, 552(%0); movq $0, 560(%0); movq $0, 568(%0);"
+          "xsavec64 (%0)" ::"r"(area),
+          "a"(lo), "d"(hi)
+          : "memory");
+      break;
+    default:
+      __asm__ __volatile__("fxsave (%0)" ::"r"(area) : "memory");
+      break;
+  }
 }
 
+static inline __attribute__((always_inline)) void sc_restore_state(const uint8_t *area) {
+  uint32_t lo = (uint32_t)sc_xfeatures, hi = (uint32_t)(sc_xfeatures >> 32);
 
-#define USE_MEMCPY 1
+  if (sc_save == SC_SAVE_FXSAVE) {
+    __asm__ __volatile__("fxrstor (%0)" ::"r"(area) : "memory");
+  } else {
+    // handles both the standard and compacted forms
+    __asm__ __volatile__("xrstor64 (%0)" ::"r"(area), "a"(lo), "d"(hi) : "memory");
+  }
+}
+
+// Make the saved state look like the fpregs of a signal frame to the
+// code we call.   Only the XSAVE (standard) layout can be described as
+// such.   Otherwise, the reserved bytes must not look like the marker
+static void sc_describe_state(struct _libc_fpstate *fpregs) {
+  sc_sw_bytes_t *sw = (sc_sw_bytes_t *)((uint8_t *)fpregs + SC_XSAVE_SW);
+
+  memset(fpregs->__glibc_reserved1, 0, sizeof(fpregs->__glibc_reserved1));
+  if (sc_save == SC_SAVE_XSAVE) {
+    sw->magic1 = SC_XSTATE_MAGIC1;
+    sw->extended_size = sc_save_size;
+    sw->xfeatures = sc_xfeatures;
+    sw->xstate_size = sc_save_size;
+  }
+}
 
 // note that unlike FPVM, the handler WILL NOT and MUST NOT
 // change any state except for possibly changing
-// rflags.TF and mxcsr.trap bits
+// rflags.TF and mxcsr.trap bits (and rip, and the destination
+// register, if it emulates the instruction)
 //
 // See src/x64/user_fpspy_entry.S for a layout of
 // the stack and what priv points to on entry.  The summary is
@@ -1295,27 +3184,23 @@ static inline void fxrstor(const struct _libc_fpstate *fpvm_fpregs) {
 //  rsp + 0    r8       v
 //
 // the handler will create a fake ucontext_t from this
-// and a snapshot of FP state.  The user should assume
+// and the saved FP state.  The user should assume
 // the only parts of that ucontext_t to be trusted are
 // the signal state, the above gregset_t subset, and
-// the mxcsr in the fprs.
-//
+// the fpregs (including the ymm/zmm state only if
+// it is described as in a signal frame).  Only rip
+// and rflags are copied back to the stack, and only
+// the FP state is restored from the fpregs
 //
-void fpspy_short_circuit_handler(void *priv) {
-  // Build up a sufficiently detailed ucontext_t and
-  // call the shared handler.  Copy in/out the FP and GP
-  // state
-
+static void __attribute__((noinline))
+sc_fpe_handler(void *priv, struct _libc_fpstate *fpregs, uint64_t entry) {
   siginfo_t fake_siginfo = {0};
-  struct _libc_fpstate fpregs;
   ucontext_t fake_ucontext;
-  uint32_t old;
+  greg_t *gregs = (greg_t *)priv;
 
-  // capture FP state (note that this eventually needs to do xsave)
-  // no code we call can safely deal with the fpregs beyond SSE
-  fxsave(&fpregs);
+  sc_describe_state(fpregs);
 
-  old = get_mxcsr();
+  uint32_t old = fpregs->mxcsr;
 
   uint32_t err = ~(old >> 7) & old;
   if (err & 0x001) { /* Invalid op*/
@@ -1332,15 +3217,11 @@ void fpspy_short_circuit_handler(void *priv) {
 
   siginfo_t *si = (siginfo_t *)&fake_siginfo;
 
-  fake_ucontext.uc_mcontext.fpregs = &fpregs;
+  fake_ucontext.uc_mcontext.fpregs = fpregs;
 
-#if USE_MEMCPY
+  // the whole subset comes in, since emulation may need any of
+  // the registers to form an address
   memcpy(fake_ucontext.uc_mcontext.gregs, priv, 8 * (REG_EFL - REG_R8 + 1));
-#else
-  for (int i = REG_R8; i <= REG_EFL; i++) {
-    fake_ucontext.uc_mcontext.gregs[i] = ((greg_t *)priv)[i];
-  }
-#endif
 
   ucontext_t *uc = (ucontext_t *)&fake_ucontext;
 
@@ -1391,23 +3272,64 @@ void fpspy_short_circuit_handler(void *priv) {
 
   fp_trap_handler(si, uc);
 
+  govern(uc, entry);
+
   DEBUG("SCFPE  done\n");
 
+  // and only what we may have changed goes back out
+  gregs[REG_RIP - REG_R8] = uc->uc_mcontext.gregs[REG_RIP];
+  gregs[REG_EFL - REG_R8] = uc->uc_mcontext.gregs[REG_EFL];
 
-#if USE_MEMCPY
-  memcpy(priv, fake_ucontext.uc_mcontext.gregs, 8 * (REG_EFL - REG_R8 + 1));
-#else
-  for (int i = REG_R8; i <= REG_EFL; i++) {
-    ((greg_t *)priv)[i] = fake_ucontext.uc_mcontext.gregs[i];
-  }
-#endif
+  sc_step_armed = !!(uc->uc_mcontext.gregs[REG_EFL] & 0x100UL);
+}
+
+void fpspy_short_circuit_handler(void *priv) {
+  uint64_t entry = arch_cycle_count();
+  uint8_t *area = SC_SAVE_AREA();
+
+  sc_save_state(area);
+  sc_fpe_handler(priv, (struct _libc_fpstate *)area, entry);
+  sc_restore_state(area);
+}
+
+// Entry point for the single step trap that follows, when the
+// kernel module short circuits it too.  priv is as above
+static void __attribute__((noinline))
+sc_trap_handler(void *priv, struct _libc_fpstate *fpregs, uint64_t entry) {
+  siginfo_t fake_siginfo = {0};
+  ucontext_t fake_ucontext;
+  greg_t *gregs = (greg_t *)priv;
+
+  sc_describe_state(fpregs);
 
-  // restore FP state (note that this eventually needs to do xsave)
-  // really, the only thing that should change is mxcsr, so this is
-  // doing too much work
-  fxrstor(&fpregs);
+  fake_siginfo.si_signo = SIGTRAP;
+  fake_siginfo.si_code = TRAP_TRACE;
 
-  return;
+  fake_ucontext.uc_mcontext.fpregs = fpregs;
+  memcpy(fake_ucontext.uc_mcontext.gregs, priv, 8 * (REG_EFL - REG_R8 + 1));
+
+  DEBUG("SCTRAP RIP=%p RSP=%p\n", (void *)fake_ucontext.uc_mcontext.gregs[REG_RIP],
+      (void *)fake_ucontext.uc_mcontext.gregs[REG_RSP]);
+
+  brk_trap_handler(&fake_siginfo, &fake_ucontext);
+
+  govern(&fake_ucontext, entry);
+
+  DEBUG("SCTRAP done\n");
+
+  gregs[REG_RIP - REG_R8] = fake_ucontext.uc_mcontext.gregs[REG_RIP];
+  gregs[REG_EFL - REG_R8] = fake_ucontext.uc_mcontext.gregs[REG_EFL];
+}
+
+void fpspy_short_circuit_db_handler(void *priv) {
+  uint64_t entry = arch_cycle_count();
+  uint8_t *area = SC_SAVE_AREA();
+
+  sc_step_armed = 0;
+
+  sc_save_state(area);
+  sc_trap_handler(priv, (struct _libc_fpstate *)area, entry);
+  sc_restore_state(area);
 }
 #endif
 
@@ -1429,7 +3351,10 @@ static __attribute__((destructor)) void fpspy_deinit(void);
 static void sigint_handler(int sig, siginfo_t *si, void *priv) {
   DEBUG("Handling break\n");
 
-  if (oldsa_int.sa_sigaction) {
+  if (oldsa_int.sa_handler == SIG_IGN) {
+    // the target was started ignoring breaks
+    return;
+  } else if (oldsa_int.sa_handler != SIG_DFL) {
     fpspy_deinit();  // dump everything out
     // invoke underlying handler
     oldsa_int.sa_sigaction(sig, si, priv);
@@ -1437,33 +3362,293 @@ static void sigint_handler(int sig, siginfo_t *si, void *priv) {
     // exit - our deinit will be called
     exit(-1);
   }
-}
+}
+
+
+
+//
+// FPspy handles SIGALRM in time-based sampling mode.  The
+// SIGALRM signifies the current interval is over
+//
+static void sigalrm_handler(int sig, siginfo_t *si, void *priv) {
+  monitoring_context_t *mc = find_monitoring_context(gettid());
+  ucontext_t *uc = (ucontext_t *)priv;
+
+  DEBUG("Timeout for %d\n", gettid());
+
+  if (!mc) {
+    ERROR("Could not find monitoring context for %d\n", gettid());
+    return;
+  }
+  if (!mc->sampler.on_mean_us && mc->sampler.state == ON) {
+    // the governor alone is using the timer, and it was disarmed
+    // when we switched on, so this expiry is stale
+    DEBUG("Ignoring timeout while on\n");
+    return;
+  }
+  if (mc->state != AWAIT_FPE) {
+    // we are in the middle of handling an instruction, so we will
+    // defer the transition until after this is done
+    DEBUG("Delaying sampler processing because we are in the middle of an instruction\n");
+    mc->sampler.delayed_processing = 1;
+    return;
+  } else {
+    update_sampler(mc, uc);
+  }
+}
+
+
+
+//
+// Sticky flag polling (aggregate mode, FPSPY_POLL)
+//
+// Each thread has a periodic timer that signals only it.   The
+// handler reads which sticky flags are set in the interrupted
+// thread's FP state, and if any are, notes them with where the thread
+// was, and clears them, so that the next poll sees only what happened
+// during its interval.   The result is a timeline of each thread's
+// exceptions, and a statistical picture of where they happen, without
+// ever enabling FP traps.   The flags are accumulated, so the thread's
+// aggregate result is as if they had never been cleared.   The thread
+// has a monitoring context, which only holds the poller and the
+// file its timeline is written to.
+//
+
+static poller_t *alloc_poller(void) {
+  poller_t *p;
+  size_t len = (sizeof(poller_t) + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+
+  p = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return 0;
+  }
+
+  p->alloc_len = len;
+
+  return p;
+}
+
+static void free_poller(poller_t *p) {
+  if (p) {
+    munmap(p, p->alloc_len);
+  }
+}
+
+// write out the published polls as lines of text
+// consumer side, invoked with writer_lock held
+static void flush_polls(monitoring_context_t *mc) {
+  poller_t *p = mc->poller;
+  uint64_t tail = p->tail;
+  uint64_t head = __atomic_load_n(&p->head, __ATOMIC_ACQUIRE);
+  char buf[160];
+  int n;
+
+  for (; tail != head; tail++) {
+    poll_record_t *r = &p->record[tail % POLL_BUFLEN];
+    if (create_monitor_file) {
+      n = sprintf(buf, "%lu\t%lu\t%016lx\t", r->poll, r->time, r->ip);
+      stringify_fe_exceptions(buf + n, r->flags);
+      strcat(buf, "\n");
+      if (writeall(mc->fd, buf, strlen(buf))) {
+        ERROR("Failed to write all of poll timeline\n");
+        tail = head;
+        break;
+      }
+    }
+  }
+
+  __atomic_store_n(&p->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void poll_handler(int sig, siginfo_t *si, void *priv) {
+  monitoring_context_t *mc = find_monitoring_context(gettid());
+  ucontext_t *uc = (ucontext_t *)priv;
+  poller_t *p;
+  poll_record_t *r;
+  uint64_t head, tail;
+  int flags;
+
+  if (aborted || !mc || !(p = mc->poller)) {
+    return;
+  }
+
+  p->polls++;
+
+  if (!(flags = arch_get_fp_exceptions_in_context(uc))) {
+    return;
+  }
+
+  arch_clear_fp_exceptions(uc);
+
+  p->flags |= flags;
+
+  // the writer thread writes the records out, so no system calls here
+  // other than the occasional poke
+  head = p->head;
+  tail = __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE);
+  if (head - tail >= POLL_BUFLEN) {
+    p->dropped++;
+    return;
+  }
+
+  r = &p->record[head % POLL_BUFLEN];
+  r->poll = p->polls;
+  r->time = arch_cycle_count() - mc->start_time;
+  r->ip = arch_get_ip(uc);
+  r->flags = flags;
+  __atomic_store_n(&p->head, head + 1, __ATOMIC_RELEASE);
+
+  if (head + 1 - tail == POLL_BUFLEN / 2) {
+    wake_writer();
+  }
+}
+
+static void stop_poller(poller_t *p) {
+  if (p->have_timer) {
+    timer_delete(p->timer);
+    p->have_timer = 0;
+  }
+}
+
+static int bringup_poller(int tid) {
+  monitoring_context_t *c;
+  struct sigevent sev;
+  struct itimerspec it;
+  char name[80];
+
+  if (!(c = alloc_monitoring_context(tid))) {
+    ERROR("Cannot allocate monitoring context\n");
+    return -1;
+  }
+
+  c->start_time = arch_cycle_count();
+
+  if (!(c->poller = alloc_poller())) {
+    ERROR("Cannot allocate poller\n");
+    discard_monitoring_context(tid);
+    return -1;
+  }
+
+  if (create_monitor_file) {
+    sprintf(name, "__%s.%lu.%d.timeline.fpemon", program_invocation_short_name, time(0), tid);
+    if ((c->fd = open(name, O_CREAT | O_WRONLY | O_TRUNC, 0666)) < 0) {
+      ERROR("Cannot open poll timeline file\n");
+      free_poller(c->poller);
+      discard_monitoring_context(tid);
+      return -1;
+    }
+  }
+
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = timer_signal();
+  sev.sigev_notify_thread_id = tid;
+
+  it.it_value.tv_sec = it.it_interval.tv_sec = poll_us / 1000000;
+  it.it_value.tv_nsec = it.it_interval.tv_nsec = (poll_us % 1000000) * 1000;
+
+  if (timer_create(timer_clock(), &sev, &c->poller->timer)) {
+    ERROR("Failed to create poll timer\n");
+  } else {
+    c->poller->have_timer = 1;
+    if (timer_settime(c->poller->timer, 0, &it, NULL)) {
+      ERROR("Failed to set poll timer\n");
+    }
+  }
+
+  DEBUG("Polling thread %d every %lu us\n", tid, poll_us);
+
+  return 0;
+}
+
+// returns the flags the poller has seen (and cleared)
+static int teardown_poller(int tid) {
+  monitoring_context_t *mc = find_monitoring_context(tid);
+  sigset_t mask, old, old_lock;
+  int flags;
+
+  if (!mc) {
+    return 0;
+  }
+
+  // our handler must not run while we tear down
+  sigemptyset(&mask);
+  sigaddset(&mask, timer_signal());
+  pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+  // nor may anyone walking the contexts see ours go away
+  lock_writer(&old_lock);
+
+  stop_poller(mc->poller);
+  flags = mc->poller->flags;
+
+  DEBUG("Thread %d took %lu polls, and saw 0x%x\n", tid, mc->poller->polls, flags);
+
+  if (mc->poller->dropped) {
+    INFO("Dropped %lu poll records for %d because the writer fell behind\n", mc->poller->dropped,
+        tid);
+  }
 
+  if (mc->closed) {
+    // the process is exiting, and has already finished the timeline
+  } else {
+    flush_polls(mc);
+    if (create_monitor_file) {
+      close(mc->fd);
+    }
+  }
+  free_poller(mc->poller);
+  free_monitoring_context(tid);
 
+  unlock_writer(&old_lock);
+  pthread_sigmask(SIG_SETMASK, &old, 0);
 
-//
-// FPspy handles SIGALRM in time-based sampling mode.  The
-// SIGALRM signifies the current interval is over
-//
-static void sigalrm_handler(int sig, siginfo_t *si, void *priv) {
-  monitoring_context_t *mc = find_monitoring_context(gettid());
-  ucontext_t *uc = (ucontext_t *)priv;
+  return flags;
+}
 
-  DEBUG("Timeout for %d\n", gettid());
+// At process exit, finish the timelines of the threads that are still
+// running, whose own teardown then leaves them alone.   Their handlers
+// may keep publishing polls, which are simply never written
+static void close_running_pollers(void) {
+  context_table_t *t;
+  sigset_t old;
+  int i;
 
-  if (!mc) {
-    ERROR("Could not find monitoring context for %d\n", gettid());
-    return;
+  lock_writer(&old);
+  for (t = context_tables; t; t = t->next) {
+    for (i = 0; i < t->size; i++) {
+      monitoring_context_t *mc = t->slot[i].mc;
+      if (t->slot[i].tid > 0 && mc && mc->poller && !mc->closed) {
+        stop_poller(mc->poller);
+        flush_polls(mc);
+        if (create_monitor_file) {
+          close(mc->fd);
+        }
+        mc->closed = 1;
+      }
+    }
   }
-  if (mc->state != AWAIT_FPE) {
-    // we are in the middle of handling an instruction, so we will
-    // defer the transition until after this is done
-    DEBUG("Delaying sampler processing because we are in the middle of an instruction\n");
-    mc->sampler.delayed_processing = 1;
-    return;
-  } else {
-    update_sampler(mc, uc);
+  unlock_writer(&old);
+}
+
+// stop all threads from polling, e.g., on an abort.   Whatever
+// has been buffered is written when the threads exit
+static void stop_pollers(void) {
+  context_table_t *t;
+  sigset_t old;
+  int i;
+
+  // the threads may be tearing down their pollers right now
+  lock_writer(&old);
+  for (t = context_tables; t; t = t->next) {
+    for (i = 0; i < t->size; i++) {
+      monitoring_context_t *mc = t->slot[i].mc;
+      if (t->slot[i].tid > 0 && mc && mc->poller) {
+        stop_poller(mc->poller);
+      }
+    }
   }
+  unlock_writer(&old);
 }
 
 
@@ -1475,17 +3660,96 @@ static void sigalrm_handler(int sig, siginfo_t *si, void *priv) {
 static int bringup_monitoring_context(int tid) {
   monitoring_context_t *c;
   char name[80];
+  time_t now = time(0);
 
   if (!(c = alloc_monitoring_context(tid))) {
     ERROR("Cannot allocate monitoring context\n");
     return -1;
   }
 
+  c->start_time = arch_cycle_count();
+
   if (create_monitor_file) {
-    sprintf(name, "__%s.%lu.%d.individual.fpemon", program_invocation_short_name, time(0), tid);
-    if ((c->fd = open(name, O_CREAT | O_WRONLY, 0666)) < 0) {
-      ERROR("Cannot open monitoring output file\n");
-      free_monitoring_context(tid);
+    if (container) {
+      // the thread's trace goes into the process's container instead
+      c->fd = -1;
+      if (!(c->chunks = alloc_chunker(trace_chunk_size))) {
+        ERROR("Cannot allocate trace chunk buffer\n");
+        discard_monitoring_context(tid);
+        return -1;
+      }
+    } else {
+      sprintf(name, "__%s.%lu.%d.%s.fpemon", program_invocation_short_name, now, tid,
+          mode == SITES ? "sites" : "individual");
+      if ((c->fd = open(name, output == OUTPUT_MMAP ? O_CREAT | O_RDWR | O_TRUNC : O_CREAT | O_WRONLY,
+               0666)) < 0) {
+        ERROR("Cannot open monitoring output file\n");
+        discard_monitoring_context(tid);
+        return -1;
+      }
+    }
+    if (mode == INDIVIDUAL) {
+      init_trace_header(c, &c->trace_header);
+      if (output == OUTPUT_MMAP) {
+        if (mmap_trace_open(c)) {
+          ERROR("Cannot map monitoring output file\n");
+          close(c->fd);
+          free_chunker(c->chunks);
+          discard_monitoring_context(tid);
+          return -1;
+        }
+      } else if (trace_format != 1 && write_trace(c, &c->trace_header, sizeof(c->trace_header))) {
+        ERROR("Cannot write monitoring output file header\n");
+        close(c->fd);
+        free_chunker(c->chunks);
+        discard_monitoring_context(tid);
+        return -1;
+      }
+    }
+  }
+
+  if (mode == INDIVIDUAL && create_monitor_file && trace_format != 1 &&
+      !(c->instrs = alloc_instr_dict(CONFIG_INSTR_DICT_SIZE))) {
+    ERROR("Cannot allocate instruction dictionary\n");
+    close(c->fd);
+    free_chunker(c->chunks);
+    discard_monitoring_context(tid);
+    return -1;
+  }
+
+  if (mode == INDIVIDUAL && create_monitor_file && compress &&
+      !(c->blocks = alloc_blocker(trace_block_size))) {
+    ERROR("Cannot allocate trace block buffer\n");
+    close(c->fd);
+    free_instr_dict(c->instrs);
+    free_chunker(c->chunks);
+    discard_monitoring_context(tid);
+    return -1;
+  }
+
+  if ((mode == SITES || (mode == INDIVIDUAL && site_throttle)) &&
+      !(c->sites = alloc_site_table(CONFIG_SITE_TABLE_SIZE))) {
+    ERROR("Cannot allocate site table\n");
+    if (create_monitor_file) {
+      close(c->fd);
+    }
+    free_instr_dict(c->instrs);
+    free_blocker(c->blocks);
+    free_chunker(c->chunks);
+    discard_monitoring_context(tid);
+    return -1;
+  }
+
+  if (mode == INDIVIDUAL && site_throttle && create_monitor_file) {
+    sprintf(name, "__%s.%lu.%d.sites.fpemon", program_invocation_short_name, now, tid);
+    if ((c->sites_fd = open(name, O_CREAT | O_WRONLY, 0666)) < 0) {
+      ERROR("Cannot open sites output file\n");
+      close(c->fd);
+      free_site_table(c->sites);
+      free_instr_dict(c->instrs);
+      free_blocker(c->blocks);
+      free_chunker(c->chunks);
+      discard_monitoring_context(tid);
       return -1;
     }
   }
@@ -1500,6 +3764,35 @@ static int bringup_monitoring_context(int tid) {
     } else {
       DEBUG("thread kernel setup successful\n");
     }
+    // the single step traps too, if the module is willing
+    extern void *_user_fpspy_db_entry;
+    struct fpvm_db_reg db_reg = {.handler = (uint64_t)&_user_fpspy_db_entry,
+        .armed = (uint64_t)&sc_step_armed};
+    if (ioctl(kernel_fd, FPVM_IOCTL_REG_DB, &db_reg)) {
+      DEBUG("thread kernel single step setup unavailable, using SIGTRAP\n");
+    } else {
+      DEBUG("thread kernel single step setup successful\n");
+    }
+    // and the kernel records the events itself, if asked and able,
+    // in a ring the size of our own
+    if (kernel_ring) {
+      size_t len = (sizeof(fpvm_ring_t) + trace_buflen * sizeof(fpvm_ring_record_t) +
+                       getpagesize() - 1) &
+                   ~((size_t)getpagesize() - 1);
+      if (ioctl(kernel_fd, FPVM_IOCTL_REG_RING, (unsigned long)trace_buflen)) {
+        DEBUG("thread kernel event ring unavailable, recording events ourselves\n");
+      } else if ((c->kring = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, kernel_fd, 0)) ==
+                 MAP_FAILED) {
+        // the kernel is recording into a ring no one will drain
+        c->kring = 0;
+        ERROR("SC failed to map kernel event ring, very bad\n");
+        abort_operation("thread failed to map kernel event ring\n");
+        return -1;
+      } else {
+        c->kring_len = len;
+        DEBUG("thread kernel event ring setup successful\n");
+      }
+    }
   }
 #endif
 
@@ -1507,41 +3800,173 @@ static int bringup_monitoring_context(int tid) {
   init_bypassed_exceptions();
 #endif
 
-  c->start_time = arch_cycle_count();
   c->state = INIT;
   c->aborting_in_trap = 0;
   c->count = 0;
   c->trap_mode_state = 0;
 
   init_sampler(&c->sampler);
+  init_governor(&c->governor);
 
   return 0;
 }
 
 
+// The site counts go to the context's own file in sites mode, and to
+// its sites file in individual mode with per-site throttling
+static void write_context_sites(monitoring_context_t *mc) {
+  if (mode == SITES) {
+    if (write_sites(mc, mc->fd)) {
+      ERROR("Failed to write sites\n");
+    }
+  } else if (mode == INDIVIDUAL && mc->sites) {
+    if (write_sites(mc, mc->sites_fd)) {
+      ERROR("Failed to write sites\n");
+    }
+    close(mc->sites_fd);
+  }
+}
+
+// Write out everything the context still holds and close its files:
+// the sites, the remaining records, the last block and the block index,
+// and the final header.   Used both when a thread tears down its context
+// and, for threads still running then, at process exit
+static void finish_context_files(monitoring_context_t *mc) {
+  write_context_sites(mc);
+  if (mode == SITES) {
+    // nothing more to write
+  } else if (output == OUTPUT_MMAP) {
+    mmap_trace_close(mc, 1);
+  } else {
+    if (output == OUTPUT_THREAD) {
+      drain_ring(mc);
+    } else {
+      flush_trace_records(mc);
+    }
+    if (mc->blocks && finish_trace_blocks(mc)) {
+      ERROR("Failed to finish trace blocks\n");
+    }
+    if (trace_format != 1) {
+      trace_file_header_t *h = &mc->trace_header;
+      h->flags |= TRACE_FILE_COUNTED;
+      h->record_count = mc->records_written;
+      h->data_len = mc->bytes_written;
+      finish_trace_header(mc, h);
+      if (rewrite_trace_header(mc, h)) {
+        ERROR("Failed to update trace file header\n");
+      }
+    } else {
+      // no header to put the sampling in
+      int i;
+      for (i = 0; i < TRACE_SAMPLE_CLASSES; i++) {
+        if (sample_period[i] != 1 && mc->sample_seen[i]) {
+          INFO("%d recorded %lu of %lu %s events\n", mc->tid, mc->sample_recorded[i],
+              mc->sample_seen[i], sample_class_name[i]);
+        }
+      }
+    }
+    if (mc->chunks && flush_trace_chunk(mc)) {
+      ERROR("Failed to write trace chunk\n");
+    }
+  }
+  close(mc->fd);
+}
+
 static int teardown_monitoring_context(int tid) {
-  monitoring_context_t *mc = find_monitoring_context(tid);
+  monitoring_context_t *mc;
+  sigset_t old;
+
+  // the writer, and the exit path, must not see the context once we
+  // free it
+  lock_writer(&old);
+
+  mc = find_monitoring_context(tid);
 
   if (!mc) {
+    unlock_writer(&old);
     ERROR("Cannot find monitoring context for %d\n", tid);
     return -1;
   }
 
-  // add later - not relevant now PAD
-  // deinit_sampler(&mc->sampler);
+  if (mc->closed) {
+    // the process is exiting, and has already finished it for us
+    unlock_writer(&old);
+    DEBUG("Monitoring context for %d already closed at exit\n", tid);
+    return 0;
+  }
+
+  deinit_sampler(&mc->sampler);
 
   if (create_monitor_file != 0) {
-    flush_trace_records(mc);
-    close(mc->fd);
+    finish_context_files(mc);
+  }
+
+#if CONFIG_TRAP_SHORT_CIRCUITING
+  // drained above, and the module keeps recording into the ring until
+  // the thread exits, so later events are lost, like any after teardown
+  if (mc->kring) {
+    mc->dropped += ((fpvm_ring_t *)mc->kring)->dropped;
+    munmap(mc->kring, mc->kring_len);
+    mc->kring = 0;
+  }
+#endif
+
+  if (mc->dropped) {
+    INFO("Dropped %lu trace records for %d because the writer fell behind\n", mc->dropped, tid);
+  }
+
+  if (mc->governor.offs) {
+    INFO("Governor switched %d off %lu times (%lu level changes, last overhead %lu ppm)\n", tid,
+        mc->governor.offs, mc->governor.changes, mc->governor.overhead);
   }
 
+  free_site_table(mc->sites);
+  free_instr_dict(mc->instrs);
+  free_blocker(mc->blocks);
+  free_chunker(mc->chunks);
   free_monitoring_context(tid);
 
+  unlock_writer(&old);
+
   DEBUG("Tore down monitoring context for %d\n", tid);
 
   return 0;
 }
 
+// in a forked child, the contexts (and tables) inherited from the
+// parent's threads are discarded without being flushed
+static void forget_monitoring_contexts(void) {
+  context_table_t *t, *n;
+  int i;
+
+  for (t = context_tables; t; t = n) {
+    for (i = 0; i < t->size; i++) {
+      monitoring_context_t *mc = t->slot[i].mc;
+      if (t->slot[i].tid > 0 && mc) {
+        if (create_monitor_file != 0) {
+          mmap_trace_close(mc, 0);
+          close(mc->fd);
+          if (mode == INDIVIDUAL && mc->sites) {
+            close(mc->sites_fd);
+          }
+        }
+        free_site_table(mc->sites);
+        free_instr_dict(mc->instrs);
+        free_blocker(mc->blocks);
+        free_chunker(mc->chunks);
+        free_poller(mc->poller);
+        munmap(mc, mc->alloc_len);
+      }
+    }
+    n = t->next;
+    if (t != context_tables) {
+      munmap(t, sizeof(context_table_t) + t->size * sizeof(context_slot_t));
+    }
+  }
+
+  init_monitoring_contexts();
+}
+
 
 //
 // Bringup FPSpy in the process
@@ -1576,22 +4001,34 @@ static int bringup() {
 #endif
 
 
-  if (mode == INDIVIDUAL) {
+  if (mode != AGGREGATE) {
     struct sigaction sa;
 
-    int alarm_sig = timer_type == ITIMER_REAL      ? SIGALRM
-                    : timer_type == ITIMER_VIRTUAL ? SIGVTALRM
-                    : timer_type == ITIMER_PROF    ? SIGPROF
-                                                   : SIGALRM;
+    int alarm_sig = timer_signal();
 
     init_monitoring_contexts();
 
+    if (output == OUTPUT_THREAD && start_writer()) {
+      ERROR("Failed to start trace writer, handlers will write trace records\n");
+      output = OUTPUT_INLINE;
+      compress = 0;
+      container = 0;
+      kernel_ring = 0;
+    }
+
+    if (container && open_container()) {
+      ERROR("Failed to open container, threads will have their own trace files\n");
+      container = 0;
+    }
+
 #if CONFIG_TRAP_SHORT_CIRCUITING
     // need to do this early because we rely on bringup_monitoring_context
     if (kernel && kernel_fd == -1) {
       kernel_fd = open("/dev/fpvm_dev", O_RDWR);
       if (kernel_fd < 0) {
         ERROR("SC failed to open kernel support (/dev/fpvm_dev), falling back to signal handler\n");
+      } else {
+        sc_state_init();
       }
     } else {
       DEBUG("skipping kernel support, even though it is enabled\n");
@@ -1664,17 +4101,52 @@ static int bringup() {
     if (kickstart) {
       INFO("Send SIGTRAP to process %d to start\n", getpid());
     } else {
-      // now kick ourselves to set the sse bits; we are currently in state INIT
+      // now set the sse bits; we are currently in state INIT
       // this will also do the architecture init for the thread
-      kick_self();
+      start_self();
     }
 
   } else {
+    struct sigaction sa;
+
     // we need to bring up the architectural state for the thread
     if (arch_thread_init(0)) {
       ERROR("Failed to bring up thread architectural state\n");
       return -1;
     }
+
+    if (init_aggregate_rollup()) {
+      ERROR("Cannot allocate aggregate thread table, so no per-thread breakdown\n");
+    }
+
+    // so that the roll-up is written even on a break
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = sigint_handler;
+    sa.sa_flags |= SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    ORIG_IF_CAN(sigaction, SIGINT, &sa, &oldsa_int);
+
+    if (poll_us) {
+      init_monitoring_contexts();
+
+      // the timelines are written by the writer thread
+      if (create_monitor_file && !disable_pthreads && start_writer()) {
+        ERROR("Failed to start trace writer, polls beyond what a thread's ring holds will be dropped\n");
+      }
+
+      DEBUG("Setting up poll timer handler\n");
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_sigaction = poll_handler;
+      sa.sa_flags |= SA_SIGINFO | SA_RESTART;
+      sigemptyset(&sa.sa_mask);
+      sigaddset(&sa.sa_mask, SIGINT);
+      ORIG_IF_CAN(sigaction, timer_signal(), &sa, &oldsa_alrm);
+
+      if (bringup_poller(gettid())) {
+        ERROR("Failed to start polling\n");
+        // we won't break, however..
+      }
+    }
   }
 
   inited = 1;
@@ -1686,6 +4158,63 @@ static int bringup() {
 // FPSpy runtime configuration, prior to bringup
 //
 
+// FPSPY_SAMPLE is either k, for every class, or a list of class:k
+static void config_sampling(char *buf) {
+  char copy[strlen(buf) + 1];
+  char *tok, *save, *colon;
+  int i;
+
+  if (!strchr(buf, ':')) {
+    for (i = 0; i < TRACE_SAMPLE_CLASSES; i++) {
+      sample_period[i] = atoi(buf);
+    }
+    DEBUG("Setting sample period to %d\n", atoi(buf));
+    return;
+  }
+
+  strcpy(copy, buf);
+  for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(0, ",", &save)) {
+    if (!(colon = strchr(tok, ':'))) {
+      ERROR("FPSPY_SAMPLE entry %s is not class:period\n", tok);
+      continue;
+    }
+    *colon = 0;
+    for (i = 0; i < TRACE_SAMPLE_CLASSES; i++) {
+      if (sample_class_name[i] &&
+          !strncasecmp(tok, sample_class_name[i], strlen(sample_class_name[i]))) {
+        sample_period[i] = atoi(colon + 1);
+        DEBUG("Setting sample period for %s to %u\n", sample_class_name[i], sample_period[i]);
+        break;
+      }
+    }
+    if (i == TRACE_SAMPLE_CLASSES) {
+      ERROR("FPSPY_SAMPLE class %s is unknown\n", tok);
+    }
+  }
+}
+
+// FPSPY_OVERHEAD_BUDGET is a percentage of each thread's cycles, e.g. 3%
+static int config_overhead_budget(char *buf) {
+  char *end;
+  double percent;
+
+  if (mode == AGGREGATE) {
+    DEBUG("ignoring overhead budget for aggregate mode\n");
+    return 0;
+  }
+
+  percent = strtod(buf, &end);
+  if (end == buf || (*end && strcmp(end, "%")) || percent <= 0 || percent >= 100) {
+    return -1;
+  }
+
+  overhead_budget = percent * 10000;
+  // the governor switches threads off and on with the timer
+  timers = 1;
+  DEBUG("Setting overhead budget to %u ppm\n", overhead_budget);
+  return 0;
+}
+
 static void config_exceptions(char *buf) {
   if (mode == AGGREGATE) {
     DEBUG("ignoring exception list for aggregate mode\n");
@@ -1821,6 +4350,13 @@ static __attribute__((constructor)) void fpspy_init(void) {
         if (!strcasecmp(getenv("FPSPY_MODE"), "aggregate")) {
           mode = AGGREGATE;
           DEBUG("Setting AGGREGATE mode\n");
+        } else if (!strcasecmp(getenv("FPSPY_MODE"), "sites")) {
+          if (!arch_machine_supports_fp_traps()) {
+            ERROR("FPSPY_MODE requests sites mode, but this machine does not support FP traps\n");
+            abort();
+          }
+          mode = SITES;
+          DEBUG("Setting SITES mode\n");
         } else {
           ERROR("FPSPY_MODE is given, but mode %s does not make sense\n", getenv("FPSPY_MODE"));
           abort();
@@ -1841,14 +4377,113 @@ static __attribute__((constructor)) void fpspy_init(void) {
         (getenv("DISABLE_PTHREADS") && tolower(getenv("DISABLE_PTHREADS")[0]) == 'y')) {
       disable_pthreads = 1;
     }
+    if (getenv("FPSPY_TRACE_BUFLEN")) {
+      char *nptr = getenv("FPSPY_TRACE_BUFLEN");
+      char *endptr = NULL;
+      unsigned long ret = strtoul(nptr, &endptr, 10);
+      if (*nptr >= '0' && *nptr <= '9' && *endptr == '\0' && ret <= TRACE_BUFLEN_MAX) {
+        trace_buflen = ret;
+      } else {
+        ERROR("FPSPY_TRACE_BUFLEN must be a number of records from 0 to %lu, but %s was found\n",
+            TRACE_BUFLEN_MAX, nptr);
+        abort();
+      }
+      DEBUG("Setting trace buffer length to %lu records\n", trace_buflen);
+    }
     if (getenv("FPSPY_SAMPLE")) {
-      sample_period = atoi(getenv("FPSPY_SAMPLE"));
-      DEBUG("Setting sample period to %d\n", sample_period);
+      config_sampling(getenv("FPSPY_SAMPLE"));
     }
     if (getenv("FPSPY_KERNEL") && tolower(getenv("FPSPY_KERNEL")[0]) == 'y') {
       DEBUG("Attempting to use FPSpy (i.e., FPVM) kernel suppport\n");
       kernel = 1;
     }
+    if (getenv("FPSPY_KERNEL_RING") && tolower(getenv("FPSPY_KERNEL_RING")[0]) == 'y') {
+      DEBUG("Attempting to have the kernel record events\n");
+      kernel_ring = 1;
+    }
+    if (getenv("FPSPY_OUTPUT")) {
+      if (!strcasecmp(getenv("FPSPY_OUTPUT"), "thread")) {
+        output = OUTPUT_THREAD;
+      } else if (!strcasecmp(getenv("FPSPY_OUTPUT"), "inline")) {
+        output = OUTPUT_INLINE;
+      } else if (!strcasecmp(getenv("FPSPY_OUTPUT"), "mmap")) {
+        output = OUTPUT_MMAP;
+      } else {
+        ERROR("FPSPY_OUTPUT is given, but output %s does not make sense\n", getenv("FPSPY_OUTPUT"));
+        abort();
+      }
+    }
+    if (getenv("FPSPY_TRACE_FORMAT")) {
+      if (!strcasecmp(getenv("FPSPY_TRACE_FORMAT"), "v1")) {
+        trace_format = 1;
+      } else if (!strcasecmp(getenv("FPSPY_TRACE_FORMAT"), "v2")) {
+        trace_format = 2;
+      } else {
+        ERROR("FPSPY_TRACE_FORMAT is given, but format %s does not make sense\n",
+            getenv("FPSPY_TRACE_FORMAT"));
+        abort();
+      }
+    }
+    if (getenv("FPSPY_CONTAINER") && tolower(getenv("FPSPY_CONTAINER")[0]) == 'y') {
+      DEBUG("Writing traces to a container per process\n");
+      container = 1;
+    }
+    if (getenv("FPSPY_COMPRESS") && tolower(getenv("FPSPY_COMPRESS")[0]) == 'y') {
+      DEBUG("Compressing trace files\n");
+      compress = 1;
+    }
+    if (getenv("FPSPY_BACKPRESSURE")) {
+      if (!strcasecmp(getenv("FPSPY_BACKPRESSURE"), "block")) {
+        backpressure = BACKPRESSURE_BLOCK;
+      } else if (!strcasecmp(getenv("FPSPY_BACKPRESSURE"), "drop")) {
+        backpressure = BACKPRESSURE_DROP;
+      } else {
+        ERROR("FPSPY_BACKPRESSURE is given, but policy %s does not make sense\n",
+            getenv("FPSPY_BACKPRESSURE"));
+        abort();
+      }
+    }
+    if (getenv("FPSPY_SITE_THROTTLE")) {
+      char *nptr = getenv("FPSPY_SITE_THROTTLE");
+      char *endptr = NULL;
+      unsigned long ret = strtoul(nptr, &endptr, 10);
+      if (*nptr >= '0' && *nptr <= '9' && *endptr == '\0' && ret <= UINT32_MAX) {
+        site_throttle = ret;
+      } else {
+        ERROR("FPSPY_SITE_THROTTLE must be a number of events from 0 to %u, but %s was found\n",
+            UINT32_MAX, nptr);
+        abort();
+      }
+      DEBUG("Recording the first %u events at each site in full\n", site_throttle);
+    }
+    if (getenv("FPSPY_POLL")) {
+      if (mode == AGGREGATE) {
+        char *nptr = getenv("FPSPY_POLL");
+        char *endptr = NULL;
+        unsigned long ret = strtoul(nptr, &endptr, 10);
+        if (*nptr >= '0' && *nptr <= '9' && *endptr == '\0' && ret >= POLL_US_MIN &&
+            ret <= POLL_US_MAX) {
+          poll_us = ret;
+        } else {
+          ERROR("FPSPY_POLL must be a period from %lu to %lu us, but %s was found\n", POLL_US_MIN,
+              POLL_US_MAX, nptr);
+          abort();
+        }
+        DEBUG("Polling sticky flags every %lu us\n", poll_us);
+      } else {
+        DEBUG("ignoring poll period for non-aggregate mode\n");
+      }
+    }
+    if (getenv("FPSPY_OVERHEAD_BUDGET")) {
+      if (config_overhead_budget(getenv("FPSPY_OVERHEAD_BUDGET"))) {
+        ERROR("unsupported FPSPY_OVERHEAD_BUDGET arguments\n");
+        return;
+      }
+    }
+    if (getenv("FPSPY_EMULATE") && tolower(getenv("FPSPY_EMULATE")[0]) == 'n') {
+      DEBUG("Disabling instruction emulation\n");
+      emulate = 0;
+    }
     if (getenv("FPSPY_POISSON")) {
       if (sscanf(getenv("FPSPY_POISSON"), "%lu:%lu", &on_mean_us, &off_mean_us) != 2) {
         ERROR("unsupported FPSPY_POISSON arguments\n");
@@ -1897,6 +4532,34 @@ static __attribute__((constructor)) void fpspy_init(void) {
       abort_on_fpe = 1;
       create_monitor_file = 0;
     }
+    // other outputs only apply to individual mode trace files, and
+    // the writer thread needs pthreads and a buffer to drain
+    if ((output != OUTPUT_INLINE && (mode != INDIVIDUAL || !create_monitor_file)) ||
+        (output == OUTPUT_THREAD && (disable_pthreads || !trace_buflen))) {
+      DEBUG("Handlers will write trace records themselves\n");
+      output = OUTPUT_INLINE;
+    }
+    // compression is done by the writer thread, on v2 records
+    if (compress && (output != OUTPUT_THREAD || trace_format == 1)) {
+      DEBUG("Not compressing, as trace records are not written by the writer thread\n");
+      compress = 0;
+    }
+    // chunks are appended by the writer thread
+    if (container && output != OUTPUT_THREAD) {
+      DEBUG("Not using a container, as trace records are not written by the writer thread\n");
+      container = 0;
+    }
+    // the kernel's rings are drained by the writer thread
+    if (kernel_ring && (!kernel || output != OUTPUT_THREAD)) {
+      DEBUG("Not having the kernel record events, as there is no writer thread to drain them\n");
+      kernel_ring = 0;
+    }
+    if (output == OUTPUT_MMAP) {
+      trace_mmap_chunk = (trace_mmap_chunk + getpagesize() - 1) & ~((uint64_t)getpagesize() - 1);
+      if (!trace_mmap_chunk) {
+        trace_mmap_chunk = getpagesize();
+      }
+    }
     if (bringup()) {
       ERROR("cannot bring up framework\n");
       return;
@@ -1908,38 +4571,142 @@ static __attribute__((constructor)) void fpspy_init(void) {
   }
 }
 
+//
+// Aggregate roll-up
+//
+// In aggregate mode, each thread ORs its flags into the process's
+// roll-up as it exits, and the roll-up is written as a single file
+// when the process finishes (fpspy_deinit, including on SIGINT),
+// instead of a file per thread.   With FPSPY_AGGREGATE_THREADS, the
+// roll-up also keeps each thread's flags (up to
+// CONFIG_AGGREGATE_THREAD_TABLE threads) for a per-thread breakdown.
+// Threads may exit concurrently, so everything is updated atomically.
+//
+
+#define AGGREGATE_ABORTED -1  // flags of a thread that exited after an abort
+
+static int rollup_flags = 0;                  // ORed over the threads
+static uint64_t rollup_threads = 0;           // that have exited
+static uint64_t rollup_count = 0;             // entries claimed
+static aggregate_thread_t *rollup_entry = 0;  // per-thread breakdown, if kept
+
+static int init_aggregate_rollup(void) {
+  size_t len = CONFIG_AGGREGATE_THREAD_TABLE * sizeof(aggregate_thread_t);
+
+  if (!(getenv("FPSPY_AGGREGATE_THREADS") && tolower(getenv("FPSPY_AGGREGATE_THREADS")[0]) == 'y')) {
+    return 0;
+  }
+
+  // pages are touched only as threads exit
+  rollup_entry = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (rollup_entry == MAP_FAILED) {
+    rollup_entry = 0;
+    return -1;
+  }
+
+  DEBUG("Keeping aggregate info for up to %d threads\n", CONFIG_AGGREGATE_THREAD_TABLE);
+  return 0;
+}
+
+// a forked child reports only on itself, so it also forgets the
+// parent's entries, which would otherwise read as filled in
+static void reset_aggregate_rollup(void) {
+  uint64_t n = rollup_count;
+
+  if (rollup_entry) {
+    if (n > CONFIG_AGGREGATE_THREAD_TABLE) {
+      n = CONFIG_AGGREGATE_THREAD_TABLE;
+    }
+    memset(rollup_entry, 0, n * sizeof(aggregate_thread_t));
+  }
+  rollup_flags = 0;
+  rollup_threads = 0;
+  rollup_count = 0;
+}
+
 //
 // This is invoked when a thread exits, and we are in
 // aggregate mode.   The thread's aggregate info must be
-// dumped to a file at this point
+// rolled up into the process's at this point
 //
 static void handle_aggregate_thread_exit() {
-  // show_current_fe_exceptions();
-  /* If this thread is in aggregate mode, then the monitoring file was not
-   * created before. So this thread needs to do it now that it is exiting. */
-  if (create_monitor_file != 0) {
-    DEBUG("Dumping aggregate exceptions\n");
-    char buf[80];
-    int fd;
-    sprintf(buf, "__%s.%lu.%d.aggregate.fpemon", program_invocation_short_name, time(0), gettid());
-    if ((fd = open(buf, O_CREAT | O_WRONLY, 0666)) < 0) {
-      ERROR("Cannot open monitoring output file\n");
-    } else {
-      if (!aborted) {
-        stringify_current_fe_exceptions(buf);
-        strcat(buf, "\n");
+  // the poller has cleared the flags it saw
+  int seen = poll_us ? teardown_poller(gettid()) : 0;
+  int flags = aborted ? AGGREGATE_ABORTED : current_fe_exceptions() | seen;
+  uint64_t i;
+
+  if (!aborted) {
+    __atomic_fetch_or(&rollup_flags, flags, __ATOMIC_RELAXED);
+  }
+  __atomic_fetch_add(&rollup_threads, 1, __ATOMIC_RELAXED);
+
+  if (rollup_entry) {
+    i = __atomic_fetch_add(&rollup_count, 1, __ATOMIC_RELAXED);
+    if (i < CONFIG_AGGREGATE_THREAD_TABLE) {
+      rollup_entry[i].flags = flags;
+      __atomic_store_n(&rollup_entry[i].tid, gettid(), __ATOMIC_RELEASE);
+    }
+  }
+
+  DEBUG("Thread %d rolled up aggregate exceptions 0x%x\n", gettid(), flags);
+}
+
+// The first line is the process's exceptions, as a thread's used to
+// be.   With the breakdown, a line per thread follows.
+static void write_aggregate_rollup(void) {
+  char buf[128];
+  uint64_t i, n;
+  int fd, tid, len;
+
+  if (!create_monitor_file) {
+    DEBUG("Skipping dumping aggregate exceptions\n");
+    return;
+  }
+
+  DEBUG("Dumping aggregate exceptions for %lu threads\n", rollup_threads);
+
+  sprintf(buf, "__%s.%lu.%d.aggregate.fpemon", program_invocation_short_name, time(0), getpid());
+  if ((fd = open(buf, O_CREAT | O_WRONLY | O_TRUNC, 0666)) < 0) {
+    ERROR("Cannot open monitoring output file\n");
+    return;
+  }
+
+  if (!aborted) {
+    stringify_fe_exceptions(buf, __atomic_load_n(&rollup_flags, __ATOMIC_RELAXED));
+    strcat(buf, "\n");
+  } else {
+    strcpy(buf, "ABORTED\n");
+  }
+  if (writeall(fd, buf, strlen(buf))) {
+    ERROR("Failed to write all of monitoring output\n");
+  }
+  DEBUG("aggregate exception string: %s", buf);
+
+  if (rollup_entry) {
+    n = __atomic_load_n(&rollup_count, __ATOMIC_RELAXED);
+    if (n > CONFIG_AGGREGATE_THREAD_TABLE) {
+      INFO("Aggregate breakdown is missing %lu threads\n", n - CONFIG_AGGREGATE_THREAD_TABLE);
+      n = CONFIG_AGGREGATE_THREAD_TABLE;
+    }
+    for (i = 0; i < n; i++) {
+      if (!(tid = __atomic_load_n(&rollup_entry[i].tid, __ATOMIC_ACQUIRE))) {
+        continue;  // still being filled in
+      }
+      len = sprintf(buf, "%d\t", tid);
+      if (rollup_entry[i].flags == AGGREGATE_ABORTED) {
+        strcpy(buf + len, "ABORTED");
       } else {
-        strcpy(buf, "ABORTED\n");
+        stringify_fe_exceptions(buf + len, rollup_entry[i].flags);
       }
+      strcat(buf, "\n");
       if (writeall(fd, buf, strlen(buf))) {
         ERROR("Failed to write all of monitoring output\n");
+        break;
       }
-      DEBUG("aggregate exception string: %s", buf);
-      close(fd);
     }
-  } else {
-    DEBUG("Skipping dumping aggregate exceptions\n");
   }
+
+  close(fd);
 }
 
 
@@ -1950,23 +4717,47 @@ static __attribute__((destructor)) void fpspy_deinit(void) {
   DEBUG("deinit\n");
   if (inited) {
     if (mode == AGGREGATE) {
+      stop_writer();
       handle_aggregate_thread_exit();
+      if (poll_us) {
+        close_running_pollers();
+      }
+      write_aggregate_rollup();
     } else {
+      stop_writer();
       teardown_monitoring_context(gettid());
+      context_table_t *t;
+      sigset_t old;
       int i;
       DEBUG("FPE exceptions previously dumped to files - now closing them\n");
-      for (i = 0; i < CONFIG_MAX_CONTEXTS; i++) {
-        if (context[i].tid) {
-          if (create_monitor_file != 0) {
-            close(context[i].fd);
+      // the other threads may be tearing down their contexts right now,
+      // which they do with writer_lock held.  Those we finish here are
+      // marked, so that they record nothing more, and so that their own
+      // teardown later leaves them alone
+      lock_writer(&old);
+      for (t = context_tables; t; t = t->next) {
+        for (i = 0; i < t->size; i++) {
+          monitoring_context_t *mc = t->slot[i].mc;
+          if (t->slot[i].tid > 0 && mc && !mc->closed) {
+            if (close_running_context(mc)) {
+              // stuck recording, so its files are left as they are
+              ERROR("Cannot close files of thread %d, which is still recording\n", mc->tid);
+            } else if (create_monitor_file != 0) {
+              // still running threads get what they have published
+              finish_context_files(mc);
+            }
           }
         }
       }
+      unlock_writer(&old);
 #if CONFIG_TRAP_SHORT_CIRCUITING
       if (kernel && kernel_fd > 0) {
         close(kernel_fd);
       }
 #endif
+      if (container) {
+        close(container_fd);
+      }
       /* TODO: Close the RISC-V bypassed character device! */
     }
   }
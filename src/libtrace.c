@@ -11,6 +11,8 @@
 #include <fcntl.h>
 
 #include "libtrace.h"
+#include "trace_codec.h"
+#include "trace_lz.h"
 
 //  Part of FPSpy
 //
@@ -19,80 +21,886 @@
 //
 //  Copyright (c) 2018 Peter A. Dinda - see LICENSE
 
-trace_t *trace_attach(char *file) {
+// decode delta encoded records, appending them to t->decoded, and
+// stopping quietly at a truncated record (e.g., after a crash)
+static int decode(trace_t *t, const uint8_t *data, uint64_t len) {
+  const uint8_t *end = data + len;
+  trace_codec_state_t s;
+  trace_decode_dict_t d = {0, 0};
+  int n;
+
+  trace_codec_reset(&s);
+
+  while (data < end) {
+    if (t->numrecs == t->decoded_size) {
+      individual_trace_record_t *r;
+      uint64_t size = t->decoded_size ? t->decoded_size * 2 : 1024;
+      r = realloc(t->decoded, size * sizeof(individual_trace_record_t));
+      if (!r) {
+        free(d.entry);
+        return -1;
+      }
+      t->decoded = r;
+      t->decoded_size = size;
+    }
+    n = trace_decode_record(&s, &d, data, end, &t->decoded[t->numrecs]);
+    if (n < 0) {
+      free(d.entry);
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    data += n;
+    t->numrecs++;
+  }
+
+  free(d.entry);
+  t->rec = t->decoded;
+
+  return 0;
+}
+
+// find the blocks of a TRACE_FILE_BLOCKS file, from its index if it
+// has one, and otherwise by walking them
+static int find_blocks(trace_t *t, uint64_t len) {
+  trace_file_header_t *h = t->header;
+  trace_block_header_t *bh;
+  uint64_t off, size = 0;
+
+  if ((h->flags & TRACE_FILE_COUNTED) && h->index_offset && h->index_offset <= len &&
+      h->block_count <= (len - h->index_offset) / sizeof(trace_block_index_t)) {
+    t->blocks = (trace_block_index_t *)(t->map + h->index_offset);
+    t->numblocks = h->block_count;
+    return 0;
+  }
+
+  if ((h->flags & TRACE_FILE_COUNTED) && h->data_len < len - h->header_size) {
+    len = h->header_size + h->data_len;
+  }
+
+  for (off = h->header_size; off + sizeof(*bh) <= len; off += sizeof(*bh) + bh->stored_len) {
+    bh = (trace_block_header_t *)(t->map + off);
+    if (bh->magic != TRACE_BLOCK_MAGIC || bh->stored_len > len - off - sizeof(*bh)) {
+      break;
+    }
+    if (t->numblocks == size) {
+      trace_block_index_t *b;
+      size = size ? size * 2 : 64;
+      if (!(b = realloc(t->scanned_blocks, size * sizeof(trace_block_index_t)))) {
+        return -1;
+      }
+      t->scanned_blocks = b;
+    }
+    t->scanned_blocks[t->numblocks].offset = off;
+    t->scanned_blocks[t->numblocks].record_count = bh->record_count;
+    t->scanned_blocks[t->numblocks].first_time = bh->first_time;
+    t->scanned_blocks[t->numblocks].last_time = bh->last_time;
+    t->numblocks++;
+  }
+
+  t->blocks = t->scanned_blocks;
+
+  return 0;
+}
+
+// decode block i, appending its records to t->decoded
+static int decode_block(trace_t *t, uint64_t i) {
+  trace_block_header_t *bh;
+  const uint8_t *data;
+  uint64_t off;
+
+  if (i >= t->numblocks) {
+    return -1;
+  }
+
+  off = t->blocks[i].offset;
+  if (off + sizeof(*bh) > t->map_len) {
+    return -1;
+  }
+  bh = (trace_block_header_t *)(t->map + off);
+  if (bh->magic != TRACE_BLOCK_MAGIC || bh->stored_len > t->map_len - off - sizeof(*bh)) {
+    return -1;
+  }
+  data = (const uint8_t *)(bh + 1);
+
+  if (bh->flags & TRACE_BLOCK_LZ) {
+    if (bh->raw_len > t->raw_size) {
+      uint8_t *r = realloc(t->raw, bh->raw_len);
+      if (!r) {
+        return -1;
+      }
+      t->raw = r;
+      t->raw_size = bh->raw_len;
+    }
+    if (trace_lz_decompress(data, bh->stored_len, t->raw, bh->raw_len) != bh->raw_len) {
+      return -1;
+    }
+    data = t->raw;
+  } else if (bh->raw_len != bh->stored_len) {
+    return -1;
+  }
+
+  return decode(t, data, bh->raw_len);
+}
+
+// how much of a trace is decoded when it is attached
+#define ATTACH_ALL    0  // everything
+#define ATTACH_BLOCKS 1  // not the blocks, which are decoded on demand
+#define ATTACH_STREAM 2  // nothing, a merge decodes as it goes
+
+// interpret the trace at t->map, detaching it if it makes no sense
+static trace_t *parse(trace_t *t, int lazy) {
+  uint64_t len = t->map_len;
+
+  if (len >= TRACE_FILE_HEADER_V1_SIZE &&
+      !memcmp(((trace_file_header_t *)t->map)->magic, TRACE_FILE_MAGIC, 8)) {
+    trace_file_header_t *h = (trace_file_header_t *)t->map;
+
+    t->header = h;
+    t->version = h->version;
+
+    if (h->version == 1 && h->header_size == TRACE_FILE_HEADER_V1_SIZE) {
+      // version 1 headers were only written by the mmap output,
+      // which always counts
+      t->record_format = TRACE_RECORD_FIXED;
+    } else if (h->version == TRACE_FILE_VERSION && h->header_size >= TRACE_FILE_HEADER_V2_SIZE) {
+      t->record_format = h->record_format;
+    } else {
+      trace_detach(t);
+      return 0;
+    }
+
+    if (h->header_size > len || (t->record_format == TRACE_RECORD_FIXED &&
+                                    h->record_size != sizeof(individual_trace_record_t))) {
+      trace_detach(t);
+      return 0;
+    }
+
+    if (t->record_format == TRACE_RECORD_FIXED) {
+      uint64_t avail;
+
+      // the file may extend past what was committed, or, if the
+      // writer was killed at just the wrong time, fall short of it
+      avail = (len - h->header_size) / sizeof(individual_trace_record_t);
+      if ((h->version == 1 || (h->flags & TRACE_FILE_COUNTED)) && h->record_count < avail) {
+        avail = h->record_count;
+      }
+      t->numrecs = avail;
+      t->rec = (individual_trace_record_t *)(t->map + h->header_size);
+    } else if (t->record_format == TRACE_RECORD_DELTA && h->version >= 2 &&
+               (h->flags & TRACE_FILE_BLOCKS)) {
+      uint64_t i;
+
+      if (find_blocks(t, len)) {
+        trace_detach(t);
+        return 0;
+      }
+      for (i = 0; lazy == ATTACH_ALL && i < t->numblocks; i++) {
+        if (decode_block(t, i)) {
+          trace_detach(t);
+          return 0;
+        }
+      }
+    } else if (t->record_format == TRACE_RECORD_DELTA) {
+      t->data = t->map + h->header_size;
+      t->data_len = (h->flags & TRACE_FILE_COUNTED) && h->data_len < len - h->header_size
+                        ? h->data_len
+                        : len - h->header_size;
+      if (lazy != ATTACH_STREAM && decode(t, t->data, t->data_len)) {
+        trace_detach(t);
+        return 0;
+      }
+    } else {
+      trace_detach(t);
+      return 0;
+    }
+  } else {
+    if (len % sizeof(individual_trace_record_t)) {
+      trace_detach(t);
+      return 0;
+    }
+    t->record_format = TRACE_RECORD_FIXED;
+    t->numrecs = len / sizeof(individual_trace_record_t);
+    t->rec = (individual_trace_record_t *)t->map;
+  }
+
+  return t;
+}
+
+// map a whole file read-only
+static void *map_file(char *file, int *fd, uint64_t *len) {
   struct stat s;
-  uint64_t len;
-  trace_t *t;
-  int fd;
+  void *map;
 
-  fd = open(file, O_RDONLY, 0666);
+  *fd = open(file, O_RDONLY, 0666);
 
-  if (fd < 0) {
+  if (*fd < 0) {
+    return 0;
+  }
+
+  if (fstat(*fd, &s) < 0) {
+    close(*fd);
     return 0;
   }
 
+  *len = s.st_size;
+
+  map = mmap(0, *len, PROT_READ, MAP_SHARED, *fd, 0);
+
+  if (map == MAP_FAILED) {
+    close(*fd);
+    return 0;
+  }
+
+  return map;
+}
+
+static trace_t *attach(char *file, int lazy) {
+  trace_t *t;
+
   t = malloc(sizeof(trace_t));
 
   if (!t) {
-    close(fd);
     return t;
   }
 
   memset(t, 0, sizeof(*t));
 
-  t->fd = fd;
-
-  if (fstat(fd, &s) < 0) {
-    close(fd);
+  if (!(t->map = map_file(file, &t->fd, &t->map_len))) {
     free(t);
     return 0;
   }
 
-  len = s.st_size;
+  return parse(t, lazy);
+}
 
-  if (len % sizeof(individual_trace_record_t)) {
-    close(fd);
-    free(t);
-    return 0;
+trace_t *trace_attach(char *file) { return attach(file, ATTACH_ALL); }
+
+trace_t *trace_attach_blocks(char *file) { return attach(file, ATTACH_BLOCKS); }
+
+void trace_detach(trace_t *t) {
+  free(t->decoded);
+  free(t->scanned_blocks);
+  free(t->raw);
+  if (t->stream) {
+    free(t->stream);
+  } else {
+    munmap(t->map, t->map_len);
+    close(t->fd);
   }
+  free(t);
+}
 
-  t->numrecs = len / sizeof(individual_trace_record_t);
+uint64_t trace_num_blocks(trace_t *t) { return t->blocks ? t->numblocks : 1; }
 
-  t->rec = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+int trace_load_block(trace_t *t, uint64_t i) {
+  if (!t->blocks) {
+    return i == 0 ? 0 : -1;
+  }
+  t->numrecs = 0;
+  t->rec = t->decoded;
+  return decode_block(t, i);
+}
 
-  if (t->rec == MAP_FAILED) {
-    close(fd);
-    free(t);
+uint64_t trace_find_block(trace_t *t, uint64_t time) {
+  uint64_t lo = 0, hi;
+
+  if (!t->blocks) {
     return 0;
   }
 
-  return t;
+  // first block that does not end before time
+  hi = t->numblocks;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (t->blocks[mid].last_time < time) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
 }
 
-void trace_detach(trace_t *t) {
-  munmap(t->rec, t->numrecs * sizeof(individual_trace_record_t));
-  close(t->fd);
-  free(t);
+
+int trace_map_range(char *file, uint64_t start, uint64_t end,
+    void (*filter)(individual_trace_record_t *, void *), void *state) {
+  uint64_t b, i;
+  trace_t *t = trace_attach_blocks(file);
+
+  if (!t) {
+    return -1;
+  }
+
+  for (b = trace_find_block(t, start); b < trace_num_blocks(t); b++) {
+    if (t->blocks && t->blocks[b].first_time > end) {
+      break;
+    }
+    if (trace_load_block(t, b)) {
+      trace_detach(t);
+      return -1;
+    }
+    for (i = 0; i < t->numrecs; i++) {
+      if (t->rec[i].time >= start && t->rec[i].time <= end) {
+        filter(&t->rec[i], state);
+      }
+    }
+  }
+
+  trace_detach(t);
+
+  return 0;
 }
 
 
 int trace_map(char *file, void (*filter)(individual_trace_record_t *, void *), void *state) {
+  return trace_map_range(file, 0, (uint64_t)-1, filter, state);
+}
+
+
+//
+// Container files
+//
+// On attach, the chunks are only indexed, by thread.   A thread's
+// trace is assembled from its chunks when it is attached, and is then
+// interpreted exactly as if it had been read from its own file.
+//
+
+int trace_is_container(char *file) {
+  char magic[8];
+  int fd = open(file, O_RDONLY, 0666);
+  int rc;
+
+  if (fd < 0) {
+    return 0;
+  }
+
+  rc = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+       !memcmp(magic, TRACE_CONTAINER_MAGIC, sizeof(magic));
+
+  close(fd);
+
+  return rc;
+}
+
+static trace_container_thread_t *find_thread(trace_container_t *c, int tid) {
   uint64_t i;
-  trace_t *t = trace_attach(file);
+
+  for (i = 0; i < c->numthreads; i++) {
+    if (c->threads[i].tid == tid) {
+      return &c->threads[i];
+    }
+  }
+
+  return 0;
+}
+
+// note a chunk of a thread's trace, adding the thread if it is new
+static int add_chunk(trace_container_t *c, trace_chunk_header_t *ch, uint64_t off) {
+  trace_container_thread_t *th = find_thread(c, ch->tid);
+
+  if (!th) {
+    if (c->numthreads == c->size) {
+      uint64_t size = c->size ? c->size * 2 : 16;
+      trace_container_thread_t *n = realloc(c->threads, size * sizeof(*n));
+      if (!n) {
+        return -1;
+      }
+      c->threads = n;
+      c->size = size;
+    }
+    th = &c->threads[c->numthreads++];
+    memset(th, 0, sizeof(*th));
+    th->tid = ch->tid;
+  }
+
+  if (th->numchunks == th->size) {
+    uint64_t size = th->size ? th->size * 2 : 16;
+    uint64_t *n = realloc(th->chunks, size * sizeof(*n));
+    if (!n) {
+      return -1;
+    }
+    th->chunks = n;
+    th->size = size;
+  }
+  th->chunks[th->numchunks++] = off;
+
+  if (ch->offset + ch->len > th->len) {
+    th->len = ch->offset + ch->len;
+  }
+
+  return 0;
+}
+
+trace_container_t *trace_container_attach(char *file) {
+  trace_container_t *c;
+  trace_chunk_header_t *ch;
+  uint64_t payload = 0;
+  uint64_t off;
+  uint64_t i;
+
+  c = malloc(sizeof(trace_container_t));
+
+  if (!c) {
+    return c;
+  }
+
+  memset(c, 0, sizeof(*c));
+
+  if (!(c->map = map_file(file, &c->fd, &c->map_len))) {
+    free(c);
+    return 0;
+  }
+
+  c->header = (trace_container_header_t *)c->map;
+
+  if (c->map_len < sizeof(trace_container_header_t) ||
+      memcmp(c->header->magic, TRACE_CONTAINER_MAGIC, 8) ||
+      c->header->version != TRACE_CONTAINER_VERSION || c->header->header_size > c->map_len) {
+    trace_container_detach(c);
+    return 0;
+  }
+
+  // stop quietly at a truncated or corrupt chunk (e.g., after a crash)
+  for (off = c->header->header_size; off + sizeof(*ch) <= c->map_len;
+       off += sizeof(*ch) + ch->len) {
+    ch = (trace_chunk_header_t *)(c->map + off);
+    if (ch->magic != TRACE_CHUNK_MAGIC || ch->len > c->map_len - off - sizeof(*ch) ||
+        ch->offset > UINT64_MAX - ch->len) {
+      break;
+    }
+    if (add_chunk(c, ch, off)) {
+      trace_container_detach(c);
+      return 0;
+    }
+    payload += ch->len;
+  }
+
+  // no trace can be longer than all of the chunks put together
+  for (i = 0; i < c->numthreads; i++) {
+    if (c->threads[i].len > payload) {
+      c->threads[i].len = payload;
+    }
+  }
+
+  return c;
+}
+
+void trace_container_detach(trace_container_t *c) {
+  uint64_t i;
+
+  for (i = 0; i < c->numthreads; i++) {
+    free(c->threads[i].chunks);
+  }
+  free(c->threads);
+  munmap(c->map, c->map_len);
+  close(c->fd);
+  free(c);
+}
+
+uint64_t trace_container_num_threads(trace_container_t *c) { return c->numthreads; }
+
+int trace_container_tid(trace_container_t *c, uint64_t i) {
+  return i < c->numthreads ? (int)c->threads[i].tid : -1;
+}
+
+// put a thread's trace together, later chunks overwriting earlier ones
+static uint8_t *assemble(trace_container_t *c, int tid, uint64_t *len) {
+  trace_container_thread_t *th = find_thread(c, tid);
+  trace_chunk_header_t *ch;
+  uint8_t *s;
+  uint64_t i;
+
+  if (!th || !th->len || !(s = calloc(th->len, 1))) {
+    return 0;
+  }
+
+  *len = 0;
+  for (i = 0; i < th->numchunks; i++) {
+    ch = (trace_chunk_header_t *)(c->map + th->chunks[i]);
+    if (ch->offset > th->len || ch->len > th->len - ch->offset) {
+      continue;  // beyond what the container can hold, so corrupt
+    }
+    memcpy(s + ch->offset, ch + 1, ch->len);
+    if (ch->offset + ch->len > *len) {
+      *len = ch->offset + ch->len;
+    }
+  }
+
+  if (!*len) {
+    free(s);
+    return 0;
+  }
+
+  return s;
+}
+
+static trace_t *attach_thread(trace_container_t *c, int tid, int lazy) {
+  trace_t *t;
+
+  t = malloc(sizeof(trace_t));
 
   if (!t) {
+    return t;
+  }
+
+  memset(t, 0, sizeof(*t));
+
+  if (!(t->stream = assemble(c, tid, &t->map_len))) {
+    free(t);
+    return 0;
+  }
+
+  t->map = t->stream;
+  t->fd = -1;
+
+  return parse(t, lazy);
+}
+
+trace_t *trace_container_attach_thread(trace_container_t *c, int tid) {
+  return attach_thread(c, tid, ATTACH_ALL);
+}
+
+trace_t *trace_container_attach_thread_blocks(trace_container_t *c, int tid) {
+  return attach_thread(c, tid, ATTACH_BLOCKS);
+}
+
+int trace_container_write_thread(trace_container_t *c, int tid, FILE *dest) {
+  uint64_t len;
+  uint8_t *s = assemble(c, tid, &len);
+  int rc;
+
+  if (!s) {
+    return -1;
+  }
+
+  rc = fwrite(s, 1, len, dest) == len ? 0 : -1;
+
+  free(s);
+
+  return rc;
+}
+
+int trace_container_map(char *file, int tid,
+    void (*filter)(int, individual_trace_record_t *, void *), void *state) {
+  trace_container_t *c = trace_container_attach(file);
+  uint64_t i, b, r;
+  int rc = 0;
+
+  if (!c) {
     return -1;
   }
 
-  for (i = 0; i < t->numrecs; i++) {
-    filter(&t->rec[i], state);
+  for (i = 0; !rc && i < c->numthreads; i++) {
+    trace_t *t;
+    if (tid && c->threads[i].tid != tid) {
+      continue;
+    }
+    if (!(t = trace_container_attach_thread_blocks(c, c->threads[i].tid))) {
+      rc = -1;
+      break;
+    }
+    for (b = 0; b < trace_num_blocks(t); b++) {
+      if (trace_load_block(t, b)) {
+        rc = -1;
+        break;
+      }
+      for (r = 0; r < t->numrecs; r++) {
+        filter(c->threads[i].tid, &t->rec[r], state);
+      }
+    }
+    trace_detach(t);
   }
 
-  trace_detach(t);
+  trace_container_detach(c);
+
+  return rc;
+}
+
+
+//
+// Time-ordered merging of traces
+//
+// Each input (a trace file, or a thread of a container) has a cursor
+// on its next record, and the cursors are kept in a heap ordered by
+// the time of that record on CLOCK_MONOTONIC, as given by the anchor
+// in the trace's header.   Only one block of a compressed trace, and
+// one record of an uncompressed one, is decoded at a time, so for trace
+// files, which stay mapped, memory does not grow with the length of the
+// traces.   A thread of a container, though, is assembled from its
+// chunks into memory of its own (assemble()) when it is added, so each
+// container thread is held in full for the whole merge.
+//
+
+#define NS_PER_SEC 1000000000ULL
+
+// traces that did not live to measure their cycle frequency borrow
+// one from another input, or failing that, assume this
+#define DEFAULT_CYCLE_FREQ NS_PER_SEC
+
+static void free_input(trace_merge_input_t *in) {
+  if (in) {
+    free(in->dict.entry);
+    if (in->trace) {
+      trace_detach(in->trace);
+    }
+    free(in);
+  }
+}
+
+static int add_input(trace_merge_t *m, trace_t *t) {
+  trace_merge_input_t *in;
+
+  if (!t) {
+    return -1;
+  }
+
+  // only version 2 headers anchor the records to a clock
+  if (!t->header || t->version < 2) {
+    trace_detach(t);
+    return -1;
+  }
+
+  if (m->num == m->size) {
+    uint64_t size = m->size ? m->size * 2 : 16;
+    trace_merge_input_t **n = realloc(m->inputs, size * sizeof(*n));
+    if (!n) {
+      trace_detach(t);
+      return -1;
+    }
+    m->inputs = n;
+    m->size = size;
+  }
+
+  if (!(in = malloc(sizeof(*in)))) {
+    trace_detach(t);
+    return -1;
+  }
+
+  memset(in, 0, sizeof(*in));
+  in->trace = t;
+  in->order = m->num;
+  in->pid = t->header->pid;
+  in->tid = t->header->tid;
+  in->start_ns = t->header->start_monotonic_ns;
+  in->freq = t->header->cycle_freq;
+  in->data = t->data;
+  in->end = t->data + t->data_len;
+  trace_codec_reset(&in->codec);
+
+  m->inputs[m->num++] = in;
+
+  return 0;
+}
+
+trace_merge_t *trace_merge_open(void) {
+  trace_merge_t *m = malloc(sizeof(trace_merge_t));
+
+  if (m) {
+    memset(m, 0, sizeof(*m));
+  }
+
+  return m;
+}
+
+int trace_merge_add_file(trace_merge_t *m, char *file) {
+  trace_container_t *c;
+  uint64_t i;
+  int rc = 0;
+
+  if (m->started) {
+    return -1;
+  }
+
+  if (!trace_is_container(file)) {
+    return add_input(m, attach(file, ATTACH_STREAM));
+  }
+
+  if (!(c = trace_container_attach(file))) {
+    return -1;
+  }
+
+  for (i = 0; !rc && i < c->numthreads; i++) {
+    rc = add_input(m, attach_thread(c, c->threads[i].tid, ATTACH_STREAM));
+  }
+
+  trace_container_detach(c);
+
+  return rc;
+}
+
+void trace_merge_close(trace_merge_t *m) {
+  uint64_t i;
+
+  for (i = 0; i < m->num; i++) {
+    free_input(m->inputs[i]);
+  }
+  free(m->inputs);
+  free(m->heap);
+  free(m);
+}
+
+// move the input's cursor to its next record, returning 1 if
+// there is one, 0 if the input is done, and -1 on error
+static int advance(trace_merge_input_t *in) {
+  trace_t *t = in->trace;
+
+  if (t->record_format == TRACE_RECORD_DELTA && !t->blocks) {
+    int n = trace_decode_record(&in->codec, &in->dict, in->data, in->end, &in->rec);
+    if (n <= 0) {
+      // a truncated record (e.g., after a crash) ends the input
+      return n;
+    }
+    in->data += n;
+  } else {
+    while (in->next >= t->numrecs) {
+      if (!t->blocks || in->block >= t->numblocks) {
+        return 0;
+      }
+      if (trace_load_block(t, in->block++)) {
+        return -1;
+      }
+      in->next = 0;
+    }
+    in->rec = t->rec[in->next++];
+  }
+
+  // integer math, so that times are exact at any scale
+  in->time_ns = in->start_ns + (unsigned __int128)in->rec.time * NS_PER_SEC / in->freq;
+
+  return 1;
+}
+
+static inline int earlier(trace_merge_input_t *a, trace_merge_input_t *b) {
+  return a->time_ns < b->time_ns || (a->time_ns == b->time_ns && a->order < b->order);
+}
+
+static void sift_down(trace_merge_t *m, uint64_t i) {
+  for (;;) {
+    uint64_t l = 2 * i + 1, r = l + 1, min = i;
+    trace_merge_input_t *tmp;
+    if (l < m->heap_len && earlier(m->heap[l], m->heap[min])) {
+      min = l;
+    }
+    if (r < m->heap_len && earlier(m->heap[r], m->heap[min])) {
+      min = r;
+    }
+    if (min == i) {
+      return;
+    }
+    tmp = m->heap[i];
+    m->heap[i] = m->heap[min];
+    m->heap[min] = tmp;
+    i = min;
+  }
+}
+
+// position every input on its first record, and heapify
+static int start(trace_merge_t *m) {
+  uint64_t freq = 0;
+  uint64_t i;
+
+  for (i = 0; i < m->num && !freq; i++) {
+    freq = m->inputs[i]->freq;
+  }
+  if (!freq) {
+    freq = DEFAULT_CYCLE_FREQ;
+  }
+
+  if (m->num && !(m->heap = malloc(m->num * sizeof(*m->heap)))) {
+    return -1;
+  }
+
+  for (i = 0; i < m->num; i++) {
+    trace_merge_input_t *in = m->inputs[i];
+    int rc;
+    if (!in->freq) {
+      in->freq = freq;
+    }
+    if ((rc = advance(in)) < 0) {
+      return -1;
+    }
+    if (rc) {
+      m->heap[m->heap_len++] = in;
+    }
+  }
+
+  for (i = m->heap_len / 2; i-- > 0;) {
+    sift_down(m, i);
+  }
+
+  m->started = 1;
 
   return 0;
 }
 
+int trace_merge_next(trace_merge_t *m, trace_merge_record_t *r) {
+  trace_merge_input_t *in;
+  int rc;
+
+  if (!m->started && start(m)) {
+    return -1;
+  }
+
+  // the previous record's input moves on only now, so that the
+  // record handed out last time stays valid until this call
+  if (m->current) {
+    in = m->current;
+    m->current = 0;
+    if ((rc = advance(in)) < 0) {
+      return -1;
+    }
+    if (rc) {
+      sift_down(m, 0);
+    } else {
+      m->heap[0] = m->heap[--m->heap_len];
+      sift_down(m, 0);
+    }
+  }
+
+  if (!m->heap_len) {
+    return 0;
+  }
+
+  in = m->current = m->heap[0];
+
+  r->pid = in->pid;
+  r->tid = in->tid;
+  r->time_ns = in->time_ns;
+  r->rec = &in->rec;
+
+  return 1;
+}
+
+int trace_merge_map(char **files, int n, void (*filter)(trace_merge_record_t *, void *),
+    void *state) {
+  trace_merge_t *m = trace_merge_open();
+  trace_merge_record_t r;
+  int rc = 0;
+  int i;
+
+  if (!m) {
+    return -1;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (trace_merge_add_file(m, files[i])) {
+      trace_merge_close(m);
+      return -1;
+    }
+  }
+
+  while ((rc = trace_merge_next(m, &r)) > 0) {
+    filter(&r, state);
+  }
+
+  trace_merge_close(m);
+
+  return rc;
+}
+
 
 static inline void print(individual_trace_record_t *r, FILE *out) {
   char *op;
@@ -123,9 +931,12 @@ static inline void print(individual_trace_record_t *r, FILE *out) {
     case 8:
       op = "FPE_FLTSUB";
       break;
-    case -1:
+    case TRACE_CODE_ABORT:
       op = "***ABORT!!";
       break;
+    case TRACE_CODE_GOVERN:
+      op = "***GOVERN";
+      break;
     default:
       op = "***UNKNOWN";
       break;
@@ -142,21 +953,124 @@ static inline void print(individual_trace_record_t *r, FILE *out) {
 }
 
 
-int trace_print(char *file, FILE *dest, int (*select)(individual_trace_record_t *)) {
-  uint64_t i;
-  trace_t *t = trace_attach(file);
+int trace_print_header(trace_t *t, FILE *out) {
+  trace_file_header_t *h = t->header;
+  static const char *arch[] = {"unknown", "x64", "arm64", "riscv64"};
 
-  if (!t) {
-    return -1;
+  if (!h) {
+    fprintf(out, "version\t0 (no header)\n");
+    fprintf(out, "records\t%lu\n", t->numrecs);
+    return 0;
   }
 
-  for (i = 0; i < t->numrecs; i++) {
-    if (!select || select(&t->rec[i])) {
-      print(&t->rec[i], dest);
+  fprintf(out, "version\t%u\n", h->version);
+  fprintf(out, "format\t%s\n", t->record_format == TRACE_RECORD_DELTA ? "delta" : "fixed");
+  fprintf(out, "records\t%lu%s\n", t->numrecs,
+      h->version == 1 || (h->flags & TRACE_FILE_COUNTED) ? "" : " (uncounted)");
+  if (h->version >= 2) {
+    fprintf(out, "arch\t%s\n", h->arch <= TRACE_ARCH_RISCV64 ? arch[h->arch] : "unknown");
+    fprintf(out, "pid\t%u\n", h->pid);
+    fprintf(out, "tid\t%u\n", h->tid);
+    fprintf(out, "cycle_freq\t%lu\n", h->cycle_freq);
+    fprintf(out, "start_cycles\t%lu\n", h->start_cycles);
+    fprintf(out, "start_realtime_ns\t%lu\n", h->start_realtime_ns);
+    fprintf(out, "start_monotonic_ns\t%lu\n", h->start_monotonic_ns);
+    fprintf(out, "except_mask\t%08x\n", h->except_mask);
+    fprintf(out, "round_config\t%08x%s\n", h->round_config,
+        h->flags & TRACE_FILE_FORCED_ROUND ? " (forced)" : "");
+    if (h->flags & TRACE_FILE_BLOCKS) {
+      fprintf(out, "blocks\t%lu%s\n", t->numblocks,
+          t->blocks == t->scanned_blocks ? " (no index)" : "");
+    }
+    if (h->site_throttle) {
+      fprintf(out, "site_throttle\t%u\n", h->site_throttle);
+    }
+    if (h->overhead_budget) {
+      fprintf(out, "overhead_budget\t%u ppm\n", h->overhead_budget);
+    }
+    if (h->header_size >= TRACE_FILE_HEADER_SAMPLED_SIZE) {
+      static const char *name[TRACE_SAMPLE_CLASSES] = {
+          "inv", "den", "div", "over", "under", "prec", "other", "unknown"};
+      int i;
+      for (i = 0; i < TRACE_SAMPLE_CLASSES; i++) {
+        if (h->sample_period[i] != 1 || h->sample_seen[i]) {
+          fprintf(out, "sample_%s\tperiod %u seen %lu recorded %lu\n", name[i],
+              h->sample_period[i], h->sample_seen[i], h->sample_recorded[i]);
+        }
+      }
     }
   }
 
-  trace_detach(t);
+  return 0;
+}
+
+
+int trace_container_print_header(trace_container_t *c, FILE *out) {
+  trace_container_header_t *h = c->header;
+  static const char *arch[] = {"unknown", "x64", "arm64", "riscv64"};
+  uint64_t i;
+
+  fprintf(out, "container\t%u\n", h->version);
+  fprintf(out, "arch\t%s\n", h->arch <= TRACE_ARCH_RISCV64 ? arch[h->arch] : "unknown");
+  fprintf(out, "pid\t%u\n", h->pid);
+  fprintf(out, "start_realtime_ns\t%lu\n", h->start_realtime_ns);
+  fprintf(out, "threads\t%lu\n", c->numthreads);
+  for (i = 0; i < c->numthreads; i++) {
+    fprintf(out, "thread\t%u\t%lu bytes in %lu chunks\n", c->threads[i].tid, c->threads[i].len,
+        c->threads[i].numchunks);
+  }
 
   return 0;
 }
+
+
+struct print_state {
+  FILE *dest;
+  int (*select)(individual_trace_record_t *);
+};
+
+static void print_filter(individual_trace_record_t *r, void *state) {
+  struct print_state *p = state;
+
+  if (!p->select || p->select(r)) {
+    print(r, p->dest);
+  }
+}
+
+int trace_print_range(char *file, uint64_t start, uint64_t end, FILE *dest,
+    int (*select)(individual_trace_record_t *)) {
+  struct print_state p = {dest, select};
+
+  return trace_map_range(file, start, end, print_filter, &p);
+}
+
+static void print_container_filter(int tid, individual_trace_record_t *r, void *state) {
+  print_filter(r, state);
+}
+
+int trace_print_container(char *file, int tid, FILE *dest,
+    int (*select)(individual_trace_record_t *)) {
+  struct print_state p = {dest, select};
+
+  return trace_container_map(file, tid, print_container_filter, &p);
+}
+
+static void print_merge_filter(trace_merge_record_t *r, void *state) {
+  struct print_state *p = state;
+
+  if (!p->select || p->select(r->rec)) {
+    fprintf(p->dest, "%u\t%u\t%lu\t", r->pid, r->tid, r->time_ns);
+    print(r->rec, p->dest);
+  }
+}
+
+int trace_print_merged(char **files, int n, FILE *dest,
+    int (*select)(individual_trace_record_t *)) {
+  struct print_state p = {dest, select};
+
+  return trace_merge_map(files, n, print_merge_filter, &p);
+}
+
+int trace_print(char *file, FILE *dest, int (*select)(individual_trace_record_t *)) {
+  return trace_print_range(file, 0, (uint64_t)-1, dest, select);
+}
@@ -187,6 +187,20 @@ int arch_have_special_fp_csr_exception(int which) {
   return 0;
 }
 
+int arch_have_special_fp_csr_exception_in_context(const ucontext_t *uc, int which) {
+  // RISC-V does not have denorm...
+  return 0;
+}
+
+static uint32_t *get_fpcsr_ptr(ucontext_t *uc);
+
+// the fflags are laid out as the fenv values
+int arch_get_fp_exceptions_in_context(const ucontext_t *uc) {
+  const uint32_t *fpcsr = get_fpcsr_ptr((ucontext_t *)uc);
+
+  return fpcsr ? *fpcsr & FLAG_MASK & FE_ALL_EXCEPT : 0;
+}
+
 // Linux's GP state is basically just the PC (masqurading as x0)
 // and the GPRs (x1..x31), with special callouts for
 // REG_PC 0, REG_RA 1, REG_SP 2, REG_TP 4, REG_S0 8, REG_S1 9
@@ -347,7 +361,7 @@ static inline uint64_t insn_len(uintptr_t pc) {
   return (inst & 3) ? 4 : 2;
 }
 
-void arch_set_trap_mode(ucontext_t *uc, uint64_t *state) {
+int arch_set_trap_mode(ucontext_t *uc, uint64_t *state) {
   DEBUG("%s (0x%016lx): mcontext PC: 0x%016lx\n", __func__, (uintptr_t)arch_set_trap_mode,
       uc->uc_mcontext.__gregs[REG_PC]);
   // Figure out how long this instruction was so we can move our trap target on
@@ -357,6 +371,10 @@ void arch_set_trap_mode(ucontext_t *uc, uint64_t *state) {
   uint32_t *next_inst = (uint32_t *)(fp_pc + fp_inst_width);
 
   if (state) {
+    if (make_code_writeable(next_inst, 4)) {
+      ERROR("cannot insert breakpoint at %p\n", next_inst);
+      return -1;
+    }
     // it should be the case that were are in TRAP_MODE_OFF
     uint32_t orig_next_inst = *next_inst;
     ENCODE(state, orig_next_inst, TRAP_MODE_ON);
@@ -370,6 +388,7 @@ void arch_set_trap_mode(ucontext_t *uc, uint64_t *state) {
   } else {
     ERROR("no state on set trap - just ignoring\n");
   }
+  return 0;
 }
 
 void arch_reset_trap_mode(ucontext_t *uc, uint64_t *state) {
@@ -553,6 +572,9 @@ int arch_get_instr_bytes(const ucontext_t *uc, uint8_t *dest, int size) {
   }
 }
 
+// no emulation support, we always single step past the instruction
+int arch_emulate_instruction(ucontext_t *uc) { return -1; }
+
 // representation is as the FCSR from the architecture
 // with "our" extensions added to the front
 uint64_t arch_get_fp_csr(const ucontext_t *uc) {
@@ -764,66 +786,11 @@ uintptr_t handle_kbe(uintptr_t cause, uintptr_t epc, uintptr_t regs[32]) {
 }
 #endif
 
-/*
-  The following is done because single step mode is typically not available for
-  user programs, so, outside of a kernel module that enables it, we need to
-  use breakpoint instructions to clean up, and thus we need to be able
-  to write executable regions.
-
-  An alternative to this, which would work for post startup loads of code as well,
-  would be to handle SEGV and then edit regions
-
- */
-static int make_my_exec_regions_writeable() {
-  DEBUG("making executable regions of memory map writeable to allow breakpoint insertion...\n");
-  DEBUG("yes, this is as hideous as it sounds...\n");
-
-  FILE *f = fopen("/proc/self/maps", "r");
-
-  if (!f) {
-    ERROR("cannot open /proc/self/maps\n");
-    return -1;
-  }
-
-  char line_buf[256];
-
-  while (!feof(f)) {
-    off_t start, end;
-    char flags[5];  // "rwxp\0"
-    if (fgets(line_buf, 256, f) == 0) {
-      // DEBUG("cannot fetch line... (soft failure)\n");
-      break;
-    }
-    int count = sscanf(line_buf, "%lx-%lx %s\n", &start, &end, flags);
-    if (count == 3) {
-      if (flags[2] == 'x' && flags[0] == 'r' && flags[1] != 'w') {
-        DEBUG("mprotecting this region as rwx: %s", line_buf);
-        void *s = (void *)start;
-        off_t len = end - start;
-        int flags = PROT_READ | PROT_WRITE | PROT_EXEC;
-        //	DEBUG("mprotect(%p,0x%lx,0x%x)\n",s,len,flags);
-        if (mprotect(s, len, flags)) {
-          ERROR("failed to mptoect this region as rwx: %s", line_buf);
-          fclose(f);
-          return -1;
-        }
-      } else {
-        // DEBUG("ignoring this region: %s",line_buf);
-      }
-    } else {
-      DEBUG("unparseable region: %s\n", line_buf);
-    }
-  }
-  DEBUG("completed mprotects\n");
-  fclose(f);
-  return 0;
-}
-
 int arch_process_init(void) {
   DEBUG("riscv64 process init\n");
   // TODO: Actually figure out the FP extension in-use
   what_fp = HAVE_D_FP;
-  return make_my_exec_regions_writeable();
+  return 0;
 }
 
 void arch_process_deinit(void) { DEBUG("riscv64 process deinit\n"); }
@@ -834,3 +801,30 @@ int arch_thread_init(ucontext_t *uc) {
 }
 
 void arch_thread_deinit(void) { DEBUG("riscv64 thread deinit\n"); }
+
+// no breakpoint has been inserted yet, so there is nothing to rewrite
+int arch_thread_init_direct(const fpspy_round_config_t *round_config, uint64_t *state) {
+  uint32_t fcsr;
+
+  if (arch_thread_init(0)) {
+    return -1;
+  }
+
+  fcsr = riscv_get_fcsr();
+  fcsr &= ~FLAG_MASK;
+  if (round_config) {
+    fcsr &= ~FCSR_ROUND_MASK;
+    fcsr |= *round_config;
+  }
+  riscv_set_fcsr(fcsr);
+
+  riscv_set_fflags_mask(riscv_get_fflags_mask() | ENABLE_MASK);
+
+  if (state) {
+    ENCODE(state, 0, TRAP_MODE_OFF);
+  }
+
+  DEBUG("riscv64 thread directly initialized (fcsr=0x%08x)\n", fcsr);
+
+  return 0;
+}
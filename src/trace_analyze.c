@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "libtrace.h"
+
+/*
+
+  Part of FPSpy
+
+  Copyright (c) 2018 Peter A. Dinda - see LICENSE
+
+  Native version of analyze_individual.pl, producing the same report.
+  The records are split among worker threads, each of which counts
+  them in hash tables of its own, and the tables are merged at the
+  end.   A compressed trace is split by blocks, so the decoding is
+  also done in parallel, while any other trace is decoded (if needed)
+  when attached, and then split by ranges of records.
+
+*/
+
+
+//
+// Histograms (open addressing hash tables of counts)
+//
+
+#define KEY_SIZE 16
+
+typedef struct bucket {
+  uint8_t key[KEY_SIZE];
+  uint64_t count;  // 0 => empty
+} bucket_t;
+
+typedef struct histogram {
+  uint64_t size;  // power of 2
+  uint64_t used;
+  bucket_t *bucket;
+} histogram_t;
+
+static int init_histogram(histogram_t *h) {
+  h->size = 1024;
+  h->used = 0;
+  h->bucket = calloc(h->size, sizeof(bucket_t));
+  return h->bucket ? 0 : -1;
+}
+
+static void deinit_histogram(histogram_t *h) { free(h->bucket); }
+
+static inline uint64_t hash(const uint8_t *key) {
+  uint64_t a, b;
+
+  memcpy(&a, key, 8);
+  memcpy(&b, key + 8, 8);
+
+  a ^= b * 0x9e3779b97f4a7c15ULL;
+  a ^= a >> 33;
+  a *= 0xff51afd7ed558ccdULL;
+  a ^= a >> 33;
+
+  return a;
+}
+
+static int add(histogram_t *h, const uint8_t *key, uint64_t count);
+
+static int grow(histogram_t *h) {
+  histogram_t n;
+  uint64_t i;
+
+  n.size = h->size * 2;
+  n.used = 0;
+  if (!(n.bucket = calloc(n.size, sizeof(bucket_t)))) {
+    return -1;
+  }
+
+  for (i = 0; i < h->size; i++) {
+    if (h->bucket[i].count) {
+      add(&n, h->bucket[i].key, h->bucket[i].count);
+    }
+  }
+
+  free(h->bucket);
+  *h = n;
+
+  return 0;
+}
+
+static int add(histogram_t *h, const uint8_t *key, uint64_t count) {
+  uint64_t i;
+
+  if ((h->used + 1) * 4 > h->size * 3 && grow(h)) {
+    return -1;
+  }
+
+  for (i = hash(key) & (h->size - 1);; i = (i + 1) & (h->size - 1)) {
+    if (!h->bucket[i].count) {
+      memcpy(h->bucket[i].key, key, KEY_SIZE);
+      h->bucket[i].count = count;
+      h->used++;
+      return 0;
+    }
+    if (!memcmp(h->bucket[i].key, key, KEY_SIZE)) {
+      h->bucket[i].count += count;
+      return 0;
+    }
+  }
+}
+
+static int merge(histogram_t *dest, histogram_t *src) {
+  uint64_t i;
+
+  for (i = 0; i < src->size; i++) {
+    if (src->bucket[i].count && add(dest, src->bucket[i].key, src->bucket[i].count)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+//
+// Counting
+//
+
+#define BY_TYPE  0
+#define BY_CSR   1
+#define BY_RIP   2
+#define BY_INSTR 3
+#define BY_COUNT 4
+
+typedef struct worker {
+  pthread_t thread;
+  trace_t *trace;  // this worker's own, if the trace is in blocks
+  uint64_t first;  // otherwise, the range of records to count
+  uint64_t last;
+  uint64_t n;
+  histogram_t hist[BY_COUNT];
+  int rc;
+} worker_t;
+
+static char *file;
+static trace_t *whole;         // the trace, if not in blocks
+static uint64_t next_block;    // the next block to claim, if in blocks
+static int denorm_in_csr;      // the csr notes a denormal operand (x64)
+
+static inline int count(worker_t *w, individual_trace_record_t *r) {
+  uint8_t key[KEY_SIZE];
+  int rc = 0;
+
+  // the type is the code, with the denormal distinction that the
+  // csr captures, but only for real events
+  memset(key, 0, sizeof(key));
+  memcpy(key, &r->code, sizeof(r->code));
+  key[4] = denorm_in_csr && r->code != TRACE_CODE_ABORT && r->code != TRACE_CODE_GOVERN &&
+           (r->mxcsr & 0x2);
+  rc |= add(&w->hist[BY_TYPE], key, 1);
+
+  memset(key, 0, sizeof(key));
+  memcpy(key, &r->mxcsr, sizeof(r->mxcsr));
+  rc |= add(&w->hist[BY_CSR], key, 1);
+
+  memset(key, 0, sizeof(key));
+  memcpy(key, &r->rip, sizeof(r->rip));
+  rc |= add(&w->hist[BY_RIP], key, 1);
+
+  memset(key, 0, sizeof(key));
+  memcpy(key, r->instruction, MAX_INSTR_SIZE);
+  rc |= add(&w->hist[BY_INSTR], key, 1);
+
+  w->n++;
+
+  return rc;
+}
+
+static void *work(void *arg) {
+  worker_t *w = arg;
+  uint64_t b, i;
+
+  if (!w->trace) {
+    for (i = w->first; i < w->last; i++) {
+      if (count(w, &whole->rec[i])) {
+        w->rc = -1;
+        return 0;
+      }
+    }
+    return 0;
+  }
+
+  while ((b = __atomic_fetch_add(&next_block, 1, __ATOMIC_RELAXED)) < trace_num_blocks(w->trace)) {
+    if (trace_load_block(w->trace, b)) {
+      fprintf(stderr, "Failed to decode block %lu of %s\n", b, file);
+      w->rc = -1;
+      return 0;
+    }
+    for (i = 0; i < w->trace->numrecs; i++) {
+      if (count(w, &w->trace->rec[i])) {
+        w->rc = -1;
+        return 0;
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+//
+// Reporting
+//
+
+static const char *type_name(int code) {
+  switch (code) {
+    case 1:
+      return "FPE_INTDIV";
+    case 2:
+      return "FPE_INTOVF";
+    case 3:
+      return "FPE_FLTDIV";
+    case 4:
+      return "FPE_FLTOVF";
+    case 5:
+      return "FPE_FLTUND";
+    case 6:
+      return "FPE_FLTRES";
+    case 7:
+      return "FPE_FLTINV";
+    case 8:
+      return "FPE_FLTSUB";
+    case TRACE_CODE_ABORT:
+      return "***ABORT!!";
+    case TRACE_CODE_GOVERN:
+      return "***GOVERN";
+    default:
+      return "UNDEF";
+  }
+}
+
+static void format_key(int which, const uint8_t *key, char *buf) {
+  uint64_t rip;
+  int code, csr, i;
+
+  switch (which) {
+    case BY_TYPE:
+      memcpy(&code, key, sizeof(code));
+      sprintf(buf, "%s%s", type_name(code), key[4] ? "-FPE_DENORM" : "");
+      break;
+    case BY_CSR:
+      memcpy(&csr, key, sizeof(csr));
+      sprintf(buf, "%08x", csr);
+      break;
+    case BY_RIP:
+      memcpy(&rip, key, sizeof(rip));
+      sprintf(buf, "%016lx", rip);
+      break;
+    case BY_INSTR:
+      for (i = 0; i < MAX_INSTR_SIZE; i++) {
+        sprintf(buf + 2 * i, "%02x", key[i]);
+      }
+      break;
+  }
+}
+
+typedef struct entry {
+  uint64_t count;
+  char name[2 * KEY_SIZE + 16];
+  char dis[256];
+} entry_t;
+
+// by count, most first, then by name
+static int compare(const void *a, const void *b) {
+  const entry_t *x = a, *y = b;
+
+  if (x->count != y->count) {
+    return x->count > y->count ? -1 : 1;
+  }
+
+  return strcmp(x->name, y->name);
+}
+
+// disassembles all the instructions in one batch, leaving the
+// instruction of each in its name
+static int disassemble(entry_t *e, uint64_t n) {
+  char tmp[] = "/tmp/trace_analyze.XXXXXX";
+  char cmd[64];
+  char line[256];
+  uint64_t i;
+  char *p;
+  FILE *f;
+  int fd;
+
+  if ((fd = mkstemp(tmp)) < 0 || !(f = fdopen(fd, "w"))) {
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmp);
+    }
+    return -1;
+  }
+
+  for (i = 0; i < n; i++) {
+    fprintf(f, "%s\n", e[i].name);
+  }
+  fclose(f);
+
+  snprintf(cmd, sizeof(cmd), "disassem_instr.pl < %s", tmp);
+
+  if (!(f = popen(cmd, "r"))) {
+    unlink(tmp);
+    return -1;
+  }
+
+  for (i = 0; i < n && fgets(line, sizeof(line), f); i++) {
+    line[strcspn(line, "\n")] = 0;
+    p = strrchr(line, '\t');
+    snprintf(e[i].dis, sizeof(e[i].dis), "%s", p ? p + 1 : line);
+  }
+
+  pclose(f);
+  unlink(tmp);
+
+  return 0;
+}
+
+static int report(int which, histogram_t *h, int dis) {
+  static const char *title[BY_COUNT] = {"TYPE", "MXCSR", "RIP", "Instruction"};
+  entry_t *e;
+  uint64_t i, n = 0;
+
+  if (!(e = calloc(h->used ? h->used : 1, sizeof(entry_t)))) {
+    return -1;
+  }
+
+  for (i = 0; i < h->size; i++) {
+    if (h->bucket[i].count) {
+      e[n].count = h->bucket[i].count;
+      format_key(which, h->bucket[i].key, e[n].name);
+      n++;
+    }
+  }
+
+  qsort(e, n, sizeof(entry_t), compare);
+
+  printf("\nBy %s\n", title[which]);
+
+  if (dis && disassemble(e, n)) {
+    fprintf(stderr, "Failed to disassemble\n");
+  }
+
+  for (i = 0; i < n; i++) {
+    if (dis) {
+      printf("\t%lu\t%s\t%s\n", e[i].count, e[i].name, e[i].dis);
+    } else {
+      printf("\t%lu\t%s\n", e[i].count, e[i].name);
+    }
+  }
+
+  free(e);
+
+  return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+  long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  worker_t *w;
+  trace_t *t;
+  uint64_t n = 0;
+  int dis, arch;
+  long i, j;
+  int rc = 0;
+
+  if (argc >= 3 && !strcmp(argv[1], "-j")) {
+    nworkers = atol(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+
+  if ((argc != 2 && argc != 3) || nworkers < 1) {
+    fprintf(stderr, "trace_analyze [-j threads] <individual trace file> [disassem]\n");
+    return -1;
+  }
+
+  file = argv[1];
+  dis = argc == 3;
+
+  if (trace_is_container(file)) {
+    fprintf(stderr, "%s is a container, extract a thread's trace with trace_print -x\n", file);
+    return -1;
+  }
+
+  if (!(t = trace_attach_blocks(file))) {
+    fprintf(stderr, "Failed to attach %s\n", file);
+    return -1;
+  }
+
+  // the architecture of the trace, or failing that, our own
+  arch = t->header && t->version >= 2 ? t->header->arch : 0;
+  if (!arch) {
+#if defined(x64)
+    arch = TRACE_ARCH_X64;
+#elif defined(arm64)
+    arch = TRACE_ARCH_ARM64;
+#elif defined(riscv64)
+    arch = TRACE_ARCH_RISCV64;
+#endif
+  }
+  denorm_in_csr = arch == TRACE_ARCH_X64;
+
+  if (!(w = calloc(nworkers, sizeof(worker_t)))) {
+    trace_detach(t);
+    return -1;
+  }
+
+  for (i = 0; i < nworkers; i++) {
+    for (j = 0; j < BY_COUNT; j++) {
+      if (init_histogram(&w[i].hist[j])) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+      }
+    }
+  }
+
+  if (t->blocks) {
+    // each worker decodes the blocks it claims, with a trace of its own
+    w[0].trace = t;
+    for (i = 1; i < nworkers; i++) {
+      if (!(w[i].trace = trace_attach_blocks(file))) {
+        fprintf(stderr, "Failed to attach %s\n", file);
+        return -1;
+      }
+    }
+  } else {
+    whole = t;
+    for (i = 0; i < nworkers; i++) {
+      w[i].first = t->numrecs * i / nworkers;
+      w[i].last = t->numrecs * (i + 1) / nworkers;
+    }
+  }
+
+  for (i = 1; i < nworkers; i++) {
+    if (pthread_create(&w[i].thread, 0, work, &w[i])) {
+      fprintf(stderr, "Failed to create worker\n");
+      return -1;
+    }
+  }
+
+  work(&w[0]);
+
+  for (i = 0; i < nworkers; i++) {
+    if (i) {
+      pthread_join(w[i].thread, 0);
+      for (j = 0; j < BY_COUNT; j++) {
+        if (merge(&w[0].hist[j], &w[i].hist[j])) {
+          fprintf(stderr, "Out of memory\n");
+          return -1;
+        }
+        deinit_histogram(&w[i].hist[j]);
+      }
+      if (w[i].trace) {
+        trace_detach(w[i].trace);
+      }
+    }
+    rc |= w[i].rc;
+    n += w[i].n;
+  }
+
+  if (rc) {
+    fprintf(stderr, "Failed to analyze %s\n", file);
+  } else {
+    printf("Saw %lu events:\n", n);
+    for (j = 0; j < BY_COUNT; j++) {
+      report(j, &w[0].hist[j], j == BY_INSTR && dis);
+    }
+  }
+
+  for (j = 0; j < BY_COUNT; j++) {
+    deinit_histogram(&w[0].hist[j]);
+  }
+  trace_detach(t);
+  free(w);
+
+  return rc;
+}
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "libtrace.h"
 
 /*
@@ -10,9 +12,96 @@
 */
 
 
+static int has_thread(trace_container_t *c, int tid) {
+  uint64_t i;
+
+  for (i = 0; i < trace_container_num_threads(c); i++) {
+    if (trace_container_tid(c, i) == tid) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int container(int argc, char *argv[]) {
+  trace_container_t *c;
+  int tid = 0;
+  int rc = 0;
+
+  if (argc == 4 && (!strcmp(argv[1], "-T") || !strcmp(argv[1], "-x"))) {
+    tid = atoi(argv[2]);
+  } else if (argc != 2 && !(argc == 3 && !strcmp(argv[1], "-h"))) {
+    fprintf(stderr, "trace_print [-h | -T tid | -x tid] <container file>\n");
+    return -1;
+  }
+
+  if (!(c = trace_container_attach(argv[argc - 1]))) {
+    fprintf(stderr, "Failed to attach %s\n", argv[argc - 1]);
+    return -1;
+  }
+
+  if (argc == 3) {
+    trace_container_print_header(c, stdout);
+  } else if (argc == 4 && !strcmp(argv[1], "-x")) {
+    rc = trace_container_write_thread(c, tid, stdout);
+  } else if (tid && !has_thread(c, tid)) {
+    fprintf(stderr, "No thread %d in %s\n", tid, argv[argc - 1]);
+    rc = -1;
+  } else {
+    rc = trace_print_container(argv[argc - 1], tid, stdout, 0);
+  }
+
+  trace_container_detach(c);
+
+  if (rc) {
+    fprintf(stderr, "Failed to print %s\n", argv[argc - 1]);
+  }
+
+  return rc;
+}
+
+
 int main(int argc, char *argv[]) {
+  if (argc >= 3 && !strcmp(argv[1], "-m")) {
+    if (trace_print_merged(&argv[2], argc - 2, stdout, 0)) {
+      fprintf(stderr, "Failed to merge traces\n");
+      return -1;
+    }
+    return 0;
+  }
+
+  if (argc >= 2 && trace_is_container(argv[argc - 1])) {
+    return container(argc, argv);
+  }
+
+  if (argc == 3 && !strcmp(argv[1], "-h")) {
+    trace_t *t = trace_attach(argv[2]);
+    if (!t) {
+      fprintf(stderr, "Failed to attach %s\n", argv[2]);
+      return -1;
+    }
+    trace_print_header(t, stdout);
+    trace_detach(t);
+    return 0;
+  }
+
+  if (argc == 4 && !strcmp(argv[1], "-t")) {
+    uint64_t start, end;
+    if (sscanf(argv[2], "%lu:%lu", &start, &end) != 2) {
+      fprintf(stderr, "time range must be start:end (cycles)\n");
+      return -1;
+    }
+    if (trace_print_range(argv[3], start, end, stdout, 0)) {
+      fprintf(stderr, "Failed to print %s\n", argv[3]);
+      return -1;
+    }
+    return 0;
+  }
+
   if (argc != 2) {
-    fprintf(stderr, "trace_print <individual trace file>\n");
+    fprintf(stderr, "trace_print [-h | -t start:end] <individual trace file>\n");
+    fprintf(stderr, "trace_print -m <individual trace or container file>...\n");
     return -1;
   }
 
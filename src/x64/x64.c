@@ -7,6 +7,7 @@
 #include <ucontext.h>
 #include <fenv.h>
 #include <string.h>
+#include <cpuid.h>
 
 #include "config.h"
 #include "fpspy.h"
@@ -102,6 +103,22 @@ int arch_have_special_fp_csr_exception(int which) {
   }
 }
 
+int arch_have_special_fp_csr_exception_in_context(const ucontext_t *uc, int which) {
+  if (which == FE_DENORM) {
+    return !!(uc->uc_mcontext.fpregs->mxcsr & 0x2);
+  } else {
+    return 0;
+  }
+}
+
+// the mxcsr flags are laid out as the fenv values, with
+// denorm (0x2) in the gap
+int arch_get_fp_exceptions_in_context(const ucontext_t *uc) {
+  uint32_t flags = uc->uc_mcontext.fpregs->mxcsr & MXCSR_FLAG_MASK;
+
+  return (flags & FE_ALL_EXCEPT) | (flags & 0x2 ? FE_DENORM : 0);
+}
+
 void arch_dump_gp_csr(const char *prefix, const ucontext_t *uc) {
   char buf[256];
 
@@ -171,12 +188,13 @@ void arch_dump_fp_csr(const char *pre, const ucontext_t *uc) {
 #define TRAP_MODE_ON   2
 
 // simply turn on trap mode
-void arch_set_trap_mode(ucontext_t *uc, uint64_t *state) {
+int arch_set_trap_mode(ucontext_t *uc, uint64_t *state) {
   // should be TRAP_MODE_OFF
   uc->uc_mcontext.gregs[REG_EFL] |= 0x100UL;
   if (state) {
     *state = TRAP_MODE_ON;
   }
+  return 0;
 }
 
 // simply turn off trap mode
@@ -287,8 +305,434 @@ int arch_get_instr_bytes(const ucontext_t *uc, uint8_t *dest, int size) {
 }
 
 
+#if CONFIG_INSTRUCTION_EMULATION
+
+//
+// Emulation of the common SSE/AVX arithmetic instructions
+//
+// We handle 0F 51 (sqrt), 58 (add), 59 (mul), 5C (sub), 5D (min),
+// 5E (div), and 5F (max) in their ps/pd/ss/sd forms, both legacy SSE
+// encoded (with optional REX) and VEX encoded (128 and 256 bit).
+// The instruction is decoded from the ucontext, its operands are
+// gathered from the ucontext, and then the same instruction is executed
+// here on those operands, with the app's rounding/DAZ/FTZ configuration
+// and all exceptions masked.   The result is then written back
+// into the ucontext.
+//
+// Anything else (other opcodes, segment/address size overrides,
+// AVX-512 state that a VEX write would need to zero, etc) is left
+// for the single step path.
+//
+
+// one ymm register's worth of data
+typedef union {
+  uint8_t b[32];
+  uint32_t d[8];
+  uint64_t q[4];
+} emu_reg_t;
+
+typedef void (*emu_func_t)(emu_reg_t *dst, const emu_reg_t *src);
+
+// legacy SSE: dst = dst op src, upper 128 bits untouched
+#define EMU_SSE(insn)                                                           \
+  static void emu_##insn(emu_reg_t *d, const emu_reg_t *s) {                    \
+    __asm__ __volatile__("movdqu (%0), %%xmm0\n\t"                              \
+                         "movdqu (%1), %%xmm1\n\t" #insn " %%xmm1, %%xmm0\n\t" \
+                         "movdqu %%xmm0, (%0)\n\t"                              \
+                         :                                                      \
+                         : "r"(d), "r"(s)                                       \
+                         : "xmm0", "xmm1", "memory");                           \
+  }
+
+// 256 bit AVX: dst = dst op src
+#define EMU_AVX(insn)                                                                     \
+  static void emu_v##insn##_256(emu_reg_t *d, const emu_reg_t *s) {                       \
+    __asm__ __volatile__("vmovdqu (%0), %%ymm0\n\t"                                       \
+                         "vmovdqu (%1), %%ymm1\n\t"                                       \
+                         "v" #insn " %%ymm1, %%ymm0, %%ymm0\n\t"                          \
+                         "vmovdqu %%ymm0, (%0)\n\t"                                       \
+                         "vzeroupper\n\t"                                                 \
+                         :                                                                \
+                         : "r"(d), "r"(s)                                                 \
+                         : "xmm0", "xmm1", "memory");                                     \
+  }
+
+// 256 bit AVX unary: dst = op src
+#define EMU_AVX_UNARY(insn)                                                               \
+  static void emu_v##insn##_256(emu_reg_t *d, const emu_reg_t *s) {                       \
+    __asm__ __volatile__("vmovdqu (%1), %%ymm1\n\t"                                       \
+                         "v" #insn " %%ymm1, %%ymm0\n\t"                                  \
+                         "vmovdqu %%ymm0, (%0)\n\t"                                       \
+                         "vzeroupper\n\t"                                                 \
+                         :                                                                \
+                         : "r"(d), "r"(s)                                                 \
+                         : "xmm0", "xmm1", "memory");                                     \
+  }
+
+#define EMU_OP(op) \
+  EMU_SSE(op##ps)  \
+  EMU_SSE(op##pd)  \
+  EMU_SSE(op##ss)  \
+  EMU_SSE(op##sd)  \
+  EMU_AVX(op##ps)  \
+  EMU_AVX(op##pd)
+
+EMU_SSE(sqrtps)
+EMU_SSE(sqrtpd)
+EMU_SSE(sqrtss)
+EMU_SSE(sqrtsd)
+EMU_AVX_UNARY(sqrtps)
+EMU_AVX_UNARY(sqrtpd)
+EMU_OP(add)
+EMU_OP(mul)
+EMU_OP(sub)
+EMU_OP(min)
+EMU_OP(div)
+EMU_OP(max)
+
+// operand types, indexed by the (mandatory) prefix
+#define EMU_PS 0  // none
+#define EMU_PD 1  // 66
+#define EMU_SS 2  // F3
+#define EMU_SD 3  // F2
+
+#define EMU_ROW(op) {emu_##op##ps, emu_##op##pd, emu_##op##ss, emu_##op##sd}
+
+static const emu_func_t emu_128[7][4] = {
+    EMU_ROW(sqrt), EMU_ROW(add), EMU_ROW(mul), EMU_ROW(sub), EMU_ROW(min), EMU_ROW(div), EMU_ROW(max)};
+
+static const emu_func_t emu_256[7][2] = {{emu_vsqrtps_256, emu_vsqrtpd_256},
+    {emu_vaddps_256, emu_vaddpd_256}, {emu_vmulps_256, emu_vmulpd_256},
+    {emu_vsubps_256, emu_vsubpd_256}, {emu_vminps_256, emu_vminpd_256},
+    {emu_vdivps_256, emu_vdivpd_256}, {emu_vmaxps_256, emu_vmaxpd_256}};
+
+static int emu_op_index(uint8_t op) {
+  switch (op) {
+    case 0x51:
+      return 0;
+    case 0x58:
+      return 1;
+    case 0x59:
+      return 2;
+    case 0x5c:
+      return 3;
+    case 0x5d:
+      return 4;
+    case 0x5e:
+      return 5;
+    case 0x5f:
+      return 6;
+    default:
+      return -1;
+  }
+}
+
+// map from ModRM/SIB register numbers to gregs
+static const int emu_gpr[16] = {REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI,
+    REG_RDI, REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15};
+
+// The XSAVE area follows the 512 byte FXSAVE image in the signal frame.
+// The kernel marks its presence in the software reserved bytes of the
+// FXSAVE image.  We need it for the upper halves of the ymm registers
+#define XSAVE_SW_OFFSET    464
+#define XSAVE_HDR_OFFSET   512
+#define XSAVE_YMM_OFFSET   576
+#define XSTATE_MAGIC1      0x46505853U
+#define XFEATURE_YMM       0x4UL
+#define XFEATURE_ZMM_HI256 0x40UL
+
+typedef struct {
+  uint32_t magic1;
+  uint32_t extended_size;
+  uint64_t xfeatures;
+  uint32_t xstate_size;
+  uint32_t padding[7];
+} __attribute__((packed)) xsave_sw_bytes_t;
+
+// offset of the upper halves of zmm0..15 in the XSAVE area, if the
+// machine has AVX-512 (from CPUID at process init), zero otherwise
+static uint32_t xsave_zmm_hi256_offset = 0;
+
+static void emu_init(void) {
+  uint32_t eax, ebx, ecx, edx;
+
+  if (__get_cpuid_max(0, 0) >= 0xd) {
+    __cpuid_count(0xd, 0, eax, ebx, ecx, edx);
+    if (eax & XFEATURE_ZMM_HI256) {
+      __cpuid_count(0xd, 6, eax, ebx, ecx, edx);
+      xsave_zmm_hi256_offset = ebx;
+    }
+  }
+  DEBUG("emulation initialized (zmm_hi256 xsave offset %u)\n", xsave_zmm_hi256_offset);
+}
+
+// returns the xstate_bv field of the XSAVE header, and
+// the array of ymm upper halves, or NULL if we do not have them
+static uint8_t *emu_ymm_upper(const ucontext_t *uc, uint64_t **xstate_bv) {
+  uint8_t *fp = (uint8_t *)uc->uc_mcontext.fpregs;
+  xsave_sw_bytes_t *sw = (xsave_sw_bytes_t *)(fp + XSAVE_SW_OFFSET);
+
+  if (sw->magic1 != XSTATE_MAGIC1 || !(sw->xfeatures & XFEATURE_YMM) ||
+      sw->xstate_size < XSAVE_YMM_OFFSET + 16 * 16) {
+    return 0;
+  }
+  *xstate_bv = (uint64_t *)(fp + XSAVE_HDR_OFFSET);
+  return fp + XSAVE_YMM_OFFSET;
+}
+
+typedef struct {
+  int op;      // index into emu tables
+  int type;    // EMU_PS, ...
+  int vex;     // VEX encoded?
+  int l256;    // VEX.L
+  int reg;     // destination
+  int vvvv;    // VEX first source
+  int rm_reg;  // source is a register?
+  int rm;      // source register
+  uint64_t addr;  // source address if not
+  int len;     // instruction length
+} emu_insn_t;
+
+static int emu_decode(const ucontext_t *uc, emu_insn_t *in) {
+  const uint8_t *start = (const uint8_t *)uc->uc_mcontext.gregs[REG_RIP];
+  const uint8_t *p = start;
+  int opsize = 0, rep = 0, rex = 0;
+  int mod, rm;
+
+  memset(in, 0, sizeof(*in));
+
+  // legacy prefixes
+  while (p - start < 15) {
+    switch (*p) {
+      case 0x66:
+        opsize = 1;
+        break;
+      case 0xf2:
+        rep = EMU_SD;
+        break;
+      case 0xf3:
+        rep = EMU_SS;
+        break;
+      case 0x26:
+      case 0x2e:
+      case 0x36:
+      case 0x3e:
+        // null segment overrides in 64 bit mode
+        break;
+      default:
+        goto prefixes_done;
+    }
+    p++;
+  }
+prefixes_done:
+
+  if (*p == 0xc5 || *p == 0xc4) {
+    // VEX cannot be combined with the legacy SIMD prefixes
+    if (opsize || rep) {
+      return -1;
+    }
+    in->vex = 1;
+    if (*p == 0xc5) {
+      rex = (p[1] & 0x80) ? 0 : 0x4;  // R
+      in->vvvv = (~p[1] >> 3) & 0xf;
+      in->l256 = (p[1] >> 2) & 0x1;
+      in->type = p[1] & 0x3;
+      p += 2;
+    } else {
+      if ((p[1] & 0x1f) != 1) {  // only the 0F map
+        return -1;
+      }
+      rex = (~p[1] >> 5) & 0x7;  // R X B
+      in->vvvv = (~p[2] >> 3) & 0xf;
+      in->l256 = (p[2] >> 2) & 0x1;
+      in->type = p[2] & 0x3;
+      p += 3;
+    }
+    // VEX.pp is 0=none, 1=66, 2=F3, 3=F2, matching our types
+  } else {
+    if ((*p & 0xf0) == 0x40) {
+      rex = *p & 0xf;
+      p++;
+    }
+    if (*p != 0x0f) {
+      return -1;
+    }
+    p++;
+    in->type = rep ? rep : opsize ? EMU_PD : EMU_PS;
+  }
+
+  if ((in->op = emu_op_index(*p)) < 0) {
+    return -1;
+  }
+  p++;
+
+  if (in->l256 && in->type >= EMU_SS) {
+    return -1;
+  }
+
+  mod = *p >> 6;
+  in->reg = ((*p >> 3) & 0x7) | ((rex & 0x4) << 1);
+  rm = *p & 0x7;
+  p++;
+
+  if (mod == 3) {
+    in->rm_reg = 1;
+    in->rm = rm | ((rex & 0x1) << 3);
+  } else {
+    uint64_t addr = 0;
+    int32_t disp = 0;
+    int riprel = 0;
+
+    if (rm == 4) {
+      int scale = *p >> 6;
+      int index = ((*p >> 3) & 0x7) | ((rex & 0x2) << 2);
+      int base = *p & 0x7;
+      p++;
+      if (index != 4) {
+        addr += (uint64_t)uc->uc_mcontext.gregs[emu_gpr[index]] << scale;
+      }
+      if (base == 5 && mod == 0) {
+        memcpy(&disp, p, 4);
+        p += 4;
+      } else {
+        addr += uc->uc_mcontext.gregs[emu_gpr[base | ((rex & 0x1) << 3)]];
+      }
+    } else if (rm == 5 && mod == 0) {
+      memcpy(&disp, p, 4);
+      p += 4;
+      riprel = 1;
+    } else {
+      addr += uc->uc_mcontext.gregs[emu_gpr[rm | ((rex & 0x1) << 3)]];
+    }
+
+    if (mod == 1) {
+      disp = (int8_t)*p;
+      p++;
+    } else if (mod == 2) {
+      memcpy(&disp, p, 4);
+      p += 4;
+    }
+
+    // none of our instructions have immediates, so the next
+    // instruction starts here, which is what rip-relative needs
+    if (riprel) {
+      addr = (uint64_t)p;
+    }
+    in->addr = addr + (int64_t)disp;
+  }
+
+  in->len = p - start;
+
+  return in->len > 15 ? -1 : 0;
+}
+
+int arch_emulate_instruction(ucontext_t *uc) {
+  emu_insn_t in;
+  emu_reg_t dst, src;
+  uint8_t *ymm_hi;
+  uint8_t *zmm_hi = 0;
+  uint64_t *xstate_bv = 0;
+  int width;
+  uint32_t old_mxcsr;
+
+  if (emu_decode(uc, &in)) {
+    return -1;
+  }
+
+  ymm_hi = emu_ymm_upper(uc, &xstate_bv);
+
+  if (in.vex) {
+    // VEX writes zero the destination above the operation width,
+    // including the upper zmm bits if AVX-512 state is live
+    if (!ymm_hi) {
+      return -1;
+    }
+    if (*xstate_bv & XFEATURE_ZMM_HI256) {
+      xsave_sw_bytes_t *sw =
+          (xsave_sw_bytes_t *)((uint8_t *)uc->uc_mcontext.fpregs + XSAVE_SW_OFFSET);
+      if (!xsave_zmm_hi256_offset || !(sw->xfeatures & XFEATURE_ZMM_HI256) ||
+          sw->xstate_size < xsave_zmm_hi256_offset + 16 * 32) {
+        return -1;
+      }
+      zmm_hi = (uint8_t *)uc->uc_mcontext.fpregs + xsave_zmm_hi256_offset;
+    }
+  }
+
+  width = in.type == EMU_SS ? 4 : in.type == EMU_SD ? 8 : in.l256 ? 32 : 16;
+
+  memset(&dst, 0, sizeof(dst));
+  memset(&src, 0, sizeof(src));
+
+#define GET_XMM(r, n) memcpy((r).b, &uc->uc_mcontext.fpregs->_xmm[(n)], 16)
+#define GET_YMM_HI(r, n)                                      \
+  if (*xstate_bv & XFEATURE_YMM) {                           \
+    memcpy((r).b + 16, ymm_hi + (n) * 16, 16);               \
+  }
+
+  // first source / destination
+  if (in.vex) {
+    GET_XMM(dst, in.vvvv);
+    if (in.l256) {
+      GET_YMM_HI(dst, in.vvvv);
+    }
+  } else {
+    GET_XMM(dst, in.reg);
+  }
+
+  // second source
+  if (in.rm_reg) {
+    GET_XMM(src, in.rm);
+    if (in.l256) {
+      GET_YMM_HI(src, in.rm);
+    }
+  } else {
+    memcpy(src.b, (const void *)in.addr, width);
+  }
+
+  // execute with the app's rounding, DAZ, and FTZ, but everything masked
+  old_mxcsr = get_mxcsr();
+  set_mxcsr((uc->uc_mcontext.fpregs->mxcsr | 0x1f80) & ~0x3f);
+  if (in.l256) {
+    emu_256[in.op][in.type](&dst, &src);
+  } else {
+    emu_128[in.op][in.type](&dst, &src);
+  }
+  set_mxcsr(old_mxcsr);
+
+  // write back
+  memcpy(&uc->uc_mcontext.fpregs->_xmm[in.reg], dst.b, 16);
+  if (in.vex) {
+    if (in.l256) {
+      memcpy(ymm_hi + in.reg * 16, dst.b + 16, 16);
+    } else {
+      memset(ymm_hi + in.reg * 16, 0, 16);
+    }
+    *xstate_bv |= XFEATURE_YMM;
+    if (zmm_hi) {
+      memset(zmm_hi + in.reg * 32, 0, 32);
+    }
+  }
+
+  uc->uc_mcontext.gregs[REG_RIP] += in.len;
+
+  DEBUG("emulated instruction (op %d type %d%s%s) of length %d\n", in.op, in.type,
+      in.vex ? " vex" : "", in.l256 ? " 256" : "", in.len);
+
+  return 0;
+}
+
+#else
+
+int arch_emulate_instruction(ucontext_t *uc) { return -1; }
+
+#endif
+
+
 int arch_process_init(void) {
   DEBUG("x64 process init\n");
+#if CONFIG_INSTRUCTION_EMULATION
+  emu_init();
+#endif
   return 0;
 }
 
@@ -300,3 +744,30 @@ int arch_thread_init(ucontext_t *uc) {
 }
 
 void arch_thread_deinit(void) { DEBUG("x64 thread deinit\n"); }
+
+// trap mode (TF) is never set outside of a handler, so there
+// is nothing to undo in rflags
+int arch_thread_init_direct(const fpspy_round_config_t *round_config, uint64_t *state) {
+  uint32_t mxcsr;
+
+  if (arch_thread_init(0)) {
+    return -1;
+  }
+
+  mxcsr = get_mxcsr();
+  mxcsr &= ~MXCSR_FLAG_MASK;
+  mxcsr &= ~MXCSR_MASK_MASK;
+  if (round_config) {
+    mxcsr &= ~MXCSR_ROUND_DAZ_FTZ_MASK;
+    mxcsr |= *round_config;
+  }
+  set_mxcsr(mxcsr);
+
+  if (state) {
+    *state = TRAP_MODE_OFF;
+  }
+
+  DEBUG("x64 thread directly initialized (mxcsr=0x%08x)\n", mxcsr);
+
+  return 0;
+}
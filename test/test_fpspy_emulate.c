@@ -0,0 +1,309 @@
+/*
+
+  Part of FPSpy
+
+  Test code for instruction emulation (x64)
+
+  Each case executes one trapping SSE/AVX arithmetic instruction in a
+  particular encoding (legacy, REX, VEX2, VEX3, 128/256 bit, register,
+  base+displacement, SIB, RIP-relative memory operands), under each
+  rounding mode, and with DAZ/FTZ, and prints the resulting register
+  contents in hex.   The output must be the same when run natively,
+  under FPSpy with emulation, and under FPSpy with single stepping
+  (FPSPY_EMULATE=no), which is what "make test_emulate" checks.
+
+  Copyright (c) 2017 Peter A. Dinda - see LICENSE
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef x64
+
+#define MXCSR_RC_SHIFT 13
+#define MXCSR_RC_MASK  (3 << MXCSR_RC_SHIFT)
+#define MXCSR_FTZ      (1 << 15)
+#define MXCSR_DAZ      (1 << 6)
+
+// numerators and denominators, chosen to raise every exception
+static double num_d[4] __attribute__((aligned(32))) = {1.0, 2.0, -1.0, 4.9e-324};
+static double den_d[4] __attribute__((aligned(32))) = {3.0, 0.0, 0.0, 3.0};
+static float num_f[8] __attribute__((aligned(32))) = {1.0f, 2.0f, -1.0f, 1e-45f, 1e38f, 5.0f, 0.0f, 7.0f};
+static float den_f[8] __attribute__((aligned(32))) = {3.0f, 0.0f, 0.0f, 3.0f, 1e-38f, 3.0f, 0.0f, 9.0f};
+static double neg_d[4] __attribute__((aligned(32))) = {-1.0, 2.0, -4.0, 3.0};
+static float nan_f[4] __attribute__((aligned(16))) = {__builtin_nanf(""), 1.0f, 2.0f, 3.0f};
+static double tiny_d[2] __attribute__((aligned(16))) = {1e-160, 1e-160};
+static double ones_d[4] __attribute__((aligned(32))) = {1.0, 1.0, 1.0, 1.0};
+// reached only RIP-relative
+static double three_d __attribute__((used)) = 3.0;
+
+static uint64_t out[4] __attribute__((aligned(32)));
+
+static void show(const char *name, int n) {
+  int i;
+
+  printf("%-28s", name);
+  for (i = 0; i < n; i++) {
+    printf(" %016lx", out[i]);
+  }
+  printf("\n");
+  memset(out, 0, sizeof(out));
+}
+
+static uint32_t get_mxcsr(void) {
+  uint32_t m;
+  __asm__ __volatile__("stmxcsr %0" : "=m"(m));
+  return m;
+}
+
+static void set_mxcsr(uint32_t m) { __asm__ __volatile__("ldmxcsr %0" : : "m"(m)); }
+
+// the legacy SSE encodings
+static void sse_cases(void) {
+  // F2 0F 5E C1, upper lane of the destination is kept
+  __asm__ __volatile__(
+      "movupd (%0), %%xmm0\n\t"
+      "movupd (%1), %%xmm1\n\t"
+      "divsd %%xmm1, %%xmm0\n\t"
+      "movupd %%xmm0, (%2)\n\t"
+      :
+      : "r"(num_d), "r"(den_d), "r"(out)
+      : "xmm0", "xmm1", "memory");
+  show("divsd xmm,xmm", 2);
+
+  // 66 45 0F 5E C1
+  __asm__ __volatile__(
+      "movupd (%0), %%xmm8\n\t"
+      "movupd (%1), %%xmm9\n\t"
+      "divpd %%xmm9, %%xmm8\n\t"
+      "movupd %%xmm8, (%2)\n\t"
+      :
+      : "r"(num_d + 2), "r"(den_d + 2), "r"(out)
+      : "xmm8", "xmm9", "memory");
+  show("divpd xmm8,xmm9 (rex)", 2);
+
+  // 0F 5E 50 disp8
+  __asm__ __volatile__(
+      "movups (%0), %%xmm2\n\t"
+      "divps 16(%0), %%xmm2\n\t"
+      "movups %%xmm2, (%1)\n\t"
+      :
+      : "r"(num_f), "r"(out)
+      : "xmm2", "memory");
+  show("divps disp8(base)", 2);
+
+  // F3 0F 5E 90 disp32
+  __asm__ __volatile__(
+      "movups (%0), %%xmm3\n\t"
+      "divss 0x100(%1), %%xmm3\n\t"
+      "movups %%xmm3, (%2)\n\t"
+      :
+      : "r"(num_f + 4), "r"((uintptr_t)(den_f + 4) - 0x100), "r"(out)
+      : "xmm3", "memory");
+  show("divss disp32(base)", 2);
+
+  // F2 0F 51 of a negative, invalid
+  __asm__ __volatile__(
+      "movupd (%0), %%xmm4\n\t"
+      "sqrtsd (%1), %%xmm4\n\t"
+      "movupd %%xmm4, (%2)\n\t"
+      :
+      : "r"(ones_d), "r"(neg_d), "r"(out)
+      : "xmm4", "memory");
+  show("sqrtsd (base)", 2);
+
+  // F2 0F 5E 1D disp32
+  __asm__ __volatile__(
+      "movupd (%0), %%xmm5\n\t"
+      "divsd three_d(%%rip), %%xmm5\n\t"
+      "movupd %%xmm5, (%1)\n\t"
+      :
+      : "r"(num_d), "r"(out)
+      : "xmm5", "memory");
+  show("divsd rip-relative", 2);
+
+  // F2 43 0F 5E 34 CC, SIB with REX.X and REX.B
+  __asm__ __volatile__(
+      "movupd (%0), %%xmm6\n\t"
+      "mov %1, %%r12\n\t"
+      "mov $1, %%r9\n\t"
+      "divsd (%%r12,%%r9,8), %%xmm6\n\t"
+      "movupd %%xmm6, (%2)\n\t"
+      :
+      : "r"(num_d + 1), "r"(den_d), "r"(out)
+      : "xmm6", "r9", "r12", "memory");
+  show("divsd (r12,r9,8)", 2);
+
+  // 66 0F 5E 44 C8 disp8, SIB with displacement
+  __asm__ __volatile__(
+      "movupd (%0), %%xmm7\n\t"
+      "mov $1, %%rcx\n\t"
+      "divpd -8(%1,%%rcx,8), %%xmm7\n\t"
+      "movupd %%xmm7, (%2)\n\t"
+      :
+      : "r"(num_d), "r"(den_d), "r"(out)
+      : "xmm7", "rcx", "memory");
+  show("divpd disp8(base,idx,8)", 2);
+
+  // F2 0F 5E 04 0D 00000000, SIB with no base
+  __asm__ __volatile__(
+      "movupd (%0), %%xmm0\n\t"
+      "mov %1, %%rcx\n\t"
+      "divsd 0(,%%rcx,1), %%xmm0\n\t"
+      "movupd %%xmm0, (%2)\n\t"
+      :
+      : "r"(num_d + 2), "r"(den_d + 2), "r"(out)
+      : "xmm0", "rcx", "memory");
+  show("divsd disp32(,idx,1)", 2);
+
+  // 0F 5F, max with a NaN is invalid
+  __asm__ __volatile__(
+      "movups (%0), %%xmm1\n\t"
+      "maxps (%1), %%xmm1\n\t"
+      "movups %%xmm1, (%2)\n\t"
+      :
+      : "r"(num_f), "r"(nan_f), "r"(out)
+      : "xmm1", "memory");
+  show("maxps nan", 2);
+
+  // F2 0F 59, underflows to a denormal, or to zero with FTZ
+  __asm__ __volatile__(
+      "movupd (%0), %%xmm2\n\t"
+      "mulsd 8(%0), %%xmm2\n\t"
+      "movupd %%xmm2, (%1)\n\t"
+      :
+      : "r"(tiny_d), "r"(out)
+      : "xmm2", "memory");
+  show("mulsd underflow", 2);
+
+  // F2 0F 58 of a denormal, which is zero with DAZ
+  __asm__ __volatile__(
+      "movupd (%0), %%xmm3\n\t"
+      "addsd 24(%1), %%xmm3\n\t"
+      "movupd %%xmm3, (%2)\n\t"
+      :
+      : "r"(ones_d), "r"(num_d), "r"(out)
+      : "xmm3", "memory");
+  show("addsd denormal", 2);
+}
+
+// the VEX encodings
+static void avx_cases(void) {
+  // C5 F3 5E D0, the destination above 128 bits is zeroed
+  __asm__ __volatile__(
+      "vmovupd (%3), %%ymm2\n\t"
+      "vmovupd (%0), %%xmm0\n\t"
+      "vmovupd (%1), %%xmm1\n\t"
+      "vdivsd %%xmm1, %%xmm0, %%xmm2\n\t"
+      "vmovupd %%ymm2, (%2)\n\t"
+      "vzeroupper\n\t"
+      :
+      : "r"(num_d), "r"(den_d), "r"(out), "r"(ones_d)
+      : "xmm0", "xmm1", "xmm2", "memory");
+  show("vdivsd (vex2)", 4);
+
+  // C5 F8 5E, 128 bit packed
+  __asm__ __volatile__(
+      "vmovupd (%3), %%ymm3\n\t"
+      "vmovups (%0), %%xmm4\n\t"
+      "vdivps (%1), %%xmm4, %%xmm3\n\t"
+      "vmovupd %%ymm3, (%2)\n\t"
+      "vzeroupper\n\t"
+      :
+      : "r"(num_f), "r"(den_f), "r"(out), "r"(ones_d)
+      : "xmm3", "xmm4", "memory");
+  show("vdivps xmm,mem (vex2)", 4);
+
+  // C5 FD 5E, 256 bit packed
+  __asm__ __volatile__(
+      "vmovupd (%0), %%ymm5\n\t"
+      "vmovupd (%1), %%ymm6\n\t"
+      "vdivpd %%ymm6, %%ymm5, %%ymm7\n\t"
+      "vmovupd %%ymm7, (%2)\n\t"
+      "vzeroupper\n\t"
+      :
+      : "r"(num_d), "r"(den_d), "r"(out)
+      : "xmm5", "xmm6", "xmm7", "memory");
+  show("vdivpd ymm (vex2)", 4);
+
+  // C4 01 2D 5E 1C C8, 256 bit with SIB, REX.X, REX.B, REX.R
+  __asm__ __volatile__(
+      "vmovupd (%0), %%ymm10\n\t"
+      "mov %1, %%r8\n\t"
+      "xor %%r9, %%r9\n\t"
+      "vdivpd (%%r8,%%r9,8), %%ymm10, %%ymm11\n\t"
+      "vmovupd %%ymm11, (%2)\n\t"
+      "vzeroupper\n\t"
+      :
+      : "r"(num_d), "r"(den_d), "r"(out)
+      : "xmm10", "xmm11", "r8", "r9", "memory");
+  show("vdivpd (r8,r9,8) (vex3)", 4);
+
+  // C4 41 7D 51, 256 bit unary, invalid
+  __asm__ __volatile__(
+      "vmovupd (%0), %%ymm12\n\t"
+      "vsqrtpd %%ymm12, %%ymm13\n\t"
+      "vmovupd %%ymm13, (%1)\n\t"
+      "vzeroupper\n\t"
+      :
+      : "r"(neg_d), "r"(out)
+      : "xmm12", "xmm13", "memory");
+  show("vsqrtpd ymm (vex3)", 4);
+
+  // C5 FB 5E 05 disp32, RIP-relative
+  __asm__ __volatile__(
+      "vmovupd (%2), %%ymm14\n\t"
+      "vmovupd (%0), %%xmm15\n\t"
+      "vdivsd three_d(%%rip), %%xmm15, %%xmm14\n\t"
+      "vmovupd %%ymm14, (%1)\n\t"
+      "vzeroupper\n\t"
+      :
+      : "r"(num_d), "r"(out), "r"(ones_d)
+      : "xmm14", "xmm15", "memory");
+  show("vdivsd rip-relative", 4);
+}
+
+static void all_cases(int avx) {
+  sse_cases();
+  if (avx) {
+    avx_cases();
+  }
+}
+
+int main(int argc, char *argv[]) {
+  static const char *rc_name[4] = {"nearest", "negative", "positive", "zero"};
+  uint32_t orig = get_mxcsr();
+  int avx = __builtin_cpu_supports("avx");
+  int rc;
+
+  printf("Hello from test_fpspy_emulate (%s)\n", avx ? "sse and avx" : "sse only");
+
+  // the exception masks are left as they are, as FPSpy has them
+  for (rc = 0; rc < 4; rc++) {
+    printf("rounding %s\n", rc_name[rc]);
+    set_mxcsr((orig & ~MXCSR_RC_MASK) | (rc << MXCSR_RC_SHIFT));
+    all_cases(avx);
+  }
+
+  printf("rounding nearest, ftz, daz\n");
+  set_mxcsr((orig & ~MXCSR_RC_MASK) | MXCSR_FTZ | MXCSR_DAZ);
+  all_cases(avx);
+
+  set_mxcsr(orig);
+
+  printf("Goodbye from test_fpspy_emulate\n");
+
+  return 0;
+}
+
+#else
+
+int main(int argc, char *argv[]) {
+  printf("test_fpspy_emulate only applies to x64\n");
+  return 0;
+}
+
+#endif
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+
+  Part of FPSpy
+
+  Produces a deterministic stream of floating point events, from a
+  handful of distinct instructions, so that the same run can be traced
+  in each trace format and the printed traces compared.
+
+  test_fpspy_trace [iterations] [running]
+
+  With "running", a second thread does the same, and is still raising
+  events when main returns, so that its trace is finished at exit.
+
+*/
+
+#define DEFAULT_ITERATIONS 20000
+
+static volatile double zero = 0.0;
+static volatile double one = 1.0;
+static volatile double three = 3.0;
+static volatile double huge = 1e300;
+static volatile double tiny = 1e-300;
+
+static volatile double sink;
+
+static void inexact(void) { sink = one / three; }
+
+static void divide_by_zero(void) { sink = one / zero; }
+
+static void invalid(void) { sink = zero / zero; }
+
+static void overflow(void) { sink = huge * huge; }
+
+static void underflow(void) { sink = tiny * tiny; }
+
+static void events(long iterations) {
+  long i;
+
+  for (i = 0; i < iterations; i++) {
+    inexact();
+    // vary the spacing of the rarer events so that records are not all alike
+    if (!(i % 3)) {
+      divide_by_zero();
+    }
+    if (!(i % 7)) {
+      invalid();
+    }
+    if (!(i % 11)) {
+      overflow();
+    }
+    if (!(i % 13)) {
+      underflow();
+    }
+  }
+}
+
+static volatile int running;
+
+static void *runner(void *arg) {
+  long iterations = *(long *)arg;
+
+  events(iterations);
+  running = 1;
+  while (1) {
+    events(1000);
+  }
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+  pthread_t tid;
+
+  printf("Hello from test_fpspy_trace (%ld iterations)\n", iterations);
+
+  if (argc > 2 && !strcmp(argv[2], "running")) {
+    if (pthread_create(&tid, 0, runner, &iterations)) {
+      perror("pthread_create");
+      return -1;
+    }
+    events(iterations);
+    while (!running) {
+    }
+  } else {
+    events(iterations);
+  }
+
+  // a running thread is left running
+  printf("Goodbye from test_fpspy_trace\n");
+
+  return 0;
+}